@@ -0,0 +1,1432 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "tinygc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using TinyGC::GarbageCollector;
+using TinyGC::GCAllocatorType;
+using TinyGC::GCObject;
+using TinyGC::GCValue;
+using TinyGC::GCRootPtr;
+using TinyGC::GCField;
+using TinyGC::make_root_ptr;
+using TinyGC::GCThreadScope;
+
+typedef std::chrono::steady_clock Clock;
+
+static double millisecondsSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// the collector measures with the same clock
+static double lastPauseMs(const TinyGC::GCStatistics &last) {
+    return std::chrono::duration<double, std::milli>(Clock::duration(last.elapsedTime)).count();
+}
+
+static double lastMarkMs(const TinyGC::GCStatistics &last) {
+    return std::chrono::duration<double, std::milli>(Clock::duration(last.markTime)).count();
+}
+
+// high-water resident set of the process, select a single workload to attribute it
+static std::size_t peakRSSKiB() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<std::size_t>(usage.ru_maxrss) / 1024;   // in bytes
+#else
+    return static_cast<std::size_t>(usage.ru_maxrss);
+#endif
+#endif
+}
+
+// resident set of the process now, 0 where it is not available
+static std::size_t currentRSSKiB() {
+#ifdef __linux__
+    long pages = 0, resident = 0;
+    auto file = std::fopen("/proc/self/statm", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    if (std::fscanf(file, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    std::fclose(file);
+    return static_cast<std::size_t>(resident) * 4;
+#else
+    return 0;
+#endif
+}
+
+static double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[static_cast<std::size_t>(p * (samples.size() - 1))];
+}
+
+//===================================
+// * One line of results
+// * Aligned text, or a JSON object per line with --json
+//===================================
+static bool jsonOutput = false;
+
+class BenchLine {
+public:
+    BenchLine(const char *workload, const char *config) {
+        char buffer[64];
+        if (jsonOutput) {
+            text = std::string("{\"workload\": \"") + workload + "\", \"config\": \"" + config + "\"";
+        } else {
+            std::snprintf(buffer, sizeof(buffer), "%-14s %-12s", workload, config);
+            text = buffer;
+        }
+    }
+
+    BenchLine& add(const char *key, double value, int precision = 2) {
+        char buffer[64];
+        std::snprintf(buffer, sizeof(buffer), jsonOutput ? "%.*f" : "%10.*f", precision, value);
+        append(key, buffer, false);
+        return *this;
+    }
+
+    BenchLine& add(const char *key, const char *value) {
+        append(key, value, true);
+        return *this;
+    }
+
+    BenchLine& addPauses(const std::vector<double> &pauses) {
+        return add("collections", static_cast<double>(pauses.size()), 0)
+            .add("pause_max_ms", percentile(pauses, 1.0), 3)
+            .add("pause_p99_ms", percentile(pauses, 0.99), 3)
+            .add("pause_p50_ms", percentile(pauses, 0.5), 3);
+    }
+
+    void print() {
+        add("peak_rss_kib", static_cast<double>(peakRSSKiB()), 0);
+        std::printf("%s%s\n", text.c_str(), jsonOutput ? "}" : "");
+        std::fflush(stdout);
+    }
+
+private:
+    void append(const char *key, const char *value, bool quoted) {
+        if (jsonOutput) {
+            text = text + ", \"" + key + "\": " + (quoted ? "\"" : "") + value + (quoted ? "\"" : "");
+        } else {
+            text = text + "  " + key + " " + value;
+        }
+    }
+
+    std::string text;
+};
+
+//===================================
+// * Collector configuration under test
+//===================================
+struct BenchConfig {
+    const char *name;
+    GCAllocatorType allocator;
+    TinyGC::GCMarkMode markMode;
+    bool lazySweep;
+    bool generational;
+
+    void apply(GarbageCollector &gc) const {
+        gc.setMarkMode(markMode);
+        gc.setLazySweep(lazySweep);
+        gc.setGenerational(generational);
+    }
+};
+
+static const BenchConfig defaultConfig = { "default", GCAllocatorType::Default, TinyGC::GCMarkMode::Header, false, false };
+static const BenchConfig poolConfig = { "pool", GCAllocatorType::Pool, TinyGC::GCMarkMode::Header, false, false };
+static const BenchConfig bitmapConfig = { "bitmap", GCAllocatorType::Pool, TinyGC::GCMarkMode::Bitmap, false, false };
+static const BenchConfig lazyDefaultConfig = { "lazy", GCAllocatorType::Default, TinyGC::GCMarkMode::Header, true, false };
+static const BenchConfig lazyPoolConfig = { "lazy-pool", GCAllocatorType::Pool, TinyGC::GCMarkMode::Bitmap, true, false };
+static const BenchConfig generationalConfig = { "generational", GCAllocatorType::Pool, TinyGC::GCMarkMode::Bitmap, false, true };
+
+//===================================
+// * Records the pause of every collection the policy is asked about
+//===================================
+class RecordingPolicy : public TinyGC::GCDefaultPolicy {
+public:
+    explicit RecordingPolicy(std::vector<double> &pauses, double growthFactor = 2.0,
+        std::size_t minBudget = DefaultMinBudget)
+        : GCDefaultPolicy(growthFactor, minBudget), pauses(pauses), lastEnd(0) {}
+
+    std::size_t allocationBudget(const TinyGC::GCStatistics &last) override {
+        if (last.hasValue && last.endTime != lastEnd) {
+            lastEnd = last.endTime;
+            pauses.push_back(lastPauseMs(last));
+        }
+        return GCDefaultPolicy::allocationBudget(last);
+    }
+
+private:
+    std::vector<double> &pauses;
+    std::size_t lastEnd;
+};
+
+struct Point : public GCObject
+{
+    Point(GCValue<int> *x, GCValue<int> *y) : x(x), y(y) {}
+    GCValue<int> *x, *y;
+
+protected:
+    GCOBJECT(Point, GCObject, x, y)
+};
+
+struct TreeNode : public GCObject
+{
+    TreeNode(TreeNode *l, TreeNode *r) : left(l), right(r) {}
+    TreeNode *left, *right;
+
+protected:
+    GCOBJECT(TreeNode, GCObject, left, right)
+};
+
+struct ListNode : public GCObject
+{
+    explicit ListNode(ListNode *n) : next(n) {}
+    ListNode *next;
+
+protected:
+    GCOBJECT(ListNode, GCObject, next)
+};
+
+static TreeNode* makeTree(GarbageCollector &gc, int depth) {
+    if (depth == 0) {
+        return gc.newObject<TreeNode>(nullptr, nullptr);
+    }
+    auto left = make_root_ptr(makeTree(gc, depth - 1));
+    auto right = makeTree(gc, depth - 1);
+    return gc.newObject<TreeNode>(left, right);
+}
+
+// children are replaced while incremental marking runs, so they are GCFields
+struct MutableNode : public GCObject
+{
+    MutableNode(MutableNode *l, MutableNode *r, GCValue<int> *v) : left(l), right(r), value(v) {}
+    GCField<MutableNode> left, right;
+    GCField<GCValue<int>> value;
+
+protected:
+    GCOBJECT(MutableNode, GCObject, left, right, value)
+};
+
+static MutableNode* makeMutableTree(GarbageCollector &gc, int depth, int value) {
+    auto v = make_root_ptr(gc.newValue<int>(value));
+    if (depth == 0) {
+        return gc.newObject<MutableNode>(nullptr, nullptr, v);
+    }
+    auto left = make_root_ptr(makeMutableTree(gc, depth - 1, value));
+    auto right = makeMutableTree(gc, depth - 1, value);
+    return gc.newObject<MutableNode>(left, right, v);
+}
+
+// every node below must hold `value`, dangling pointers show up here or in a sanitizer
+static std::size_t checkMutableTree(const MutableNode *node, int value) {
+    if (node == nullptr) {
+        return 0;
+    }
+    if (node->value->get() != value) {
+        std::fprintf(stderr, "corrupted tree node\n");
+        std::abort();
+    }
+    return 1 + checkMutableTree(node->left, value) + checkMutableTree(node->right, value);
+}
+
+//===================================
+// * Timings of one workload, summed over all rounds
+//===================================
+struct BenchResult {
+    BenchResult() : allocMs(0), collectMs(0), objects(0) {}
+    double allocMs;
+    double collectMs;
+    std::vector<double> pauses;
+    std::size_t objects;
+
+    void addPause(double ms) {
+        collectMs += ms;
+        pauses.push_back(ms);
+    }
+};
+
+static void report(const char *workload, const BenchConfig &config, const BenchResult &r) {
+    BenchLine(workload, config.name)
+        .add("alloc_ms", r.allocMs)
+        .add("collect_ms", r.collectMs)
+        .addPauses(r.pauses)
+        .add("alloc_mobj_s", r.objects / (r.allocMs * 1000.0), 1)
+        .add("throughput_mobj_s", r.objects / ((r.allocMs + r.collectMs) * 1000.0), 1)
+        .print();
+}
+
+// high churn of boxed ints, one in `keepEvery` survives each collection
+static BenchResult boxedChurn(const BenchConfig &config, int rounds, int perRound, int keepEvery) {
+    BenchResult r;
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    auto kept = make_root_ptr(gc.newContainer<std::vector<GCValue<int>*>>());
+    for (int round = 0; round < rounds; ++round) {
+        kept->get().clear();
+        auto start = Clock::now();
+        for (int i = 0; i < perRound; ++i) {
+            auto v = gc.newValue<int>(i);
+            if (i % keepEvery == 0) {
+                kept->get().push_back(v);
+            }
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        r.objects += perRound;
+    }
+    return r;
+}
+
+// small objects with children, all of them die young
+static BenchResult pointChurn(const BenchConfig &config, int rounds, int perRound) {
+    BenchResult r;
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    for (int round = 0; round < rounds; ++round) {
+        auto start = Clock::now();
+        for (int i = 0; i < perRound; ++i) {
+            gc.newObject<Point>(gc.newValue<int>(i), gc.newValue<int>(-i));
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        r.objects += perRound * 3;
+    }
+    return r;
+}
+
+// a large heap that stays alive, only a little garbage per collection
+static BenchResult mostlyLive(const BenchConfig &config, int rounds, int depth, int garbage) {
+    BenchResult r;
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    auto start = Clock::now();
+    auto tree = make_root_ptr(makeTree(gc, depth));
+    r.allocMs += millisecondsSince(start);
+    r.objects += (std::size_t(2) << depth) - 1;
+    for (int round = 0; round < rounds; ++round) {
+        start = Clock::now();
+        for (int i = 0; i < garbage; ++i) {
+            gc.newObject<TreeNode>(nullptr, nullptr);
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        r.objects += garbage;
+    }
+    return r;
+}
+
+// GCBench: short-lived binary trees built top-down and bottom-up next to a long-lived tree
+// and a large array, collections are triggered by the allocations themselves
+static void populate(GarbageCollector &gc, int depth, TreeNode *node) {
+    if (depth > 0) {
+        node->left = gc.newObject<TreeNode>(nullptr, nullptr);
+        node->right = gc.newObject<TreeNode>(nullptr, nullptr);
+        populate(gc, depth - 1, node->left);
+        populate(gc, depth - 1, node->right);
+    }
+}
+
+// every node is rooted while its sibling is built
+static TreeNode* makeRootedTree(GarbageCollector &gc, int depth) {
+    if (depth == 0) {
+        return gc.newObject<TreeNode>(nullptr, nullptr);
+    }
+    auto left = make_root_ptr(makeRootedTree(gc, depth - 1));
+    auto right = make_root_ptr(makeRootedTree(gc, depth - 1));
+    return gc.newObject<TreeNode>(left, right);
+}
+
+static void gcBench(const BenchConfig &config, int stretchDepth, int longLivedDepth, int maxDepth) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    BenchResult r;
+    gc.setPolicy(std::unique_ptr<TinyGC::GCPolicy>(new RecordingPolicy(r.pauses)));
+    gc.setAutoCollect(true);
+    auto treeSize = [](int depth) { return (std::size_t(2) << depth) - 1; };
+    auto start = Clock::now();
+    makeRootedTree(gc, stretchDepth);
+    r.objects += treeSize(stretchDepth);
+    auto longLived = make_root_ptr(gc.newObject<TreeNode>(nullptr, nullptr));
+    populate(gc, longLivedDepth, longLived);
+    auto array = make_root_ptr(gc.newValue<std::vector<double>>(500000));
+    for (std::size_t i = 0; i < array->get().size() / 2; ++i) {
+        array->get()[i] = 1.0 / (i + 1);
+    }
+    r.objects += treeSize(longLivedDepth) + 1;
+    for (int depth = 4; depth <= maxDepth; depth += 2) {
+        auto iterations = 2 * treeSize(stretchDepth) / treeSize(depth);
+        for (std::size_t i = 0; i < iterations; ++i) {
+            auto topDown = make_root_ptr(gc.newObject<TreeNode>(nullptr, nullptr));
+            populate(gc, depth, topDown);
+        }
+        for (std::size_t i = 0; i < iterations; ++i) {
+            makeRootedTree(gc, depth);
+        }
+        r.objects += 2 * iterations * treeSize(depth);
+    }
+    double totalMs = millisecondsSince(start);
+    if (longLived->left == nullptr || array->get()[1000] != 1.0 / 1001) {
+        std::fprintf(stderr, "corrupted long-lived data\n");
+        std::abort();
+    }
+    for (auto ms : r.pauses) {
+        r.collectMs += ms;
+    }
+    r.allocMs = totalMs - r.collectMs;
+    report("gcbench", config, r);
+}
+
+// a long linked list stays alive, its marking goes one node deep at a time
+static BenchResult linkedList(const BenchConfig &config, int rounds, int length, int garbage) {
+    BenchResult r;
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    auto start = Clock::now();
+    GCRootPtr<ListNode> head(&gc);
+    for (int i = 0; i < length; ++i) {
+        head = gc.newObject<ListNode>(head.get());
+    }
+    r.allocMs += millisecondsSince(start);
+    r.objects += length;
+    for (int round = 0; round < rounds; ++round) {
+        start = Clock::now();
+        for (int i = 0; i < garbage; ++i) {
+            gc.newObject<ListNode>(nullptr);
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        r.objects += garbage;
+    }
+    return r;
+}
+
+// a random graph: the left edges link all nodes into a cycle of random order and the right
+// edges point anywhere, so marking jumps over the heap and the mark stack grows deep;
+// a tenth of the right edges is redirected to new nodes every round
+static BenchResult randomGraph(const BenchConfig &config, int rounds, int nodeNum) {
+    BenchResult r;
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> pick(0, nodeNum - 1);
+    auto start = Clock::now();
+    std::vector<TreeNode*> nodes;   // all of them stay reachable through the cycle
+    std::vector<int> order;
+    for (int i = 0; i < nodeNum; ++i) {
+        nodes.push_back(gc.newObject<TreeNode>(nullptr, nullptr));
+        order.push_back(i);
+    }
+    std::shuffle(order.begin(), order.end(), random);
+    for (int i = 0; i < nodeNum; ++i) {
+        nodes[order[i]]->left = nodes[order[(i + 1) % nodeNum]];
+        nodes[order[i]]->right = nodes[pick(random)];
+    }
+    GCRootPtr<TreeNode> root(nodes[0]);
+    r.allocMs += millisecondsSince(start);
+    r.objects += nodeNum;
+    for (int round = 0; round < rounds; ++round) {
+        start = Clock::now();
+        for (int i = 0; i < nodeNum / 10; ++i) {
+            auto node = gc.newObject<TreeNode>(nodes[pick(random)], nodes[pick(random)]);
+            nodes[pick(random)]->right = node;  // the node it replaces may become garbage
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        r.objects += nodeNum / 10;
+    }
+    return r;
+}
+
+// an adjacency table, rows of `degree` neighbours of which every other one is null,
+// stored as GCArray or GCContainer<std::vector>; every round rebuilds a tenth of the rows
+static void adjacency(const BenchConfig &config, bool arrays, int rounds, int rowNum, int degree) {
+    BenchResult r;
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> pick(0, rowNum - 1);
+    auto nodes = make_root_ptr(gc.newArray<GCValue<int>*>(rowNum));
+    auto rows = make_root_ptr(gc.newArray<GCObject*>(rowNum));
+    for (int i = 0; i < rowNum; ++i) {
+        (*nodes)[i] = gc.newValue<int>(i);
+    }
+    auto makeRow = [&]() -> GCObject* {
+        if (arrays) {
+            auto row = gc.newArray<GCValue<int>*>(degree);
+            for (int k = 1; k < degree; k += 2) {
+                (*row)[k] = (*nodes)[pick(random)];
+            }
+            return row;
+        }
+        auto row = gc.newContainer<std::vector<GCValue<int>*>>(degree, nullptr);
+        for (int k = 1; k < degree; k += 2) {
+            row->get()[k] = (*nodes)[pick(random)];
+        }
+        return row;
+    };
+    auto start = Clock::now();
+    for (int i = 0; i < rowNum; ++i) {
+        (*rows)[i] = makeRow();
+    }
+    r.allocMs += millisecondsSince(start);
+    r.objects += rowNum;
+    for (int round = 0; round < rounds; ++round) {
+        start = Clock::now();
+        for (int i = 0; i < rowNum / 10; ++i) {
+            (*rows)[pick(random)] = makeRow();
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        r.objects += rowNum / 10;
+    }
+    BenchLine("adjacency", config.name)
+        .add("rows", arrays ? "array" : "vector")
+        .add("alloc_ms", r.allocMs)
+        .add("collect_ms", r.collectMs)
+        .addPauses(r.pauses)
+        .print();
+}
+
+// a container with a huge fan-out, half of its elements are replaced every round,
+// the children of one object overflow the mark stack
+static BenchResult fanOut(const BenchConfig &config, int rounds, int width) {
+    BenchResult r;
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    auto start = Clock::now();
+    auto container = make_root_ptr(gc.newContainer<std::vector<TreeNode*>>());
+    for (int i = 0; i < width; ++i) {
+        container->get().push_back(gc.newObject<TreeNode>(nullptr, nullptr));
+    }
+    r.allocMs += millisecondsSince(start);
+    r.objects += width;
+    for (int round = 0; round < rounds; ++round) {
+        start = Clock::now();
+        for (int i = round % 2; i < width; i += 2) {
+            container->get()[i] = gc.newObject<TreeNode>(nullptr, nullptr);
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        r.objects += width / 2;
+    }
+    return r;
+}
+
+// many root pointers, a tenth of them retargeted and a batch of temporary ones every round
+static BenchResult manyRoots(const BenchConfig &config, int rounds, int rootNum) {
+    BenchResult r;
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    std::vector<GCRootPtr<GCValue<int>>> roots;
+    roots.reserve(rootNum);
+    auto start = Clock::now();
+    for (int i = 0; i < rootNum; ++i) {
+        roots.emplace_back(gc.newValue<int>(i));
+    }
+    r.allocMs += millisecondsSince(start);
+    r.objects += rootNum;
+    for (int round = 0; round < rounds; ++round) {
+        start = Clock::now();
+        for (int i = round % 10; i < rootNum; i += 10) {
+            roots[i] = gc.newValue<int>(i);
+        }
+        {
+            std::vector<GCRootPtr<GCValue<int>>> temporary;
+            temporary.reserve(rootNum / 10);
+            for (int i = 0; i < rootNum / 10; ++i) {
+                temporary.emplace_back(gc.newValue<int>(-i));
+            }
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        r.objects += 2 * (rootNum / 10);
+    }
+    return r;
+}
+
+// a large live tree whose subtrees are replaced while the collector runs,
+// a cycle starts every `period` steps, budget 0 means stop-the-world collect()
+static void incrementalLatency(const BenchConfig &config, std::chrono::microseconds budget,
+        int depth, int steps, int period) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    auto tree = make_root_ptr(makeMutableTree(gc, depth, 7));
+    std::mt19937 random(42);
+    std::vector<double> pauses;
+    std::size_t cycles = 0;
+    auto total = Clock::now();
+    for (int step = 0; step < steps; ++step) {
+        MutableNode *node = tree;
+        for (int d = 0; d < depth - 5; ++d) {
+            node = (random() & 1) ? node->left : node->right;
+        }
+        // the replaced subtree becomes garbage
+        if (random() & 1) {
+            node->left = makeMutableTree(gc, 5, 7);
+        } else {
+            node->right = makeMutableTree(gc, 5, 7);
+        }
+        for (int i = 0; i < 200; ++i) {
+            gc.newValue<int>(i);
+        }
+        auto start = Clock::now();
+        bool completed = false;
+        if (budget.count() == 0) {
+            if (step % period == 0) {
+                gc.collect();
+                completed = true;
+            }
+        } else if (gc.isMarking()) {
+            completed = gc.checkPoint(budget);
+        } else if (step % period == 0) {
+            gc.startMarking();
+        }
+        double ms = millisecondsSince(start);
+        if (completed || gc.isMarking()) {
+            pauses.push_back(ms);
+        }
+        cycles += completed;
+    }
+    double totalMs = millisecondsSince(total);
+    auto nodes = checkMutableTree(tree, 7);
+    BenchLine("incremental", config.name)
+        .add("budget_us", static_cast<double>(budget.count()), 0)
+        .add("cycles", static_cast<double>(cycles), 0)
+        .addPauses(pauses)
+        .add("total_ms", totalMs, 1)
+        .add("live_nodes", static_cast<double>(nodes), 0)
+        .print();
+}
+
+// a large live tree with young garbage and a few replaced subtrees,
+// a collection every `period` steps, minor ones with generational collection except every `majorEvery`-th
+static void generationalLatency(const BenchConfig &config, int depth, int steps, int period, int majorEvery) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    auto tree = make_root_ptr(makeMutableTree(gc, depth, 7));
+    std::mt19937 random(42);
+    std::vector<double> pauses;
+    std::size_t minor = 0, promoted = 0;
+    auto total = Clock::now();
+    for (int step = 0; step < steps; ++step) {
+        MutableNode *node = tree;
+        for (int d = 0; d < depth - 3; ++d) {
+            node = (random() & 1) ? node->left : node->right;
+        }
+        if (random() & 1) {
+            node->left = makeMutableTree(gc, 3, 7);
+        } else {
+            node->right = makeMutableTree(gc, 3, 7);
+        }
+        for (int i = 0; i < 200; ++i) {
+            gc.newValue<int>(i);
+        }
+        if (step % period == 0) {
+            auto start = Clock::now();
+            if (gc.isGenerational() && (step / period) % majorEvery != 0) {
+                gc.collectMinor();
+            } else {
+                gc.collect();
+            }
+            pauses.push_back(millisecondsSince(start));
+            minor += gc.getLastGC().minor;
+            promoted += gc.getLastGC().promoted;
+        }
+    }
+    double totalMs = millisecondsSince(total);
+    auto nodes = checkMutableTree(tree, 7);
+    BenchLine("generational", config.name)
+        .addPauses(pauses)
+        .add("minor", static_cast<double>(minor), 0)
+        .add("promoted", static_cast<double>(promoted), 0)
+        .add("total_ms", totalMs, 1)
+        .add("live_nodes", static_cast<double>(nodes), 0)
+        .print();
+}
+
+// stop-the-world marking on 1 to `maxThreads` threads, a wide graph of many small trees
+// hanging from one container and a deep one of a single large tree
+static void markScaling(const BenchConfig &config, unsigned maxThreads, int rounds) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    auto wide = make_root_ptr(gc.newContainer<std::vector<TreeNode*>>());
+    for (int i = 0; i < 20000; ++i) {
+        wide->get().push_back(makeTree(gc, 5));
+    }
+    auto deep = make_root_ptr(makeTree(gc, 20));
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+        gc.setMarkThreads(threads);
+        std::vector<double> pauses;
+        for (int round = 0; round < rounds; ++round) {
+            auto start = Clock::now();
+            gc.collect();
+            pauses.push_back(millisecondsSince(start));
+        }
+        BenchLine("mark-scaling", config.name)
+            .add("threads", threads, 0)
+            .addPauses(pauses)
+            .add("pause_min_ms", percentile(pauses, 0.0), 3)
+            .add("live", static_cast<double>(gc.getLastGC().notCollected), 0)
+            .print();
+    }
+}
+
+// dead strings and vectors whose destructors free memory, run in the pause or on a background thread
+static void finalizationPause(const BenchConfig &config, bool background, int rounds, int perRound) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    gc.setBackgroundFinalization(background);
+    std::vector<double> pauses;
+    std::size_t maxBacklog = 0;
+    auto total = Clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (int i = 0; i < perRound; ++i) {
+            gc.newValue<std::string>(200, 'x');
+            gc.newContainer<std::vector<TreeNode*>>(16, nullptr);
+        }
+        auto start = Clock::now();
+        gc.collect();
+        pauses.push_back(millisecondsSince(start));
+        maxBacklog = std::max(maxBacklog, gc.getFinalizationBacklog());
+    }
+    gc.waitFinalization();
+    BenchLine("finalization", config.name)
+        .add("finalizer", background ? "background" : "pause")
+        .addPauses(pauses)
+        .add("max_backlog", static_cast<double>(maxBacklog), 0)
+        .add("total_ms", millisecondsSince(total), 1)
+        .print();
+}
+
+// boxed churn on `threads` threads, one shared heap or a heap per thread
+static void sharedThroughput(bool shared, unsigned threads, int perThread) {
+    GarbageCollector sharedGC(GCAllocatorType::Pool);
+    sharedGC.setSharedHeap(true);
+    auto churn = [perThread](GarbageCollector &gc) {
+        GCThreadScope scope(gc);
+        auto kept = make_root_ptr(gc.newContainer<std::vector<GCValue<int>*>>());
+        for (int i = 0; i < perThread; ++i) {
+            auto v = gc.newValue<int>(i);
+            if (i % 100 == 0) {
+                kept->get().push_back(v);
+            }
+            if (i % 10000 == 0) {
+                gc.checkPoint();
+            }
+        }
+    };
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned k = 0; k < threads; ++k) {
+        workers.emplace_back([&] {
+            if (shared) {
+                churn(sharedGC);
+            } else {
+                GarbageCollector gc(GCAllocatorType::Pool);
+                churn(gc);
+            }
+        });
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    double ms = millisecondsSince(start);
+    BenchLine("threads", shared ? "shared" : "per-thread")
+        .add("threads", threads, 0)
+        .add("total_ms", ms, 1)
+        .add("alloc_mobj_s", threads * static_cast<double>(perThread) / (ms * 1000.0), 1)
+        .print();
+}
+
+// a heap per thread, bursts of boxed garbage below the allocation budget between idle periods
+// in a safe region; in a group, heaps parked with a MiB allocated are collected in the background
+static void idleHeaps(bool grouped, unsigned threads, int rounds, int perBurst) {
+    TinyGC::GCGroup group(2);
+    group.setIdleThreshold(1024 * 1024);
+    std::vector<std::size_t> idleBytes(threads), collections(threads);
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned k = 0; k < threads; ++k) {
+        workers.emplace_back([&, k] {
+            GarbageCollector gc(GCAllocatorType::Pool);
+            if (grouped) {
+                group.add(gc);
+            }
+            auto kept = make_root_ptr(gc.newContainer<std::vector<GCValue<int>*>>());
+            for (int round = 0; round < rounds; ++round) {
+                for (int i = 0; i < perBurst; ++i) {
+                    auto v = gc.newValue<int>(i);
+                    if (i % 1000 == 0) {
+                        kept->get().push_back(v);
+                    }
+                    if (i % 10000 == 0) {
+                        gc.checkPoint();
+                    }
+                }
+                TinyGC::GCSafeRegion idle(gc);
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+            idleBytes[k] = gc.getHeapBytes();
+            collections[k] = gc.getTotals().collections;
+        });
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+    double ms = millisecondsSince(start);
+    std::size_t bytes = 0, num = 0;
+    for (unsigned k = 0; k < threads; ++k) {
+        bytes += idleBytes[k];
+        num += collections[k];
+    }
+    BenchLine("group", grouped ? "grouped" : "alone")
+        .add("threads", threads, 0)
+        .add("total_ms", ms, 1)
+        .add("collections", static_cast<double>(num), 0)
+        .add("background", static_cast<double>(group.getStatistics().backgroundCollections), 0)
+        .add("idle_heap_kib", bytes / 1024.0, 0)
+        .print();
+}
+
+// boxed churn over a live tree, collections paced by GCDefaultPolicy with `growthFactor`,
+// from the allocations themselves or from a checkPoint() every 1000 allocations
+static void allocationPacing(const BenchConfig &config, double growthFactor, bool autoCollect, int allocations) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    std::vector<double> pauses;
+    gc.setPolicy(std::unique_ptr<TinyGC::GCPolicy>(new RecordingPolicy(pauses, growthFactor, 1024 * 1024)));
+    gc.setAutoCollect(autoCollect);
+    auto tree = make_root_ptr(makeTree(gc, 16));
+    auto kept = make_root_ptr(gc.newContainer<std::vector<GCValue<int>*>>());
+    std::size_t peakBytes = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < allocations; ++i) {
+        auto v = gc.newValue<int>(i);
+        if (i % 1000 == 0) {
+            kept->get().clear();
+            if (!autoCollect) {
+                gc.checkPoint();
+            }
+        }
+        if (i % 10 == 0) {
+            kept->get().push_back(v);
+        }
+        peakBytes = std::max(peakBytes, gc.getHeapBytes());
+    }
+    BenchLine("pacing", config.name)
+        .add("growth", growthFactor, 1)
+        .add("trigger", autoCollect ? "auto" : "checkpoint")
+        .addPauses(pauses)
+        .add("peak_heap_kib", peakBytes / 1024.0, 1)
+        .add("total_ms", millisecondsSince(start), 1)
+        .print();
+}
+
+// hot functions holding a temporary root for each of 8 values
+static int sumWithRoots(GarbageCollector &, GCValue<int> *const *values) {
+    int sum = 0;
+    for (int k = 0; k < 8; ++k) {
+        auto root = make_root_ptr(values[k]);
+        sum += *root;
+    }
+    return sum;
+}
+
+static int sumWithCopiedRoots(GarbageCollector &, GCValue<int> *const *values) {
+    int sum = 0;
+    for (int k = 0; k < 8; ++k) {
+        auto root = make_root_ptr(values[k]);
+        GCRootPtr<GCValue<int>> copy(root);
+        sum += *copy;
+    }
+    return sum;
+}
+
+static int sumWithMovedRoots(GarbageCollector &, GCValue<int> *const *values) {
+    int sum = 0;
+    for (int k = 0; k < 8; ++k) {
+        auto root = make_root_ptr(values[k]);
+        GCRootPtr<GCValue<int>> moved(std::move(root));
+        sum += *moved;
+    }
+    return sum;
+}
+
+static int sumWithHandles(GarbageCollector &gc, GCValue<int> *const *values) {
+    TinyGC::GCHandleScope scope(gc);
+    int sum = 0;
+    for (int k = 0; k < 8; ++k) {
+        auto handle = scope.handle(values[k]);
+        sum += *handle;
+    }
+    return sum;
+}
+
+static volatile long long rootSink;     // keeps the sums of the hot functions
+
+// creation and destruction of roots, and a collection scanning `liveNum` of them,
+// handles if `handles` and root pointers otherwise
+static void rootCost(const char *kind, int (*hot)(GarbageCollector&, GCValue<int> *const*),
+        int calls, int liveNum, bool handles) {
+    GarbageCollector gc(GCAllocatorType::Pool);
+    GCValue<int> *values[8];
+    for (int k = 0; k < 8; ++k) {
+        values[k] = gc.newValue<int>(k);
+    }
+    TinyGC::GCHandleScope scope(gc);    // keeps the values
+    for (auto v : values) {
+        scope.handle(v);
+    }
+    long long sum = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < calls; ++i) {
+        sum += hot(gc, values);
+    }
+    double hotMs = millisecondsSince(start);
+    rootSink = sum;
+
+    std::vector<GCRootPtr<GCValue<int>>> roots;
+    for (int i = 0; i < liveNum; ++i) {
+        auto v = gc.newValue<int>(i);
+        if (handles) {
+            scope.handle(v);
+        } else {
+            roots.push_back(make_root_ptr(v));
+        }
+    }
+    start = Clock::now();
+    gc.collect();
+    double collectMs = millisecondsSince(start);
+    BenchLine("roots", kind)
+        .add("ns_per_root", hotMs * 1e6 / (calls * 8.0), 2)
+        .add("collect_ms", collectMs)
+        .print();
+}
+
+// the children are plain locals found by the stack scan
+static TreeNode* makeScannedTree(GarbageCollector &gc, int depth) {
+    if (depth == 0) {
+        return gc.newObject<TreeNode>(nullptr, nullptr);
+    }
+    TreeNode *left = makeScannedTree(gc, depth - 1);
+    TreeNode *right = makeScannedTree(gc, depth - 1);
+    return gc.newObject<TreeNode>(left, right);
+}
+
+// trees built while automatic collections run, their temporaries held by root pointers
+// against plain locals of a scanned stack
+static void stackRoots(bool scan, int depth, int trees) {
+    GarbageCollector gc(GCAllocatorType::Pool);
+    gc.setAutoCollect(true);
+    gc.setStackScan(scan);
+    if (scan && !gc.isStackScan()) {
+        return;                         // not supported here
+    }
+    GCRootPtr<TreeNode> last(&gc);
+    auto start = Clock::now();
+    for (int i = 0; i < trees; ++i) {
+        last = scan ? makeScannedTree(gc, depth) : makeRootedTree(gc, depth);
+    }
+    double totalMs = millisecondsSince(start);
+    auto totals = gc.getTotals();
+    BenchLine("stack-roots", scan ? "stack-scan" : "root-ptr")
+        .add("total_ms", totalMs)
+        .add("collections", static_cast<double>(totals.collections), 0)
+        .add("pause_ms", std::chrono::duration<double, std::milli>(Clock::duration(totals.pauseTime)).count())
+        .print();
+}
+
+// a list that loses nine of every ten nodes leaves its pages sparse, compaction packs the
+// survivors into fewer pages; marking and the resident set before and after it
+static void compaction(const BenchConfig &config, int length, int keepEvery) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    GCRootPtr<ListNode> head(&gc);
+    for (int i = 0; i < length; ++i) {
+        head = gc.newObject<ListNode>(head.get());
+    }
+    for (auto node = head.get(); node != nullptr; node = node->next) {
+        auto next = node->next;
+        for (int k = 1; k < keepEvery && next != nullptr; ++k) {
+            next = next->next;
+        }
+        node->next = next;
+    }
+    gc.collect();
+    double markBefore = lastMarkMs(gc.getLastGC());
+    std::size_t rssBefore = currentRSSKiB();
+    auto start = Clock::now();
+    gc.compact();
+    double compactMs = millisecondsSince(start);
+    auto compacted = gc.getLastGC();
+    gc.collect();
+    BenchLine("compact", config.name)
+        .add("moved_mib", compacted.compactedBytes / (1024.0 * 1024.0))
+        .add("fragmentation", compacted.fragmentation, 3)
+        .add("compact_ms", compactMs)
+        .add("mark_before_ms", markBefore, 3)
+        .add("mark_after_ms", lastMarkMs(gc.getLastGC()), 3)
+        .add("rss_before_kib", static_cast<double>(rssBefore), 0)
+        .add("rss_after_kib", static_cast<double>(currentRSSKiB()), 0)
+        .print();
+}
+
+// a cache that keeps its values alive, emptied only by explicit eviction
+struct StrongCache : public GCObject
+{
+    std::unordered_map<int, GCValue<int>*> map;
+
+    void GCMarkAllChildren(TinyGC::GCMarker &marker) override {
+        for (auto &entry : map) {
+            marker.markObject(entry.second);
+        }
+    }
+};
+
+// lookups of random keys, a miss creates the value; only the last `inUse` values are
+// referenced elsewhere, a weak cache loses the others with the next collection
+static void cache(const BenchConfig &config, bool weak, int rounds, int lookups, int keyNum, int inUse) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> pick(0, keyNum - 1);
+    auto recent = make_root_ptr(gc.newArray<GCValue<int>*>(inUse));
+    GCRootPtr<StrongCache> strong(&gc);
+    GCRootPtr<TinyGC::GCWeakMap<int, GCValue<int>>> weakMap(&gc);
+    if (weak) {
+        weakMap = gc.newObject<TinyGC::GCWeakMap<int, GCValue<int>>>();
+    } else {
+        strong = gc.newObject<StrongCache>();
+    }
+    BenchResult r;
+    std::size_t misses = 0, peakHeap = 0, hits = 0;
+    for (int round = 0; round < rounds; ++round) {
+        auto start = Clock::now();
+        for (int i = 0; i < lookups; ++i) {
+            int key = pick(random);
+            GCValue<int> *value;
+            if (weak) {
+                value = weakMap->find(key);
+            } else {
+                auto found = strong->map.find(key);
+                value = found != strong->map.end() ? found->second : nullptr;
+            }
+            if (value == nullptr) {
+                value = gc.newValue<int>(key);
+                if (weak) {
+                    weakMap->set(key, value);
+                } else {
+                    strong->map[key] = value;
+                }
+                ++misses;
+            } else {
+                hits += (value->get() == key);
+            }
+            (*recent)[i % inUse] = value;
+        }
+        r.allocMs += millisecondsSince(start);
+        peakHeap = std::max(peakHeap, gc.getHeapBytes());
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+    }
+    BenchLine("cache", config.name)
+        .add("map", weak ? "weak" : "strong")
+        .add("entries", static_cast<double>(weak ? weakMap->size() : strong->map.size()), 0)
+        .add("hit_rate", hits / static_cast<double>(hits + misses), 3)
+        .add("peak_heap_kib", peakHeap / 1024.0, 0)
+        .add("lookup_ms", r.allocMs)
+        .add("collect_ms", r.collectMs)
+        .addPauses(r.pauses)
+        .print();
+}
+
+// buffers of 256 KiB to 4 MiB, a few kept at a time, among small objects that outlive them;
+// the resident set once every buffer is dead tells whether their memory went back to the system
+static void largeValues(const BenchConfig &config, std::size_t mapThreshold, int rounds, int perRound, int keep) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    gc.setMapThreshold(mapThreshold);
+    std::mt19937 random(42);
+    std::uniform_int_distribution<std::size_t> length(256 * 1024, 4 * 1024 * 1024);
+    auto buffers = make_root_ptr(gc.newArray<TinyGC::GCArray<char>*>(keep));
+    auto points = make_root_ptr(gc.newContainer<std::vector<Point*>>());
+    BenchResult r;
+    std::size_t largeBytes = 0;
+    for (int round = 0; round < rounds; ++round) {
+        auto start = Clock::now();
+        for (int i = 0; i < perRound; ++i) {
+            (*buffers)[(round * perRound + i) % keep] = gc.newArray<char>(length(random), 'x');
+            points->get().push_back(gc.newObject<Point>(gc.newValue<int>(i), nullptr));
+        }
+        r.allocMs += millisecondsSince(start);
+        r.objects += perRound;
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+        largeBytes = std::max(largeBytes, gc.getLastGC().largeBytes);
+    }
+    for (int i = 0; i < keep; ++i) {
+        (*buffers)[i] = nullptr;
+    }
+    gc.collect();
+    BenchLine("large-values", config.name)
+        .add("mapped", mapThreshold == SIZE_MAX ? "none" : "large")
+        .add("alloc_ms", r.allocMs)
+        .add("collect_ms", r.collectMs)
+        .add("large_mib", largeBytes / (1024.0 * 1024.0))
+        .add("small_kib", (gc.getHeapBytes() - gc.getLargeObjectBytes()) / 1024.0, 0)
+        .add("rss_dead_kib", static_cast<double>(currentRSSKiB()), 0)
+        .addPauses(r.pauses)
+        .print();
+}
+
+// values churn next to a large live tree, collections are due by the default policy, which lets
+// the heap double, or by a soft heap limit; then the tree dies and its empty pages go back
+// to the system from the second collection on
+static void heapLimit(const BenchConfig &config, std::size_t softLimit, int depth, int allocations) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    auto tree = make_root_ptr(makeTree(gc, depth));
+    auto kept = make_root_ptr(gc.newContainer<std::vector<GCValue<int>*>>());
+    gc.setHeapLimit(softLimit);
+    gc.setAutoCollect(true);
+    std::size_t peakBytes = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < allocations; ++i) {
+        auto v = gc.newValue<int>(i);
+        if (i % 1000 == 0) {
+            kept->get().clear();
+        }
+        if (i % 10 == 0) {
+            kept->get().push_back(v);
+        }
+        peakBytes = std::max(peakBytes, gc.getHeapBytes());
+    }
+    double churnMs = millisecondsSince(start);
+    std::size_t rssLive = currentRSSKiB();
+    tree = nullptr;
+    gc.collect();
+    gc.collect();
+    BenchLine("heap-limit", config.name)
+        .add("soft_limit_mib", softLimit / (1024.0 * 1024.0), 0)
+        .add("peak_heap_mib", peakBytes / (1024.0 * 1024.0))
+        .add("collections", static_cast<double>(gc.getTotals().collections), 0)
+        .add("churn_ms", churnMs, 1)
+        .add("rss_live_kib", static_cast<double>(rssLive), 0)
+        .add("rss_dead_kib", static_cast<double>(currentRSSKiB()), 0)
+        .add("decommitted_mib", gc.getTotals().decommittedBytes / (1024.0 * 1024.0))
+        .print();
+}
+
+// points churn next to a live tree without a profiler, then sampled at `sampleBytes`
+// with `stackDepth` frames; the pauses include the census of the tree
+static void heapProfile(const BenchConfig &config, std::size_t sampleBytes, std::size_t stackDepth, 
+        int depth, int rounds, int perRound) {
+    GarbageCollector gc(config.allocator);
+    config.apply(gc);
+    std::unique_ptr<TinyGC::GCHeapProfiler> profiler;
+    if (sampleBytes != 0) {
+        profiler.reset(new TinyGC::GCHeapProfiler(gc, sampleBytes, stackDepth));
+    }
+    auto tree = make_root_ptr(makeTree(gc, depth));
+    BenchResult r;
+    for (int round = 0; round < rounds; ++round) {
+        auto start = Clock::now();
+        for (int i = 0; i < perRound; ++i) {
+            gc.newObject<Point>(gc.newValue<int>(i), gc.newValue<int>(-i));
+        }
+        r.allocMs += millisecondsSince(start);
+        start = Clock::now();
+        gc.collect();
+        r.addPause(millisecondsSince(start));
+    }
+    BenchLine("heap-profile", config.name)
+        .add("sample_kib", sampleBytes / 1024.0, 0)
+        .add("stack_depth", static_cast<double>(stackDepth), 0)
+        .add("types", static_cast<double>(profiler != nullptr ? profiler->getCensus().size() : 0), 0)
+        .add("alloc_ms", r.allocMs)
+        .add("collect_ms", r.collectMs)
+        .addPauses(r.pauses)
+        .print();
+}
+
+static std::size_t countNodes(const TreeNode *node) {
+    return node == nullptr ? 0 : 1 + countNodes(node->left) + countNodes(node->right);
+}
+
+// a tree built at startup against the same tree loaded from a heap image: the load, the first
+// walk over its pages and a collection, which traces the built tree but not the loaded one
+static void heapImage(int depth) {
+    const char *path = "tinygc_bench.image";
+    GarbageCollector built(GCAllocatorType::Pool);
+    auto start = Clock::now();
+    auto tree = make_root_ptr(makeTree(built, depth));
+    double buildMs = millisecondsSince(start);
+    start = Clock::now();
+    try {
+        built.saveImage(path, { tree.get() });
+    } catch (const std::logic_error &) {
+        return;     // not supported here
+    }
+    double saveMs = millisecondsSince(start);
+    start = Clock::now();
+    built.collect();
+    double builtCollectMs = millisecondsSince(start);
+
+    GarbageCollector loaded(GCAllocatorType::Pool);
+    start = Clock::now();
+    auto roots = loaded.loadImage(path);
+    double loadMs = millisecondsSince(start);
+    start = Clock::now();
+    auto nodes = countNodes(static_cast<TreeNode*>(roots[0]));
+    double walkMs = millisecondsSince(start);
+    start = Clock::now();
+    loaded.collect();
+    double loadedCollectMs = millisecondsSince(start);
+    std::remove(path);
+    BenchLine("heap-image", "pool")
+        .add("nodes", static_cast<double>(nodes), 0)
+        .add("image_mib", loaded.getImageBytes() / (1024.0 * 1024.0))
+        .add("build_ms", buildMs)
+        .add("save_ms", saveMs)
+        .add("load_ms", loadMs)
+        .add("first_walk_ms", walkMs)
+        .add("built_collect_ms", builtCollectMs)
+        .add("loaded_collect_ms", loadedCollectMs)
+        .print();
+}
+
+// usage: tinygc_bench [--json] [workload...], all workloads by default
+int main(int argc, char **argv)
+{
+    const BenchConfig allocators[] = { defaultConfig, poolConfig };
+    const BenchConfig markModes[] = { defaultConfig, poolConfig, bitmapConfig };
+    unsigned maxThreads = std::max(4u, std::thread::hardware_concurrency());
+    std::vector<std::pair<std::string, std::function<void()>>> workloads = {
+        // boxed values have no destructor to run, pool pages sweep them a bitmap word at a time
+        { "boxed-churn", [&] {
+            for (auto &config : markModes) {
+                report("boxed-churn", config, boxedChurn(config, 20, 200000, 10));
+            }
+        } },
+        { "point-churn", [&] {
+            for (auto &config : allocators) {
+                report("point-churn", config, pointChurn(config, 20, 100000));
+            }
+        } },
+        { "mostly-live", [&] {
+            for (auto &config : markModes) {
+                report("mostly-live", config, mostlyLive(config, 20, 20, 10000));
+            }
+        } },
+        // with lazy sweeping the pause only marks, sweeping moves to the allocations
+        { "lazy-sweep", [&] {
+            const BenchConfig sweepModes[] = { defaultConfig, lazyDefaultConfig, bitmapConfig, lazyPoolConfig };
+            for (auto &config : sweepModes) {
+                report("lazy-sweep", config, pointChurn(config, 20, 100000));
+            }
+        } },
+        { "gcbench", [&] {
+            for (auto &config : markModes) {
+                gcBench(config, 18, 16, 16);
+            }
+        } },
+        { "linked-list", [&] {
+            for (auto &config : markModes) {
+                report("linked-list", config, linkedList(config, 20, 1000000, 100000));
+            }
+        } },
+        { "random-graph", [&] {
+            for (auto &config : markModes) {
+                report("random-graph", config, randomGraph(config, 20, 1000000));
+            }
+        } },
+        // inline arrays against vectors in containers
+        { "adjacency", [&] {
+            for (auto &config : markModes) {
+                adjacency(config, false, 20, 200000, 16);
+                adjacency(config, true, 20, 200000, 16);
+            }
+        } },
+        { "fan-out", [&] {
+            for (auto &config : markModes) {
+                report("fan-out", config, fanOut(config, 20, 1000000));
+            }
+        } },
+        { "many-roots", [&] {
+            for (auto &config : markModes) {
+                report("many-roots", config, manyRoots(config, 20, 200000));
+            }
+        } },
+        // temporary roots in the list of root pointers against handles of a scope
+        { "roots", [&] {
+            rootCost("root-ptr", sumWithRoots, 10000000, 1000000, false);
+            rootCost("root-copy", sumWithCopiedRoots, 10000000, 1000000, false);
+            rootCost("root-move", sumWithMovedRoots, 10000000, 1000000, false);
+            rootCost("handle", sumWithHandles, 10000000, 1000000, true);
+        } },
+        // temporaries of a recursive build in root pointers against a conservative stack scan
+        { "stack-roots", [&] {
+            stackRoots(false, 16, 40);
+            stackRoots(true, 16, 40);
+        } },
+        // pauses of stop-the-world collection against incremental slices
+        { "incremental", [&] {
+            incrementalLatency(defaultConfig, std::chrono::microseconds(0), 18, 20000, 1000);
+            incrementalLatency(lazyDefaultConfig, std::chrono::microseconds(500), 18, 20000, 1000);
+            incrementalLatency(bitmapConfig, std::chrono::microseconds(0), 18, 20000, 1000);
+            incrementalLatency(lazyPoolConfig, std::chrono::microseconds(500), 18, 20000, 1000);
+        } },
+        // minor collections only trace the young objects and the remembered set
+        { "generational", [&] {
+            generationalLatency(bitmapConfig, 18, 20000, 100, 20);
+            generationalLatency(generationalConfig, 18, 20000, 100, 20);
+        } },
+        // parallel marking, up to one thread per hardware thread and at least 4
+        { "mark-scaling", [&] {
+            markScaling(defaultConfig, maxThreads, 5);
+            markScaling(bitmapConfig, maxThreads, 5);
+        } },
+        // destructors moved out of the pause
+        { "finalization", [&] {
+            for (auto &config : allocators) {
+                finalizationPause(config, false, 20, 50000);
+                finalizationPause(config, true, 20, 50000);
+            }
+        } },
+        // collections due by allocated bytes, the heap may grow further with a larger factor
+        { "pacing", [&] {
+            for (double growth : { 1.5, 2.0, 4.0 }) {
+                allocationPacing(poolConfig, growth, false, 5000000);
+                allocationPacing(poolConfig, growth, true, 5000000);
+            }
+            allocationPacing(defaultConfig, 2.0, true, 5000000);
+        } },
+        // survivors of sparse pages moved together
+        { "compact", [&] {
+            compaction(poolConfig, 2000000, 10);
+            compaction(bitmapConfig, 2000000, 10);
+        } },
+        // large objects on pages mapped one by one against pages from malloc,
+        // mapped first as the memory malloc keeps adds to the resident set of the later runs
+        { "large-values", [&] {
+            largeValues(poolConfig, TinyGC::details::MapThreshold, 20, 50, 8);
+            largeValues(poolConfig, SIZE_MAX, 20, 50, 8);
+            largeValues(defaultConfig, SIZE_MAX, 20, 50, 8);
+        } },
+        // heap growth capped by a soft limit, empty pages decommitted
+        { "heap-limit", [&] {
+            for (auto &config : { poolConfig, bitmapConfig }) {
+                heapLimit(config, 0, 19, 5000000);
+                heapLimit(config, 64 * 1024 * 1024, 19, 5000000);
+            }
+        } },
+        // the cost of sampling allocations and of the census against no profiler
+        { "heap-profile", [&] {
+            for (auto &config : allocators) {
+                heapProfile(config, 0, 0, 18, 10, 300000);
+                heapProfile(config, 512 * 1024, 0, 18, 10, 300000);
+                heapProfile(config, 512 * 1024, 16, 18, 10, 300000);
+                heapProfile(config, 4 * 1024, 16, 18, 10, 300000);
+            }
+        } },
+        // a weak-valued cache bounded by the collections against one that keeps every entry
+        { "cache", [&] {
+            for (auto &config : allocators) {
+                cache(config, false, 10, 100000, 1000000, 10000);
+                cache(config, true, 10, 100000, 1000000, 10000);
+            }
+        } },
+        // allocation from claimed pages against a heap per thread
+        { "threads", [&] {
+            for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+                sharedThroughput(false, threads, 2000000);
+                sharedThroughput(true, threads, 2000000);
+            }
+        } },
+        // idle heaps collected by a group against heaps left to their own budgets,
+        // grouped first as the peak resident set only grows
+        { "group", [&] {
+            idleHeaps(true, maxThreads, 20, 50000);
+            idleHeaps(false, maxThreads, 20, 50000);
+        } },
+        // a tree built at startup against the same tree mapped from a heap image
+        { "heap-image", [&] {
+            heapImage(20);
+        } }
+    };
+
+    std::set<std::string> selected;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--json") == 0) {
+            jsonOutput = true;
+        } else {
+            selected.insert(argv[i]);
+        }
+    }
+    for (auto &name : selected) {
+        auto found = std::find_if(workloads.begin(), workloads.end(),
+            [&name](const std::pair<std::string, std::function<void()>> &w) { return w.first == name; });
+        if (found == workloads.end()) {
+            std::fprintf(stderr, "unknown workload %s\n", name.c_str());
+            return 1;
+        }
+    }
+    for (auto &workload : workloads) {
+        if (selected.empty() || selected.count(workload.first)) {
+            workload.second();
+        }
+    }
+    return 0;
+}
@@ -1,5 +1,14 @@
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 #include "tinygc.h"
 
@@ -147,6 +156,157 @@ TinyGC::GCRootPtr<Point> make_root_point(TinyGC::GarbageCollector &gc, int x, in
     return make_point(gc, x, y);
 }
 
+// allocates on another thread of a shared heap, false if kept values are corrupted
+bool churn_on_thread(TinyGC::GarbageCollector &gc) {
+    TinyGC::GCThreadScope scope(gc);
+    TinyGC::GCHandleScope handles(gc);
+    auto kept = TinyGC::make_root_ptr(gc.newContainer<std::vector<TinyGC::GCValue<int>*>>());
+    auto first = handles.handle(gc.newValue<int>(-1));
+    // found on the stack of this thread while the other one collects
+    auto unrooted = gc.isStackScan() ? gc.newValue<int>(-3) : nullptr;
+    TinyGC::GCWeakPtr<TinyGC::GCValue<int>> watch(&gc);
+    watch = unrooted;
+    for (int i = 0; i < 100000; ++i) {
+        auto v = gc.newValue<int>(i);
+        if (i % 100 == 0) {
+            kept->get().push_back(v);
+        }
+        if (i % 1000 == 0) {
+            gc.checkPoint();
+        }
+    }
+    for (std::size_t i = 0; i < kept->get().size(); ++i) {
+        if (*kept->get()[i] != static_cast<int>(i * 100)) {
+            return false;
+        }
+    }
+    return *first == -1 && (unrooted == nullptr || (!watch.expired() && *unrooted == -3));
+}
+
+// a heap of another thread in a group: collected by the group while its owner is parked,
+// then by its owner once the group heap limit asks for it, and again by its owner after
+// a collection by the group has thrown; false if kept values are corrupted
+bool collect_in_group(TinyGC::GCAllocatorType type, bool stackScan) {
+    TinyGC::GCGroup group(1);
+    group.setIdleThreshold(0);
+    bool intact = false;
+    std::thread owner([&group, type, stackScan, &intact] {
+        TinyGC::GarbageCollector gc(type);
+        gc.setStackScan(stackScan);
+        group.add(gc);
+        auto kept = TinyGC::make_root_ptr(gc.newValue<int>(7));
+        // the thread of the group finds it in the snapshot of this stack
+        auto unrooted = gc.isStackScan() ? gc.newValue<int>(8) : nullptr;
+        TinyGC::GCWeakPtr<TinyGC::GCValue<int>> watch(&gc);
+        watch = unrooted;
+        for (int i = 0; i < 10000; ++i) {
+            gc.newValue<int>(i);
+        }
+        {
+            TinyGC::GCSafeRegion idle(gc);
+            group.wait();
+        }
+        // stale words on a scanned stack may keep a few of the dropped values
+        bool parked = gc.getTotals().collections == 1 
+            && gc.getLastGC().collected >= (unrooted == nullptr ? 10000u : 9990u)
+            && (unrooted == nullptr || (!watch.expired() && *unrooted == 8));
+        group.setHeapLimit(1);
+        for (int i = 0; i < 100000; ++i) {
+            gc.newValue<int>(i);
+        }
+        intact = parked && gc.checkPoint() && *kept == 7;
+        bool thrown = false;
+        gc.addEventCallback([&thrown](TinyGC::GCEvent event, const TinyGC::GCStatistics &) {
+            if (event == TinyGC::GCEvent::CollectionStart && !thrown) {
+                thrown = true;
+                throw std::runtime_error("the first collection fails");
+            }
+        });
+        gc.newValue<int>(0);
+        {
+            TinyGC::GCSafeRegion idle(gc);
+            group.wait();
+        }
+        intact = intact && thrown && gc.checkPoint() && *kept == 7;
+    });
+    owner.join();
+    auto stats = group.getStatistics();
+    return intact && stats.members == 0 && stats.collections == 3 && stats.backgroundCollections == 1
+        && stats.failedCollections == 1 && stats.limitRequests >= 1;
+}
+
+// a pair of points and an array written to a heap image and loaded twice, at the address it was
+// laid out for and, as that is taken then, elsewhere; false if the loaded objects do not survive
+bool save_and_load_image(TinyGC::GarbageCollector &gc, TinyGC::GCArray<Point*> *pair, 
+        TinyGC::GCArray<int> *data, TinyGC::GCObject *container) {
+    std::string path = "tinygc_test_" 
+        + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".image";
+    bool rejected = false;
+    try {
+        gc.saveImage(path, { container });  // holds the buffer of a vector, or no pool
+    } catch (const std::logic_error &) {
+        rejected = true;
+    }
+    if (gc.getAllocatorType() != TinyGC::GCAllocatorType::Pool) {
+        return rejected;
+    }
+    try {
+        gc.saveImage(path, { pair, nullptr, data });
+    } catch (const std::logic_error &) {
+#ifdef TINYGC_RTTI
+        return false;
+#else
+        return rejected;    // heap images need RTTI
+#endif
+    }
+    auto first = gc.loadImage(path);
+    auto second = gc.loadImage(path);
+    // a type table entry whose vtable is not the one of its class, in a copy: the loaded pages map the file
+    bool damaged = false;
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream bytes;
+        bytes << in.rdbuf();
+        std::string image = bytes.str();
+        std::string vptr(sizeof(void*), '\0'), bogus(sizeof(void*), '\0');
+        std::memcpy(&vptr[0], (*pair)[1], vptr.size());
+        bogus[0] = 16;
+        image.replace(image.rfind(vptr), vptr.size(), bogus);
+        std::ofstream(path + ".damaged", std::ios::binary) << image;
+        try {
+            gc.loadImage(path + ".damaged");
+        } catch (const std::runtime_error &) {
+            damaged = true;
+        }
+        std::remove((path + ".damaged").c_str());
+    }
+    std::remove(path.c_str());
+    auto point = (*static_cast<TinyGC::GCArray<Point*>*>(second[0]))[1];
+    auto rooted = TinyGC::make_root_ptr(point);
+    auto mixed = TinyGC::make_root_ptr(gc.newObject<Point>(point->x, point->y));
+    TinyGC::GCWeakPtr<Point> watch(&gc);
+    watch = (*static_cast<TinyGC::GCArray<Point*>*>(first[0]))[1];
+    gc.collect();
+    gc.collectMinor();
+    gc.compact();
+    auto loadedData = static_cast<TinyGC::GCArray<int>*>(first[2]);
+    return rejected && damaged && first.size() == 3 && first[1] == nullptr && first[0] != second[0]
+        && rooted->to_string() == "(11, 12)" && mixed->to_string() == "(11, 12)" && !watch.expired()
+        && (*loadedData)[0] + (*loadedData)[19999] == 14 && gc.getImageBytes() >= 4 * 64 * 1024;
+}
+
+// with incremental marking, run zero-budget slices until the cycle completes
+bool check_point(TinyGC::GarbageCollector &gc, bool incremental) {
+    if (!incremental) {
+        return gc.checkPoint();
+    }
+    bool completed = gc.checkPoint(std::chrono::microseconds(0));
+    while (!completed && gc.isMarking()) {
+        completed = gc.checkPoint(std::chrono::microseconds(0));
+    }
+    return completed;
+}
+
 int main(int argc, char **argv)
 {
     using TinyGC::GCRootPtr;
@@ -154,7 +314,48 @@ int main(int argc, char **argv)
     using TinyGC::GCValue;
     using TinyGC::make_root_ptr;
     {
-        TinyGC::GarbageCollector gc;
+        // options run the same program on other collector configurations:
+        // "pool" for the page pool allocator, "bitmap" to keep the marks in page bitmaps,
+        // "lazy" for lazy sweeping, "incremental" for incremental marking,
+        // "generational" for minor collections of the young objects, "parallel" to mark on 4 threads,
+        // "background" to run destructors on a background thread,
+        // "shared" for a heap shared with another allocating thread,
+        // "compact" to compact the pool heap once it is fragmented,
+        // "stack" to scan the stacks for conservative roots
+        std::set<std::string> options(argv + 1, argv + argc);
+        bool generational = options.count("generational") > 0;
+        bool shared = options.count("shared") > 0;
+        bool compact = options.count("compact") > 0;
+        bool stack = options.count("stack") > 0;
+        TinyGC::GarbageCollector gc(options.count("pool") || options.count("bitmap") || generational || shared
+            || compact || stack ? TinyGC::GCAllocatorType::Pool : TinyGC::GCAllocatorType::Default);
+        if (options.count("bitmap")) {
+            gc.setMarkMode(TinyGC::GCMarkMode::Bitmap);
+        }
+        gc.setLazySweep(options.count("lazy") > 0);
+        gc.setGenerational(generational, 1);
+        gc.setMarkThreads(options.count("parallel") ? 4 : 1);
+        gc.setBackgroundFinalization(options.count("background") > 0);
+        gc.setSharedHeap(shared);
+        gc.setStackScan(stack);
+        // no budget before the first collection, so the first check point collects
+        gc.setPolicy(std::unique_ptr<TinyGC::GCPolicy>(new TinyGC::GCDefaultPolicy(2.0, 0)));
+        bool incremental = options.count("incremental") > 0;
+
+        // every collection, also those of the worker thread, starts and ends once
+        std::size_t started = 0, ended = 0, before = gc.getTotals().collections;
+        gc.addEventCallback([&started, &ended](TinyGC::GCEvent event, const TinyGC::GCStatistics &) {
+            ++(event == TinyGC::GCEvent::CollectionStart ? started : ended);
+        });
+        TinyGC::GCTraceRecorder trace(gc);
+        TinyGC::GCHeapProfiler profiler(gc, 4096, 8);
+
+        TinyGC::GCThreadScope attach(gc);
+        bool churned = true;
+        std::thread worker;
+        if (shared) {
+            worker = std::thread([&gc, &churned] { churned = churn_on_thread(gc); });
+        }
 
         // GCRootPtr<int> x = gc.newValue<int>(100);
         GCRootPtr<GCValue<int>> x = gc.newValue<int>(100);
@@ -195,11 +396,12 @@ int main(int argc, char **argv)
             vector->get().pop_back();
 
             // should delete original not_a_root, l1, p2, p4, vector[4], vector[5], obj, obj::base, obj->p0, obj->p1
-            if(gc.checkPoint()){  // collect
+            if(check_point(gc, incremental)){  // collect
                 println("Garbage Collector triggerred");
             } else {
                 println("Garbage Collector not triggerred");
             } 
+            gc.waitFinalization();  // keeps the output in order
             println("l3 = " + l2->to_string());
             println("l3 = " + l3->to_string());
             println("pod = " + pod->get().to_string());
@@ -209,7 +411,7 @@ int main(int argc, char **argv)
                 println("[" + std::to_string(i++) + "] = " + p->to_string());
             }
         }
-        if(gc.checkPoint()){
+        if(check_point(gc, incremental)){
             println("Garbage Collector triggerred");
         } else {
             println("Garbage Collector not triggerred");
@@ -218,6 +420,208 @@ int main(int argc, char **argv)
         println("p2 = " + p2->to_string());
         println("p3 = " + p3->to_string());  // to_string is not virtual
         println("p4 = " + p4->to_string());
+
+        if (worker.joinable()) {
+            TinyGC::GCSafeRegion region(gc);    // the worker may collect meanwhile
+            worker.join();
+        }
+        if (!churned) {
+            println("corrupted values on the worker thread");
+            return 1;
+        }
+        // relinking a moved-from root or weak pointer needs an attached thread, the assignment throws instead
+        if (shared) {
+            auto moved = make_root_ptr(gc.newValue<int>(11));
+            auto taken = std::move(moved);
+            bool threw = false;
+            std::thread([&] {
+                try {
+                    moved = taken;
+                } catch (const std::logic_error &) {
+                    threw = true;
+                }
+            }).join();
+            if (!threw || moved != nullptr) {
+                println("a moved-from root was relinked on an unattached thread");
+                return 1;
+            }
+            TinyGC::GCWeakPtr<GCValue<int>> watched(taken.get());
+            auto watching = std::move(watched);
+            threw = false;
+            std::thread([&] {
+                try {
+                    watched = taken.get();
+                } catch (const std::logic_error &) {
+                    threw = true;
+                }
+            }).join();
+            if (!threw || !watched.expired()) {
+                println("a moved-from weak pointer was registered on an unattached thread");
+                return 1;
+            }
+        }
+        if (!collect_in_group(gc.getAllocatorType(), gc.isStackScan())) {
+            println("the collector group did not collect its member");
+            return 1;
+        }
+        // a minor collection sweeps the nursery at once, also with lazy sweeping,
+        // so what it reports as live is what is left in the heap
+        if (gc.isGenerational() && !gc.isMarking()) {
+            for (int i = 0; i < 1000; ++i) {
+                gc.newValue<int>(i);
+            }
+            gc.collectMinor();
+            auto &last = gc.getLastGC();
+            if (!last.minor || last.liveBytes != gc.getHeapBytes() || last.collectedBytes == 0) {
+                println("a minor collection misreported the live bytes");
+                return 1;
+            }
+        }
+        // a value only held by a local survives when stacks are scanned, also by compact()
+        if (gc.isStackScan()) {
+            auto unrooted = gc.newValue<int>(9);
+            TinyGC::GCWeakPtr<GCValue<int>> watch(unrooted);
+            gc.collect();
+            gc.compact();
+            if (watch.expired() || watch.get() != unrooted || *unrooted != 9) {
+                println("a value held by a local was collected");
+                return 1;
+            }
+        }
+
+        // more gray objects than the first segment of the mark stack holds,
+        // interleaved with garbage that leaves their pages half empty
+        auto wide = make_root_ptr(gc.newContainer<std::vector<GCValue<int>*>>());
+        for (int i = 0; i < 5000; ++i) {
+            wide->get().push_back(gc.newValue<int>(i));
+            gc.newValue<int>(-i);
+        }
+        // arrays keep their elements inline, every third slot of the table is set and data is not traced
+        auto table = make_root_ptr(gc.newArray<GCValue<int>*>(3000));
+        for (std::size_t i = 0; i < table->size(); ++i) {
+            auto v = gc.newValue<int>(static_cast<int>(i));
+            if (i % 3 == 0) {
+                table->set(i, v);
+            }
+        }
+        auto pair = make_root_ptr(gc.newArray<Point*>(2));
+        pair->set(1, make_point(gc, 11, 12));
+        auto data = make_root_ptr(gc.newArray<int>(20000, 7));
+        // a length whose size in bytes wraps is refused before anything is written
+        bool refused = false;
+        try {
+            gc.newArray<double>(SIZE_MAX / sizeof(double));
+        } catch (const std::bad_alloc &) {
+            refused = true;
+        }
+        if (!refused) {
+            println("an array whose size wraps was allocated");
+            return 1;
+        }
+        // a large value on a page of its own, mapped from the system, the dropped one is unmapped
+        typedef std::array<char, 300000> Buffer;
+        auto big = make_root_ptr(gc.newValue<Buffer>());
+        big->get()[Buffer().size() - 1] = 'x';
+        gc.newValue<Buffer>();
+        // handles live until their scope ends, roots moved by a growing vector stay roots
+        TinyGC::GCHandleScope handles(gc);
+        auto handle = handles.handle(gc.newValue<int>(-1));
+        std::vector<GCRootPtr<GCValue<int>>> moved;
+        for (int i = 0; i < 100; ++i) {
+            moved.push_back(make_root_ptr(gc.newValue<int>(i)));
+        }
+        // weak references are cleared and weak entries removed once their objects are collected,
+        // an ephemeron keeps its value while the key is reachable
+        TinyGC::GCWeakPtr<GCValue<int>> dropped(gc.newValue<int>(-2)), kept(x.get());
+        auto cache = make_root_ptr(gc.newObject<TinyGC::GCWeakMap<int, GCValue<int>>>());
+        cache->set(1, x);
+        cache->set(2, gc.newValue<int>(2));
+        auto ephemerons = make_root_ptr(gc.newObject<TinyGC::GCEphemeronMap<Point, GCValue<int>>>());
+        ephemerons->set((*pair)[1], gc.newValue<int>(3));
+        ephemerons->set(make_point(gc, 13, 14), gc.newValue<int>(4));
+        gc.collect();
+        if (compact) {
+            gc.compact();   // moves the values, the container, roots and handles follow
+            if (gc.getLastGC().compactedBytes == 0) {
+                println("nothing compacted");
+                return 1;
+            }
+        }
+        for (std::size_t i = 0; i < wide->get().size(); ++i) {
+            if (*wide->get()[i] != static_cast<int>(i) || (i < moved.size() && *moved[i] != static_cast<int>(i))) {
+                println("corrupted values of a wide container");
+                return 1;
+            }
+        }
+        if (*handle != -1) {
+            println("corrupted value of a handle");
+            return 1;
+        }
+        for (std::size_t i = 0; i < table->size(); ++i) {
+            if ((i % 3 == 0) ? (*table)[i] == nullptr || *(*table)[i] != static_cast<int>(i) : (*table)[i] != nullptr) {
+                println("corrupted array");
+                return 1;
+            }
+        }
+        if ((*pair)[0] != nullptr || (*pair)[1]->to_string() != "(11, 12)" || (*data)[0] + (*data)[19999] != 14) {
+            println("corrupted array");
+            return 1;
+        }
+        // the large objects are the table, the data and the buffer;
+        // stale words on a scanned stack may keep the dropped objects
+        bool precise = !gc.isStackScan();
+        auto largeNum = gc.getLastGC().largeNum;
+        if (big->get()[Buffer().size() - 1] != 'x' || (gc.getAllocatorType() == TinyGC::GCAllocatorType::Pool 
+                && !gc.isSweepPending() && (precise ? largeNum != 3 : largeNum < 3))) {
+            println("corrupted large object space");
+            return 1;
+        }
+        if ((precise && (!dropped.expired() || cache->size() != 1 || ephemerons->size() != 1))
+                || kept.get() != x.get() || cache->find(1) != x.get() || *ephemerons->find((*pair)[1]) != 3) {
+            println("weak references do not match the live objects");
+            return 1;
+        }
+        // the census counts the live objects of each type, samples are named after their type
+        std::size_t liveValues = 0;
+        for (auto &count : profiler.getCensus()) {
+            if (count.type == "TinyGC::GCValue<int>") {
+                liveValues = count.objects;
+            }
+        }
+        std::ostringstream sites, pprof;
+        profiler.write(sites);
+        profiler.writePprof(pprof);
+        if (liveValues < wide->get().size() || (!shared && (sites.str().find("GCValue<int>") == std::string::npos
+                || pprof.str().find("@ heap_v2/4096") == std::string::npos))) {
+            println("the heap profile does not match the live objects");
+            return 1;
+        }
+        // an allocation beyond the hard limit fails once nothing more can be freed
+        gc.setHeapLimit(0, gc.getHeapBytes() + 1024 * 1024);
+        bool limited = false;
+        try {
+            gc.newArray<char>(64 * 1024 * 1024);
+        } catch (const std::bad_alloc &) {
+            limited = true;
+        }
+        gc.setHeapLimit(0, 0);
+        if (!shared && (!limited || gc.getTotals().pressureEvents != 1)) {
+            println("the hard heap limit was not enforced");
+            return 1;
+        }
+        if (!save_and_load_image(gc, pair.get(), data.get(), wide.get())) {
+            println("the objects of a heap image were not loaded");
+            return 1;
+        }
+        std::ostringstream json;
+        trace.write(json);
+        if (started != ended || before + ended != gc.getTotals().collections
+                || (ended > 0 && json.str().find("\"mark\"") == std::string::npos)) {
+            println("collection events do not match the statistics");
+            return 1;
+        }
+        println("collections: " + std::to_string(ended) 
+            + ", p99 pause below " + std::to_string(gc.getTotals().pauses.percentile(0.99)) + " us");
     }
     return 0;
 }
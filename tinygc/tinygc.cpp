@@ -1,8 +1,68 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <mutex>
+#include <system_error>
+#include <thread>
 #include "tinygc.h"
 
+#ifdef _WIN32
+#include <malloc.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#endif
+// conservative stack scanning reads the registers saved by getcontext() and the frame layout of x86-64
+#if defined(__linux__) && defined(__GLIBC__) && defined(__x86_64__)
+#define TINYGC_STACK_SCAN
+#include <pthread.h>
+#include <ucontext.h>
+#define TINYGC_FRAME_ADDRESS() __builtin_frame_address(0)
+#else
+#define TINYGC_FRAME_ADDRESS() nullptr
+#endif
+// heap images are mapped with mmap() and their vtables checked through the Itanium C++ ABI layout
+// and the type_info of the classes, which needs RTTI
+#if !defined(_WIN32) && defined(__GXX_ABI_VERSION) && defined(TINYGC_RTTI)
+#define TINYGC_HEAP_IMAGE
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
 namespace TinyGC
 {
+    typedef std::chrono::steady_clock Clock;
+    typedef std::chrono::time_point<Clock> TimePoint;
+    typedef decltype(std::declval<TimePoint>() - std::declval<TimePoint>()) Duration;
+
     inline intptr_t GCMasterAsInt(GarbageCollector *master) noexcept {
         return reinterpret_cast<intptr_t>(master);
     }
@@ -22,117 +82,4083 @@ namespace TinyGC
         return IntAsGCMaster(GCMasterAsInt(master) & ~static_cast<intptr_t>(1));
     }
 
-    // using manual stack avoids overflow when marking long linked lists
-    void GCMarker::clearStack() {
-        while(this->size > 0) {
-            auto sub = this->objects[--(this->size)];
-            if(sub != nullptr) {
-                sub->GCMaster = setMark(sub->GCMaster);
-                sub->GCMarkAllChildren(*this);
+    namespace details {
+        static void* alignedAlloc(std::size_t size, std::size_t alignment) {
+#ifdef _WIN32
+            void *p = _aligned_malloc(size, alignment);
+#else
+            void *p = nullptr;
+            if (posix_memalign(&p, alignment, size) != 0) {
+                p = nullptr;
+            }
+#endif
+            if (p == nullptr) {
+                throw std::bad_alloc();
             }
+            return p;
         }
-    }
 
-    // When GC is triggered, free heap memory may be not enough
-    // use recursive function, don't malloc stacks
-    // actually do not mark objects but only push it onto the stack
-    void GCMarker::markOneObject(GCObject* object) {
-        if ((object != nullptr) && (getMark(object->GCMaster) == 0)) {
+        static void alignedFree(void *p) noexcept {
+#ifdef _WIN32
+            _aligned_free(p);
+#else
+            std::free(p);
+#endif
+        }
+
+        inline std::size_t roundUp(std::size_t n, std::size_t alignment) noexcept {
+            return (n + alignment - 1) & ~(alignment - 1);
+        }
+
+#ifdef _WIN32
+        static std::size_t systemPageSize() noexcept {
+            static const std::size_t size = [] {
+                SYSTEM_INFO info;
+                GetSystemInfo(&info);
+                return static_cast<std::size_t>(info.dwPageSize);
+            }();
+            return size;
+        }
+
+        // VirtualAlloc aligns to the allocation granularity, 64 KiB
+        static bool canMap(std::size_t alignment) noexcept {
+            return alignment <= PageSize;
+        }
+
+        static void* mapChunk(std::size_t size, std::size_t) {
+            void *p = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            if (p == nullptr) {
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+
+        static void unmapChunk(void *p, std::size_t) noexcept {
+            VirtualFree(p, 0, MEM_RELEASE);
+        }
+
+        // the contents are not needed any more, the physical pages may be taken away
+        static void decommit(void *p, std::size_t size) noexcept {
+            VirtualAlloc(p, size, MEM_RESET, PAGE_READWRITE);
+        }
+#else
+        static std::size_t systemPageSize() noexcept {
+            static const std::size_t size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+            return size;
+        }
+
+        static bool canMap(std::size_t alignment) noexcept {
+            return alignment % systemPageSize() == 0;
+        }
+
+        // the mapping is cut down to an aligned chunk, the rest goes back at once
+        static void* mapChunk(std::size_t size, std::size_t alignment) {
+            size = roundUp(size, systemPageSize());
+            auto length = size + alignment - systemPageSize();
+            void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            auto begin = reinterpret_cast<std::uintptr_t>(p);
+            auto aligned = roundUp(begin, alignment);
+            if (aligned != begin) {
+                munmap(p, aligned - begin);
+            }
+            if (begin + length != aligned + size) {
+                munmap(reinterpret_cast<void*>(aligned + size), begin + length - aligned - size);
+            }
+            return reinterpret_cast<void*>(aligned);
+        }
 
-            if(this->size < MaxSize)  {
-                this->objects[(this->size)++] = object;
+        static void unmapChunk(void *p, std::size_t size) noexcept {
+            munmap(p, roundUp(size, systemPageSize()));
+        }
+
+        // the pages read as zeros afterwards, until then they take no physical memory
+        static void decommit(void *p, std::size_t size) noexcept {
+            madvise(p, size, MADV_DONTNEED);
+        }
+#endif
 
+        // a page, which may have been mapped on its own
+        static void freePage(GCPage *page) noexcept {
+            if (page->mapped) {
+                unmapChunk(page, page->chunkSize);
             } else {
-                GCMarker another;
-                another.objects[(another.size)++] = object;
-                another.clearStack();   // recursive call, very rare case
+                alignedFree(page);
             }
         }
-    }
 
-    // All pointers in marker.objects points to the objects that should be marked but not yet marked
-    void GarbageCollector::mark() {
-        GCMarker marker;
-        auto end = &listHead;
-        for(auto i = listHead.next; i != end; i = i->next) {
-            auto root_obj = i->ptr;
-            if(root_obj != nullptr) {
-                root_obj->GCMaster = setMark(root_obj->GCMaster);
-                root_obj->GCMarkAllChildren(marker);
-                marker.clearStack();
+        // number of trailing zeros of a non-zero word
+        inline unsigned lowestBit(std::uint64_t word) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<unsigned>(__builtin_ctzll(word));
+#else
+            unsigned n = 0;
+            while ((word & 1) == 0) {
+                word >>= 1;
+                ++n;
             }
+            return n;
+#endif
         }
-    }
 
-    void GarbageCollector::sweep() {
-        auto objectListHead = listHead.ptr;
-        auto prev = objectListHead;
-        if(prev != nullptr) {
-            for(auto curr = prev->GCNextObject; curr != nullptr; ) {
-                auto next = curr->GCNextObject;
-                if(getMark(curr->GCMaster) != 0) {
-                    curr->GCMaster = clearMark(curr->GCMaster);
-                    prev = curr;
-                } else { // collect
-                    prev->GCNextObject = next;
-                    destroyObject(curr);
-                    --objectNum;
+        inline unsigned popCount(std::uint64_t word) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+            return static_cast<unsigned>(__builtin_popcountll(word));
+#else
+            unsigned n = 0;
+            for (; word != 0; word &= word - 1) {
+                ++n;
+            }
+            return n;
+#endif
+        }
+
+        // a hint to load the cache line, no effect on the program
+        inline void prefetch(const void *address) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(address);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+            _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+            (void)address;
+#endif
+        }
+
+        inline bool testBit(const std::uint64_t *bits, std::size_t index) noexcept {
+            return (bits[index / 64] & (std::uint64_t(1) << (index % 64))) != 0;
+        }
+
+        inline void setBit(std::uint64_t *bits, std::size_t index) noexcept {
+            bits[index / 64] |= std::uint64_t(1) << (index % 64);
+        }
+
+        inline void clearBit(std::uint64_t *bits, std::size_t index) noexcept {
+            bits[index / 64] &= ~(std::uint64_t(1) << (index % 64));
+        }
+
+        // mark words are shared by the threads of parallel marking
+        template <typename T>
+        inline T atomicLoad(const T *word) noexcept {
+#ifdef _MSC_VER
+            return *static_cast<const volatile T*>(word);
+#else
+            return __atomic_load_n(word, __ATOMIC_RELAXED);
+#endif
+        }
+
+        template <typename T>
+        inline T atomicFetchOr(T *word, T bits) noexcept {
+#ifdef _MSC_VER
+            if (sizeof(T) == 8) {
+                return static_cast<T>(_InterlockedOr64(
+                    reinterpret_cast<volatile __int64*>(word), static_cast<__int64>(bits)));
+            }
+            return static_cast<T>(_InterlockedOr(
+                reinterpret_cast<volatile long*>(word), static_cast<long>(bits)));
+#else
+            return __atomic_fetch_or(word, bits, __ATOMIC_RELAXED);
+#endif
+        }
+
+        // the generation bits of a page, all objects are old when generational collection starts
+        static void resetGenerations(GCPage *page, bool old) noexcept {
+            if (old) {
+                std::memcpy(page->oldBits, page->allocBits, sizeof(page->oldBits));
+            } else {
+                std::memset(page->oldBits, 0, sizeof(page->oldBits));
+            }
+            std::memset(page->ageBits, 0, sizeof(page->ageBits));
+            std::memset(page->rememberedBits, 0, sizeof(page->rememberedBits));
+            page->youngNum = 0;
+            page->nextNursery = nullptr;
+            page->inNursery = false;
+        }
+
+        // an object moved by compaction keeps its generation, a full collection has promoted it
+        static void copyGenerations(GCPage *from, std::size_t index, GCPage *to, std::size_t newIndex) noexcept {
+            std::uint64_t *bits[] = { from->oldBits, from->ageBits[0], from->ageBits[1], from->rememberedBits };
+            std::uint64_t *newBits[] = { to->oldBits, to->ageBits[0], to->ageBits[1], to->rememberedBits };
+            for (std::size_t k = 0; k < 4; ++k) {
+                if (testBit(bits[k], index)) {
+                    setBit(newBits[k], newIndex);
+                } else {
+                    clearBit(newBits[k], newIndex);
                 }
-                curr = next;
             }
+        }
 
-            if(getMark(objectListHead->GCMaster) != 0) {
-                objectListHead->GCMaster = clearMark(objectListHead->GCMaster);
+        // visits every constructed object of a page
+        template <typename Visitor>
+        void forEachObject(GCPage *page, Visitor &visit) {
+            auto words = page->usedWords();
+            for (std::size_t w = 0; w < words; ++w) {
+                for (auto bits = page->allocBits[w]; bits != 0; bits &= bits - 1) {
+                    auto index = w * 64 + lowestBit(bits);
+                    visit(reinterpret_cast<GCObject*>(page->begin + index * page->objectSize));
+                }
+            }
+        }
+
+        static const std::size_t PageHeaderSize = roundUp(sizeof(GCPage), SlotAlignment);
+
+        GCPagePool::GCPagePool(GarbageCollector *master)
+            : owner(master), largePages(nullptr), unsweptLarge(nullptr), freePages(nullptr), nursery(nullptr),
+              mapThreshold(MapThreshold), largeNum(0), largeBytes(0) {
+            for (auto &c : classes) {
+                c.head = c.tail = c.current = c.unswept = nullptr;
+            }
+        }
+
+        GCPagePool::~GCPagePool() {
+            for (auto &c : classes) {
+                for (auto lists : { c.head, c.unswept }) {
+                    for (auto page = lists; page != nullptr; ) {
+                        auto next = page->next;
+                        freePage(page);
+                        page = next;
+                    }
+                }
+            }
+            for (auto lists : { largePages, unsweptLarge }) {
+                for (auto page = lists; page != nullptr; ) {
+                    auto next = page->next;
+                    freePage(page);
+                    page = next;
+                }
+            }
+            trim();
+        }
+
+        void GCPagePool::initPage(GCPage *page, std::size_t sizeClass) {
+            auto objectSize = sizeOfClass(sizeClass);
+            auto begin = reinterpret_cast<char*>(page) + PageHeaderSize;
+            page->owner = owner;
+            page->next = nullptr;
+            page->freeList = nullptr;
+            page->begin = begin;
+            page->unused = begin;
+            page->end = begin + (PageSize - PageHeaderSize) / objectSize * objectSize;
+            page->objectSize = objectSize;
+            page->chunkSize = PageSize;
+            page->sizeClass = sizeClass;
+            page->usedNum = 0;
+            page->divMagic = ((std::uint64_t(1) << 32) + objectSize - 1) / objectSize;
+            page->markEpoch = 0;
+            page->claimed = false;
+            page->pinned = false;
+            page->evacuating = false;
+            page->image = false;
+            std::memset(page->allocBits, 0, sizeof(page->allocBits));
+            resetGenerations(page, false);
+        }
+
+        // tried again once the collector has freed what it could
+        void* GCPagePool::allocateChunk(std::size_t size, std::size_t alignment, bool mapped) {
+            try {
+                return mapped ? mapChunk(size, alignment) : alignedAlloc(size, alignment);
+            } catch (const std::bad_alloc &) {
+                owner->relieveMemory(size, true);
+                return mapped ? mapChunk(size, alignment) : alignedAlloc(size, alignment);
+            }
+        }
+
+        GCPage* GCPagePool::newPage(std::size_t sizeClass) {
+            GCPage *page = freePages;
+            if (page != nullptr) {
+                freePages = page->next;
             } else {
-                auto temp = objectListHead->GCNextObject;
-                destroyObject(objectListHead);
-                --objectNum;
-                listHead.ptr = temp;
+                // mapped, so that its memory can be given back while it is free
+                bool mapped = canMap(PageSize);
+                page = static_cast<GCPage*>(allocateChunk(PageSize, PageSize, mapped));
+                page->mapped = mapped;
+            }
+            initPage(page, sizeClass);
+            auto &c = classes[sizeClass];
+            if (c.tail != nullptr) {
+                c.tail->next = page;
+            } else {
+                c.head = page;
             }
+            c.tail = page;
+            return page;
         }
-    }
 
-    GarbageCollector::~GarbageCollector() {
-        auto objectListHead = listHead.ptr;
-        for(auto p = objectListHead; p != nullptr;) {
-            auto next = p->GCNextObject;
-            destroyObject(p);
-            p = next;
+        // unswept pages of the size class are swept before a new page is taken
+        void* GCPagePool::allocateSlow(std::size_t sizeClass) {
+            if (owner->finalizer != nullptr) {
+                owner->reclaimFinalized();
+            }
+            auto &c = classes[sizeClass];
+            auto page = (c.current != nullptr) ? c.current->next : c.head;
+            while (page != nullptr && !page->hasFreeSlot()) {
+                page = page->next;
+            }
+            while (page == nullptr && c.unswept != nullptr) {
+                owner->sweepNextPage(sizeClass);
+                if (c.tail != nullptr && c.tail->hasFreeSlot()) {
+                    page = c.tail;
+                }
+            }
+            c.current = (page != nullptr) ? page : newPage(sizeClass);
+            return allocate(sizeClass);
+        }
+
+        void* GCPagePool::allocateLarge(std::size_t size, std::size_t alignment) {
+            if (unsweptLarge != nullptr) {
+                owner->sweepNextPage(SizeClassNum);
+            }
+            auto offset = roundUp(PageHeaderSize, alignment);
+            if (size > SIZE_MAX / 2) {
+                throw std::bad_alloc();     // rounding the chunk up would wrap
+            }
+            auto chunkSize = roundUp(offset + size, SlotAlignment);
+            auto pageAlignment = alignment > PageSize ? alignment : std::size_t(PageSize);
+            bool mapped = chunkSize >= mapThreshold && canMap(pageAlignment);
+            auto page = static_cast<GCPage*>(allocateChunk(chunkSize, pageAlignment, mapped));
+            auto begin = reinterpret_cast<char*>(page) + offset;
+            page->owner = owner;
+            page->next = largePages;
+            page->freeList = nullptr;
+            page->begin = begin;
+            page->unused = begin + size;
+            page->end = begin + size;
+            page->objectSize = size;
+            page->chunkSize = chunkSize;
+            page->sizeClass = SizeClassNum;
+            page->usedNum = 1;
+            page->divMagic = 0;
+            page->markEpoch = 0;
+            page->claimed = false;
+            page->pinned = false;
+            page->evacuating = false;
+            page->mapped = mapped;
+            page->image = false;
+            std::memset(page->allocBits, 0, sizeof(page->allocBits));
+            resetGenerations(page, false);
+            largePages = page;
+            ++largeNum;
+            largeBytes += size;
+            return begin;
+        }
+
+        void GCPagePool::release(void *slot) noexcept {
+            auto page = GCPage::of(slot);
+            auto index = page->indexOf(slot);
+            page->allocBits[index / 64] &= ~(std::uint64_t(1) << (index % 64));
+            --(page->usedNum);
+            if (page->sizeClass == SizeClassNum) {
+                unlinkLarge(page);
+                --largeNum;
+                largeBytes -= page->objectSize;
+                freePage(page);
+            } else {
+                *static_cast<void**>(slot) = page->freeList;
+                page->freeList = slot;
+            }
+        }
+
+        void GCPagePool::unlinkLarge(GCPage *page) noexcept {
+            for (auto link = &largePages; *link != nullptr; link = &((*link)->next)) {
+                if (*link == page) {
+                    *link = page->next;
+                    break;
+                }
+            }
+        }
+
+        void GCPagePool::releasePage(GCPage *page) noexcept {
+            if (page->sizeClass == SizeClassNum) {
+                freePage(page);
+            } else {
+                page->idle = false;
+                page->decommitted = false;
+                page->next = freePages;
+                freePages = page;
+            }
+        }
+
+        void GCPagePool::detach() noexcept {
+            for (auto &c : classes) {
+                if (c.tail != nullptr) {
+                    c.tail->next = c.unswept;
+                    c.unswept = c.head;
+                }
+                c.head = c.tail = c.current = nullptr;
+            }
+            if (largePages != nullptr) {
+                auto last = largePages;
+                while (last->next != nullptr) {
+                    last = last->next;
+                }
+                last->next = unsweptLarge;
+                unsweptLarge = largePages;
+                largePages = nullptr;
+            }
+        }
+
+        void GCPagePool::dropEvacuated(std::size_t sizeClass) noexcept {
+            auto &c = classes[sizeClass];
+            c.tail = nullptr;
+            for (auto link = &c.head; *link != nullptr; ) {
+                auto page = *link;
+                if (page->evacuating) {
+                    *link = page->next;
+                    freePage(page);
+                } else {
+                    c.tail = page;
+                    link = &(page->next);
+                }
+            }
+            c.current = c.head;
+        }
+
+        void GCPagePool::trim() noexcept {
+            while (freePages != nullptr) {
+                auto next = freePages->next;
+                freePage(freePages);
+                freePages = next;
+            }
+        }
+
+        // a page freed since the previous call is left alone, it will probably be taken again soon;
+        // the header stays, the page is reinitialized when it is taken
+        std::size_t GCPagePool::decommitIdle() noexcept {
+            auto kept = roundUp(PageHeaderSize, systemPageSize());
+            if (kept >= PageSize) {
+                return 0;
+            }
+            std::size_t bytes = 0;
+            for (auto page = freePages; page != nullptr; page = page->next) {
+                if (page->decommitted || !page->mapped) {
+                    continue;   // malloc owns the memory of a page that is not mapped
+                }
+                if (page->idle) {
+                    decommit(reinterpret_cast<char*>(page) + kept, PageSize - kept);
+                    page->decommitted = true;
+                    bytes += PageSize - kept;
+                } else {
+                    page->idle = true;
+                }
+            }
+            return bytes;
+        }
+
+        void GCPagePool::append(GCPage *page) noexcept {
+            if (page->sizeClass == SizeClassNum) {
+                page->next = largePages;
+                largePages = page;
+                return;
+            }
+            auto &c = classes[page->sizeClass];
+            page->next = nullptr;
+            if (c.tail != nullptr) {
+                c.tail->next = page;
+            } else {
+                c.head = page;
+            }
+            c.tail = page;
         }
+
+        //===================================
+        // * Class GCMarkReserve
+        // * Free segments of mark stacks, allocated in advance so that marking does not
+        // * depend on malloc when memory runs out; shared by the threads of parallel marking
+        //===================================
+        struct GCMarkSegment {
+            GCMarkSegment *below;   // the next segment down the stack, or in the free list
+            GCObject* objects[GCMarker::MaxSize];
+        };
+
+        class GCMarkReserve {
+        public:
+            GCMarkReserve() : freeList(nullptr), freeNum(0), capacity(0) {}
+            ~GCMarkReserve() { resize(0); }
+            GCMarkReserve(const GCMarkReserve&) = delete;
+            GCMarkReserve& operator=(const GCMarkReserve&) = delete;
+
+            // keeps `n` free segments, the missing ones are allocated now
+            void resize(std::size_t n) {
+                std::lock_guard<std::mutex> guard(lock);
+                capacity = n;
+                for (; freeNum < n; ++freeNum) {
+                    auto segment = new GCMarkSegment;
+                    segment->below = freeList;
+                    freeList = segment;
+                }
+                for (; freeNum > n; --freeNum) {
+                    auto segment = freeList;
+                    freeList = segment->below;
+                    delete segment;
+                }
+            }
+
+            // nullptr if neither the reserve nor the heap has one left
+            GCMarkSegment* take() noexcept {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (freeList != nullptr) {
+                        auto segment = freeList;
+                        freeList = segment->below;
+                        --freeNum;
+                        return segment;
+                    }
+                }
+                return new (std::nothrow) GCMarkSegment;
+            }
+
+            // refills the reserve first
+            void give(GCMarkSegment *segment) noexcept {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (freeNum < capacity) {
+                        segment->below = freeList;
+                        freeList = segment;
+                        ++freeNum;
+                        return;
+                    }
+                }
+                delete segment;
+            }
+
+        private:
+            std::mutex lock;
+            GCMarkSegment *freeList;
+            std::size_t freeNum;
+            std::size_t capacity;
+        };
+
+        //===================================
+        // * Class GCMarkWorker
+        // * One thread of parallel marking, its private stack overflows into a deque
+        // * that idle threads steal from
+        //===================================
+        class GCMarkWorker {
+        public:
+            struct Shared {
+                std::vector<GCObject*> roots;
+                std::atomic<std::size_t> nextRoot;      // roots are claimed in chunks
+                std::atomic<std::size_t> idleNum;
+                std::atomic<std::size_t> workerNum;     // threads that have been started
+                std::vector<std::unique_ptr<GCMarkWorker>> workers;
+            };
+
+            GCMarkWorker(Shared &shared, std::size_t id, std::size_t markEpoch)
+                : marker(markEpoch), shared(shared), id(id), dequeSize(0) {
+                marker.worker = this;
+            }
+
+            GCMarker marker;
+
+            void run() {
+                auto &roots = shared.roots;
+                for (auto i = shared.nextRoot.fetch_add(RootChunk); i < roots.size();
+                        i = shared.nextRoot.fetch_add(RootChunk)) {
+                    auto end = std::min(i + RootChunk, roots.size());
+                    for (; i < end; ++i) {
+                        marker.markOneObject(roots[i]);
+                    }
+                    drain();
+                }
+                for (;;) {
+                    drain();
+                    if (steal()) {
+                        continue;
+                    }
+                    // every thread is idle only when no deque holds work
+                    shared.idleNum.fetch_add(1);
+                    for (;;) {
+                        if (shared.idleNum.load() == shared.workerNum.load()) {
+                            return;
+                        }
+                        if (anyWork()) {
+                            shared.idleNum.fetch_sub(1);
+                            break;
+                        }
+                        std::this_thread::yield();
+                    }
+                }
+            }
+
+            // move the bottom half of the private stack to the deque
+            void spill() {
+                auto half = marker.size / 2;
+                std::lock_guard<std::mutex> guard(lock);
+                deque.insert(deque.end(), marker.objects, marker.objects + half);
+                std::memmove(marker.objects, marker.objects + half, (marker.size - half) * sizeof(GCObject*));
+                marker.size -= half;
+                dequeSize.store(deque.size(), std::memory_order_relaxed);
+            }
+
+        private:
+            enum : std::size_t {
+                RootChunk = 64,
+                SliceStep = 64,         // objects traced between checks for idle threads
+                ShareMin = 16,
+                StealMax = GCMarker::MaxSize / 2
+            };
+            Shared &shared;
+            std::size_t id;
+            std::mutex lock;
+            std::vector<GCObject*> deque;   // marked objects whose children are not traced yet
+            std::atomic<std::size_t> dequeSize;
+
+            void drain() {
+                while (!marker.clearStack(SliceStep)) {
+                    if (marker.size > ShareMin && dequeSize.load(std::memory_order_relaxed) == 0
+                            && shared.idleNum.load(std::memory_order_relaxed) > 0) {
+                        spill();
+                    }
+                }
+            }
+
+            // take up to half of the deque of `victim`, the own deque first
+            bool takeFrom(GCMarkWorker &victim) {
+                if (victim.dequeSize.load(std::memory_order_relaxed) == 0) {
+                    return false;
+                }
+                std::lock_guard<std::mutex> guard(victim.lock);
+                auto n = victim.deque.size();
+                auto count = std::min<std::size_t>((n + 1) / 2, StealMax);
+                std::copy(victim.deque.end() - count, victim.deque.end(), marker.objects + marker.size);
+                marker.size += count;
+                victim.deque.resize(n - count);
+                victim.dequeSize.store(victim.deque.size(), std::memory_order_relaxed);
+                return count > 0;
+            }
+
+            bool steal() {
+                auto n = shared.workers.size();
+                for (std::size_t k = 0; k < n; ++k) {
+                    if (takeFrom(*shared.workers[(id + k) % n])) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            bool anyWork() const {
+                for (auto &w : shared.workers) {
+                    if (w->dequeSize.load(std::memory_order_relaxed) != 0) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+        };
     }
 
-    typedef std::chrono::steady_clock Clock;
-    typedef std::chrono::time_point<Clock> TimePoint;
-    typedef decltype(std::declval<TimePoint>() - std::declval<TimePoint>()) Duration;
+    namespace details {
+        //===================================
+        // * Class GCFinalizer
+        // * Background thread running the destructors of dead objects,
+        // * pooled slots go back to the collector that owns the pages
+        //===================================
+        class GCFinalizer {
+        public:
+            explicit GCFinalizer(bool pooled) 
+                : pooled(pooled), stopping(false), busy(false), backlog(0), busyTime(0), thread([this] { run(); }) {}
 
-    void GarbageCollector::collect() {
-        auto totalNum = objectNum;
-        auto start = Clock::now();
+            // destroys the queued objects first
+            ~GCFinalizer() {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    stopping = true;
+                }
+                wake.notify_one();
+                thread.join();
+            }
+
+            void submit(std::vector<GCObject*> &batch) {
+                if (batch.empty()) {
+                    return;
+                }
+                backlog.fetch_add(batch.size());
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    queue.emplace_back();
+                    queue.back().swap(batch);
+                }
+                wake.notify_one();
+            }
 
-        mark();
-        sweep();
+            void wait() {
+                std::unique_lock<std::mutex> guard(lock);
+                idle.wait(guard, [this] { return queue.empty() && !busy; });
+            }
 
-        auto end = Clock::now();
-        auto notCollected = objectNum;
+            // slots whose objects have been destroyed since the last call
+            void takeFinalized(std::vector<void*> &slots) {
+                std::lock_guard<std::mutex> guard(lock);
+                slots.swap(finalized);
+            }
 
-        lastGC.elapsedTime = (end - start).count();
-        lastGC.endTime = end.time_since_epoch().count();
-        lastGC.collected =  totalNum - notCollected; 
-        lastGC.notCollected =  notCollected;
-        lastGC.hasValue =  true;
+            std::size_t getBacklog() const noexcept {
+                return backlog.load(std::memory_order_relaxed);
+            }
+
+            // clock ticks spent on destructors
+            std::size_t getBusyTime() const noexcept {
+                return busyTime.load(std::memory_order_relaxed);
+            }
+
+        private:
+            bool pooled;
+            std::mutex lock;
+            std::condition_variable wake;
+            std::condition_variable idle;
+            std::vector<std::vector<GCObject*>> queue;
+            std::vector<void*> finalized;
+            bool stopping;
+            bool busy;
+            std::atomic<std::size_t> backlog;
+            std::atomic<std::size_t> busyTime;
+            std::thread thread;     // last member, started when the others are ready
+
+            void run() {
+                std::unique_lock<std::mutex> guard(lock);
+                for (;;) {
+                    wake.wait(guard, [this] { return stopping || !queue.empty(); });
+                    if (queue.empty()) {
+                        return;
+                    }
+                    auto batch = std::move(queue.front());
+                    queue.erase(queue.begin());
+                    busy = true;
+                    guard.unlock();
+                    auto start = std::chrono::steady_clock::now();
+                    std::vector<void*> slots;
+                    for (auto obj : batch) {
+                        if (!pooled) {
+                            delete obj;
+                            continue;
+                        }
+                        auto page = GCPage::of(obj);
+                        obj->~GCObject();
+                        if (page->sizeClass == SizeClassNum) {
+                            freePage(page);    // unlinked by the sweeper
+                        } else {
+                            slots.push_back(obj);
+                        }
+                    }
+                    busyTime.fetch_add(static_cast<std::size_t>((std::chrono::steady_clock::now() - start).count()),
+                        std::memory_order_relaxed);
+                    backlog.fetch_sub(batch.size());
+                    guard.lock();
+                    finalized.insert(finalized.end(), slots.begin(), slots.end());
+                    busy = false;
+                    if (queue.empty()) {
+                        idle.notify_all();
+                    }
+                }
+            }
+        };
     }
 
-    bool GarbageCollector::shouldCollect() const {
-        return !lastGC.hasValue || (lastGC.elapsedTime * lastGC.notCollected 
-                < (Clock::now().time_since_epoch().count() - lastGC.endTime) 
-                * lastGC.collected);
+    namespace details {
+        //===================================
+        // * Class GCThreadRegistry
+        // * Threads attached to a shared heap and the state of stopping them
+        //===================================
+        class GCThreadRegistry {
+        public:
+            GCThreadRegistry() : parkedNum(0) {}
+
+            std::mutex lock;                    // guards the members below and stopRequested changes
+            std::condition_variable changed;
+            std::vector<GCThreadContext*> contexts;
+            std::size_t parkedNum;              // attached threads at a safepoint or in a safe region
+            std::mutex heapLock;                // pool lists shared by the allocation slow paths
+        };
+
+        static thread_local GCThreadContext *threadContexts = nullptr;
     }
 
-    bool GarbageCollector::checkPoint(){
-        if (shouldCollect()) {
-            collect();
-            return true;
+    namespace details {
+        //===================================
+        // * Struct GCStackSnapshot
+        // * Registers and stack of a thread stopped for a collection that scans stacks;
+        // * the frames below `live` may be reused by the thread meanwhile, they are copied
+        //===================================
+        struct GCStackSnapshot {
+            GCStackSnapshot() noexcept : live(nullptr), base(nullptr), depth(0), valid(false) {}
+
+#ifdef TINYGC_STACK_SCAN
+            ucontext_t registers;
+#endif
+            std::vector<std::uintptr_t> frames;
+            const char *live;       // the stack in [live, base) stays as it is while the thread is stopped
+            const char *base;
+            std::size_t depth;      // nested safe regions
+            bool valid;
+        };
+
+        //===================================
+        // * Class GCPageIndex
+        // * The pages of a heap sorted by address, finds the constructed object
+        // * a word points into, for conservative roots
+        //===================================
+        class GCPageIndex {
+        public:
+            GCPageIndex() noexcept : low(UINTPTR_MAX), high(0) {}
+
+            void add(GCPage *page) {
+                for (; page != nullptr; page = page->next) {
+                    auto begin = reinterpret_cast<std::uintptr_t>(page->begin);
+                    auto end = reinterpret_cast<std::uintptr_t>(page->unused);
+                    if (begin != end) {
+                        ranges.push_back(Range{ begin, end, page });
+                        low = std::min(low, begin);
+                        high = std::max(high, end);
+                    }
+                }
+            }
+
+            void sort() {
+                std::sort(ranges.begin(), ranges.end(),
+                    [](const Range &a, const Range &b) { return a.begin < b.begin; });
+            }
+
+            // nullptr unless `word` points into a slot holding a constructed object
+            GCObject* find(std::uintptr_t word) const noexcept {
+                if (word < low || word >= high) {
+                    return nullptr;
+                }
+                auto next = std::upper_bound(ranges.begin(), ranges.end(), word,
+                    [](std::uintptr_t w, const Range &r) { return w < r.begin; });
+                if (next == ranges.begin() || word >= (next - 1)->end) {
+                    return nullptr;
+                }
+                auto page = (next - 1)->page;
+                auto index = page->indexOf(reinterpret_cast<const void*>(word));
+                if (!testBit(page->allocBits, index)) {
+                    return nullptr;
+                }
+                return reinterpret_cast<GCObject*>(page->begin + index * page->objectSize);
+            }
+
+        private:
+            struct Range {
+                std::uintptr_t begin;
+                std::uintptr_t end;     // of the slots handed out
+                GCPage *page;
+            };
+
+            std::vector<Range> ranges;
+            std::uintptr_t low;
+            std::uintptr_t high;
+        };
+
+#ifdef TINYGC_STACK_SCAN
+        // the end of the stack of the calling thread, where its first frame lies
+        static const char* stackBase() noexcept {
+            static thread_local const char *base = nullptr;
+            if (base == nullptr) {
+                pthread_attr_t attr;
+                void *addr = nullptr;
+                std::size_t size = 0;
+                if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+                    pthread_attr_getstack(&attr, &addr, &size);
+                    pthread_attr_destroy(&attr);
+                }
+                base = static_cast<const char*>(addr) + size;
+            }
+            return base;
         }
-        return false;
+
+        static const std::uintptr_t* alignedWord(const char *p) noexcept {
+            return reinterpret_cast<const std::uintptr_t*>(
+                roundUp(reinterpret_cast<std::uintptr_t>(p), sizeof(std::uintptr_t)));
+        }
+
+        // stacks hold the redzones of sanitized frames and words written by stopped threads
+        // before they stopped, these reads are not checked
+        __attribute__((noinline, no_sanitize_address, no_sanitize_thread))
+        static void scanWords(const char *begin, const char *end, const GCPageIndex &pages, 
+                std::vector<GCObject*> &found) {
+            for (auto word = alignedWord(begin); reinterpret_cast<const char*>(word + 1) <= end; ++word) {
+                auto object = pages.find(*static_cast<const volatile std::uintptr_t*>(word));
+                if (object != nullptr) {
+                    found.push_back(object);
+                }
+            }
+        }
+
+        __attribute__((noinline, no_sanitize_address, no_sanitize_thread))
+        static void copyWords(const char *begin, const char *end, std::vector<std::uintptr_t> &to) {
+            to.clear();
+            for (auto word = alignedWord(begin); reinterpret_cast<const char*>(word + 1) <= end; ++word) {
+                std::uintptr_t value = *static_cast<const volatile std::uintptr_t*>(word);
+                to.push_back(value);
+            }
+        }
+
+        // `live` is the frame address of a caller that returns before the thread stops, the registers
+        // its callers left to it are either still in registers or saved below it, in the copied frames
+        __attribute__((noinline))
+        static void takeSnapshot(GCStackSnapshot &s, const char *live) {
+            getcontext(&(s.registers));
+            auto sp = reinterpret_cast<const char*>(s.registers.uc_mcontext.gregs[REG_RSP]);
+            copyWords(sp, live, s.frames);
+            s.live = live;
+            s.base = stackBase();
+            s.valid = true;
+        }
+
+        static void scanSnapshot(const GCStackSnapshot *s, const GCPageIndex &pages, std::vector<GCObject*> &found) {
+            if (s == nullptr || !s->valid) {
+                return;
+            }
+            auto registers = reinterpret_cast<const char*>(&(s->registers));
+            scanWords(registers, registers + sizeof(s->registers), pages, found);
+            auto frames = reinterpret_cast<const char*>(s->frames.data());
+            scanWords(frames, frames + s->frames.size() * sizeof(std::uintptr_t), pages, found);
+            scanWords(s->live, s->base, pages, found);
+        }
+#endif
+    }
+
+#ifdef TINYGC_HEAP_IMAGE
+    namespace details {
+        //===================================
+        // * Struct GCImageHeader
+        // * Beginning of a heap image file, padded to PageSize; the pages follow as they are
+        // * mapped, then the types, their names, the roots and the pointer fields
+        //===================================
+        struct GCImageHeader {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t compactHeader;
+            std::uint64_t pointerSize;
+            std::uint64_t pageHeaderSize;
+            std::uint64_t base;             // address the pages were laid out for
+            std::uint64_t anchor;           // of imageAnchor in the writing process
+            std::uint64_t program;          // the same in every process of the writing program
+            std::uint64_t pageBytes;
+            std::uint64_t typeNum;
+            std::uint64_t nameBytes;
+            std::uint64_t rootNum;
+            std::uint64_t fieldNum;
+        };
+
+        // a vtable of the writing process and the mangled name of its type
+        struct GCImageType {
+            std::uint64_t vtable;
+            std::uint64_t name;     // offset in the names
+        };
+
+        static const char ImageMagic[8] = { 'T', 'i', 'n', 'y', 'G', 'C', 'I', 'm' };
+        static const std::uint32_t ImageVersion = 1;
+        static const std::uint64_t NullRoot = UINT64_MAX;
+
+        // where images are laid out, usually free in the address space of a 64-bit process
+        static const std::uintptr_t ImageBase = std::uintptr_t(1) << (sizeof(void*) == 8 ? 45 : 29);
+
+        // the vtables of a program move with it, by as much as this variable
+        static const char imageAnchor = 0;
+
+        static std::uint64_t programOf(std::uintptr_t anchor) noexcept {
+            return reinterpret_cast<std::uintptr_t>(&typeid(GCObject)) - anchor;
+        }
+
+        static bool readAt(int fd, void *to, std::size_t size, std::uint64_t offset) {
+            auto p = static_cast<char*>(to);
+            while (size > 0) {
+                auto n = pread(fd, p, size, static_cast<off_t>(offset));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                p += n;
+                size -= static_cast<std::size_t>(n);
+                offset += static_cast<std::uint64_t>(n);
+            }
+            return true;
+        }
+
+        //===================================
+        // * Class GCProbe
+        // * Copies memory through a pipe, so that an address which cannot be read fails with
+        // * EFAULT instead of faulting; for the vtables a heap image names, which may be damaged
+        //===================================
+        class GCProbe {
+        public:
+            GCProbe() {
+                if (pipe(fds) != 0) {
+                    throw std::system_error(errno, std::generic_category(), "TinyGC: cannot open a pipe");
+                }
+            }
+            ~GCProbe() {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            GCProbe(const GCProbe &) = delete;
+            GCProbe& operator=(const GCProbe &) = delete;
+
+            // false if any of the bytes cannot be read, the pipe is not used again then
+            bool copy(void *to, const void *from, std::size_t bytes) noexcept {
+                auto source = static_cast<const char*>(from);
+                auto target = static_cast<char*>(to);
+                while (bytes > 0) {
+                    auto n = std::min<std::size_t>(bytes, ChunkBytes);  // below PIPE_BUF, never blocks
+#ifdef __linux__
+                    // the system call itself, whose reads sanitizers do not check
+                    auto written = syscall(SYS_write, fds[1], source, n);
+#else
+                    auto written = write(fds[1], source, n);
+#endif
+                    if (written != static_cast<long>(n) || read(fds[0], target, n) != static_cast<ssize_t>(n)) {
+                        return false;
+                    }
+                    source += n;
+                    target += n;
+                    bytes -= n;
+                }
+                return true;
+            }
+
+        private:
+            enum : std::size_t { ChunkBytes = 512 };
+            int fds[2];
+        };
+    }
+#endif
+
+    namespace details {
+        //===================================
+        // * Struct GCGroupMember
+        // * A collector in a GCGroup, guarded by the lock of the group
+        //===================================
+        struct GCGroupMember {
+            GCGroupMember(GCGroupState *state, GarbageCollector *gc, std::size_t heapBytes)
+                : state(state), gc(gc), heapBytes(heapBytes), parkedNum(0), 
+                  queued(false), collecting(false), requested(false), failed(false) {}
+
+            GCGroupState *state;
+            GarbageCollector *gc;
+            std::size_t heapBytes;      // as last reported
+            std::size_t parkedNum;      // safe regions the owner thread is in
+            bool queued;                // waits for a thread of the group
+            bool collecting;            // by a thread of the group
+            bool requested;             // by the group heap limit, until the member collects
+            bool failed;                // the last collection by the group threw, the owner collects
+        };
+
+        //===================================
+        // * Class GCGroupState
+        // * Members, limits and threads of a GCGroup
+        //===================================
+        class GCGroupState {
+        public:
+            explicit GCGroupState(unsigned threadNum)
+                : limit(0), idleThreshold(SIZE_MAX), heapBytes(0), running(0), stopping(false) {
+                for (unsigned i = 0; i < threadNum; ++i) {
+                    threads.emplace_back([this] { run(); });
+                }
+            }
+
+            // members still in the group are let go
+            ~GCGroupState() {
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    stopping = true;
+                }
+                wake.notify_all();
+                for (auto &t : threads) {
+                    t.join();
+                }
+                for (auto m : members) {
+                    m->gc->groupMember = nullptr;
+                    m->gc->nextReport = SIZE_MAX;
+                    m->gc->updateEventBytes();
+                    delete m;
+                }
+            }
+
+            void add(GarbageCollector &gc) {
+                if (gc.groupMember != nullptr) {
+                    throw std::logic_error("TinyGC: the collector is in a group already");
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                auto m = new GCGroupMember(this, &gc, gc.objectBytes);
+                members.push_back(m);
+                heapBytes += m->heapBytes;
+                gc.groupMember = m;
+                gc.nextReport = gc.allocatedBytes + GarbageCollector::GroupReportStep;
+                gc.updateEventBytes();
+                requestIfOver();
+            }
+
+            void remove(GarbageCollector &gc) {
+                auto m = gc.groupMember;
+                if (m == nullptr || m->state != this) {
+                    return;
+                }
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    done.wait(guard, [m] { return !m->collecting; });
+                    unqueue(*m);
+                    members.erase(std::find(members.begin(), members.end(), m));
+                    heapBytes -= m->heapBytes;
+                }
+                delete m;
+                gc.groupMember = nullptr;
+                gc.nextReport = SIZE_MAX;
+                gc.updateEventBytes();
+            }
+
+            // on the owner thread, after allocating GroupReportStep bytes
+            void report(GCGroupMember &m, std::size_t bytes) {
+                std::lock_guard<std::mutex> guard(lock);
+                update(m, bytes);
+                requestIfOver();
+            }
+
+            // the owner thread enters a safe region, the member is collected
+            // if its budget is used up, it has allocated enough or the limit asks for it
+            void park(GCGroupMember &m) {
+                auto &gc = *(m.gc);
+                std::lock_guard<std::mutex> guard(lock);
+                update(m, gc.objectBytes);
+                requestIfOver();
+                if (m.parkedNum++ == 0 && (m.requested || gc.collectDue.load(std::memory_order_relaxed)
+                        || gc.allocatedBytes >= std::max<std::size_t>(idleThreshold, 1))) {
+                    enqueue(m);
+                }
+            }
+
+            // the owner thread leaves the safe region, after a collection of the member has ended;
+            // one that failed is due again, so the owner runs it and gets its error
+            void unpark(GCGroupMember &m) {
+                std::unique_lock<std::mutex> guard(lock);
+                if (--(m.parkedNum) > 0) {
+                    return;
+                }
+                done.wait(guard, [&m] { return !m.collecting; });
+                bool failed = m.failed;
+                m.failed = false;
+                if ((unqueue(m) && m.requested) || failed) {
+                    m.gc->collectDue.store(true, std::memory_order_relaxed);
+                }
+            }
+
+            // at the end of every collection of a member, on the thread that ran it
+            void collected(GCGroupMember &m, const GCStatistics &last, std::size_t bytes) {
+                std::lock_guard<std::mutex> guard(lock);
+                update(m, bytes);
+                m.requested = false;
+                ++(stats.collections);
+                stats.pauseTime += last.elapsedTime;
+                stats.collectedBytes += last.collectedBytes;
+            }
+
+            void setHeapLimit(std::size_t bytes) {
+                std::lock_guard<std::mutex> guard(lock);
+                limit = bytes;
+                requestIfOver();
+            }
+
+            void setIdleThreshold(std::size_t bytes) {
+                std::lock_guard<std::mutex> guard(lock);
+                idleThreshold = bytes;
+            }
+
+            void wait() {
+                std::unique_lock<std::mutex> guard(lock);
+                done.wait(guard, [this] { return queue.empty() && running == 0; });
+            }
+
+            GCGroupStatistics getStatistics() {
+                std::lock_guard<std::mutex> guard(lock);
+                auto s = stats;
+                s.members = members.size();
+                s.heapBytes = heapBytes;
+                return s;
+            }
+
+        private:
+            std::mutex lock;
+            std::condition_variable wake;   // of the threads, when a member is queued
+            std::condition_variable done;   // of the owners and wait(), when a collection ends
+            std::vector<GCGroupMember*> members;
+            std::vector<GCGroupMember*> queue;      // parked members due for a collection
+            std::size_t limit;              // 0 without a limit
+            std::size_t idleThreshold;
+            std::size_t heapBytes;          // sum of the reports of the members
+            std::size_t running;            // collections run by the threads
+            GCGroupStatistics stats;
+            bool stopping;
+            std::vector<std::thread> threads;   // last member, started when the others are ready
+
+            void update(GCGroupMember &m, std::size_t bytes) noexcept {
+                heapBytes = heapBytes - m.heapBytes + bytes;
+                m.heapBytes = bytes;
+            }
+
+            // every member not yet asked collects once, running ones at their next check point;
+            // collectDue is atomic, the other fields of their collectors are not touched
+            void requestIfOver() {
+                if (limit == 0 || heapBytes < limit) {
+                    return;
+                }
+                for (auto m : members) {
+                    if (m->requested) {
+                        continue;
+                    }
+                    m->requested = true;
+                    ++(stats.limitRequests);
+                    if (m->parkedNum > 0 && !m->collecting) {
+                        enqueue(*m);
+                    } else {
+                        m->gc->collectDue.store(true, std::memory_order_relaxed);
+                    }
+                }
+            }
+
+            void enqueue(GCGroupMember &m) {
+                if (!m.queued) {
+                    m.queued = true;
+                    queue.push_back(&m);
+                    wake.notify_one();
+                }
+            }
+
+            bool unqueue(GCGroupMember &m) {
+                if (!m.queued) {
+                    return false;
+                }
+                m.queued = false;
+                queue.erase(std::find(queue.begin(), queue.end(), &m));
+                done.notify_all();
+                return true;
+            }
+
+            // the owner stays parked until the collection ends, a failed one is left to it
+            void run() {
+                std::unique_lock<std::mutex> guard(lock);
+                for (;;) {
+                    wake.wait(guard, [this] { return stopping || !queue.empty(); });
+                    if (stopping) {
+                        return;
+                    }
+                    auto m = queue.front();
+                    queue.erase(queue.begin());
+                    m->queued = false;
+                    m->collecting = true;
+                    ++running;
+                    guard.unlock();
+                    bool failed = false;
+                    try {
+                        m->gc->collect();
+                    } catch (...) {
+                        failed = true;
+                    }
+                    guard.lock();
+                    m->collecting = false;
+                    --running;
+                    if (failed) {
+                        m->failed = true;
+                        ++(stats.failedCollections);
+                    } else {
+                        ++(stats.backgroundCollections);
+                    }
+                    done.notify_all();
+                }
+            }
+        };
+    }
+
+    // the page bitmap is cleared lazily by the first mark of an epoch,
+    // so live objects are never written and marks never need clearing
+    bool GCMarker::setMarked(GCObject* object) {
+#ifndef TINYGC_COMPACT_HEADER
+        if (epoch == 0) {
+            if (getMark(object->GCMaster) != 0) {
+                return false;
+            }
+            object->GCMaster = setMark(object->GCMaster);
+            return true;
+        }
+#endif
+        auto page = details::GCPage::of(object);
+        auto index = page->indexOf(object);
+        if (youngOnly && details::testBit(page->oldBits, index)) {
+            return false;
+        }
+        if (page->markEpoch != epoch) {
+            if (page->image) {
+                return false;   // its bits are all set and never cleared
+            }
+            auto words = page->usedWords();
+            std::memset(page->markBits, 0, words * sizeof(std::uint64_t));
+            page->markEpoch = epoch;
+        }
+        auto bit = std::uint64_t(1) << (index % 64);
+        auto &word = page->markBits[index / 64];
+        if ((word & bit) != 0) {
+            return false;
+        }
+        word |= bit;
+        return true;
+    }
+
+    // page bitmaps are cleared before parallel marking starts
+    bool GCMarker::setMarkedAtomic(GCObject* object) {
+#ifndef TINYGC_COMPACT_HEADER
+        if (epoch == 0) {
+            auto word = reinterpret_cast<std::uintptr_t*>(&object->GCMaster);
+            return (details::atomicLoad(word) & 1) == 0
+                && (details::atomicFetchOr(word, std::uintptr_t(1)) & 1) == 0;
+        }
+#endif
+        auto page = details::GCPage::of(object);
+        auto index = page->indexOf(object);
+        auto bit = std::uint64_t(1) << (index % 64);
+        auto word = &(page->markBits[index / 64]);
+        return (details::atomicLoad(word) & bit) == 0
+            && (details::atomicFetchOr(word, bit) & bit) == 0;
+    }
+
+    bool GCMarker::isMarked(const GCObject* object) const noexcept {
+#ifndef TINYGC_COMPACT_HEADER
+        if (epoch == 0) {
+            return getMark(object->GCMaster) != 0;
+        }
+#endif
+        auto page = details::GCPage::of(object);
+        auto index = page->indexOf(object);
+        if (youngOnly && details::testBit(page->oldBits, index)) {
+            return true;
+        }
+        return (page->markEpoch == epoch || page->image) && details::testBit(page->markBits, index);
+    }
+
+    // using manual stack avoids overflow when marking long linked lists
+    // objects on the stack are marked but their children are not yet
+    void GCMarker::clearStack() {
+        clearStack(SIZE_MAX);
+    }
+
+    // popped objects wait in a short queue while their cache lines are prefetched
+    bool GCMarker::clearStack(std::size_t budget) {
+        GCObject* queue[PrefetchDepth];
+        std::size_t head = 0, queued = 0;
+        for (; budget > 0; --budget) {
+            GCObject* sub;
+            if (this->size > 0 || popSegment()) {
+                auto next = this->objects[--(this->size)];
+                details::prefetch(next);
+                if (queued < PrefetchDepth) {
+                    queue[(head + queued++) % PrefetchDepth] = next;
+                    ++budget;   // nothing traced
+                    continue;
+                }
+                sub = queue[head];
+                queue[head] = next;
+                head = (head + 1) % PrefetchDepth;
+            } else if (queued > 0) {
+                sub = queue[head];
+                head = (head + 1) % PrefetchDepth;
+                --queued;
+            } else {
+                break;
+            }
+            traceChildren(sub);
+        }
+        for (; queued > 0; --queued) {  // out of budget, still gray
+            push(queue[(head + queued - 1) % PrefetchDepth]);
+        }
+        return empty();
+    }
+
+    void GCMarker::traceChildren(GCObject* object) {
+        if (census != nullptr) {
+            census->add(object);
+        }
+#ifdef TINYGC_COMPACT_HEADER
+        auto descriptor = details::GCTypeTable::find(details::vtableOf(object));
+        if (descriptor == nullptr) {
+            object->GCMarkAllChildren(*this);
+            return;
+        }
+#else
+        auto tagged = reinterpret_cast<std::uintptr_t>(object->GCNextObject);
+        if ((tagged & 1) == 0) {
+            object->GCMarkAllChildren(*this);
+            return;
+        }
+        auto descriptor = reinterpret_cast<const GCTraceDescriptor*>(tagged - 1);
+#endif
+        auto base = reinterpret_cast<char*>(object);
+        for (std::size_t i = 0; i < descriptor->fieldNum; ++i) {
+            markOneObject(*reinterpret_cast<GCObject**>(base + descriptor->offsets[i]));
+        }
+    }
+
+    // the new address of an object on a page evacuated by compaction,
+    // its old slot holds the new slot in the first word
+    GCObject* GCMarker::relocated(GCObject* object) noexcept {
+        if (object == nullptr) {
+            return nullptr;
+        }
+        auto page = details::GCPage::of(object);
+        if (!page->evacuating) {
+            return object;
+        }
+        auto slot = page->begin + page->indexOf(object) * page->objectSize;
+        auto moved = *reinterpret_cast<char**>(slot);
+        return reinterpret_cast<GCObject*>(moved + (reinterpret_cast<char*>(object) - slot));
+    }
+
+    inline void GCMarker::push(GCObject* object) {
+        if (this->size < MaxSize) {
+            this->objects[(this->size)++] = object;
+        } else {
+            overflow(object);
+        }
+    }
+
+    void GCMarker::markOneObject(GCObject* object) {
+        if (visit != nullptr) {
+            if (object != nullptr) {
+                visit(*this, object);
+            }
+            return;
+        }
+        if ((object != nullptr) && (worker != nullptr ? setMarkedAtomic(object) : setMarked(object))) {
+            ++(this->markedNum);
+            push(object);
+        }
+    }
+
+    // the top segment is full: parallel marking shares half of it with idle threads,
+    // otherwise a new segment goes on top, from the reserve of the collector
+    void GCMarker::overflow(GCObject* object) {
+        if (worker != nullptr) {
+            worker->spill();
+            this->objects[(this->size)++] = object;
+            return;
+        }
+        auto next = spare;
+        spare = nullptr;
+        if (next == nullptr) {
+            next = reserve != nullptr ? reserve->take() : new (std::nothrow) details::GCMarkSegment;
+        }
+        if (next == nullptr) {
+            // no memory at all, trace it on the native stack, very rare case
+            GCMarker another(this->epoch);
+            another.youngOnly = this->youngOnly;
+            another.census = this->census;
+            another.objects[(another.size)++] = object;
+            another.clearStack();
+            this->markedNum += another.markedNum;
+            return;
+        }
+        next->below = segment;
+        segment = next;
+        this->objects = next->objects;
+        this->objects[0] = object;
+        this->size = 1;
+    }
+
+    // the top segment is empty, go on with the full one below it
+    bool GCMarker::popSegment() {
+        if (segment == nullptr) {
+            return false;
+        }
+        if (spare != nullptr) {
+            giveSegment(spare);
+        }
+        spare = segment;    // kept, the stack may grow again right away
+        segment = segment->below;
+        this->objects = segment != nullptr ? segment->objects : bottom;
+        this->size = MaxSize;
+        return true;
+    }
+
+    void GCMarker::giveSegment(details::GCMarkSegment *s) noexcept {
+        if (reserve != nullptr) {
+            reserve->give(s);
+        } else {
+            delete s;
+        }
+    }
+
+    void GCMarker::releaseSegments() noexcept {
+        while (segment != nullptr) {
+            auto below = segment->below;
+            giveSegment(segment);
+            segment = below;
+        }
+        if (spare != nullptr) {
+            giveSegment(spare);
+            spare = nullptr;
+        }
+        this->objects = bottom;
+        this->size = 0;
+    }
+
+    std::size_t GarbageCollector::mark() {
+        if (markThreads > 1) {
+            return markParallel();
+        }
+        if (markMode == GCMarkMode::Bitmap) {
+            ++markEpoch;
+        }
+        GCMarker marker(markMode == GCMarkMode::Bitmap ? markEpoch : 0, markReserve);
+        marker.census = startCensus();
+        scanStacks();
+        for (auto obj : stackObjects) {
+            marker.markOneObject(obj);
+            marker.clearStack();
+        }
+        for (auto end : rootLists()) {
+            for(auto i = end->next; i != end; i = i->next) {
+                marker.markOneObject(i->ptr);
+                marker.clearStack();
+            }
+        }
+        for (auto area : handleAreas()) {
+            area->forEach([&marker](GCObject *handle) {
+                marker.markOneObject(handle);
+                marker.clearStack();
+            });
+        }
+        processWeak(marker);
+        return marker.markedNum;
+    }
+
+    void GarbageCollector::clearMarkBits() {
+        auto clear = [this](details::GCPage *page) {
+            for (; page != nullptr; page = page->next) {
+                std::memset(page->markBits, 0, page->usedWords() * sizeof(std::uint64_t));
+                page->markEpoch = markEpoch;
+            }
+        };
+        for (auto &c : pool.classes) {
+            clear(c.head);
+        }
+        clear(pool.largePages);
+    }
+
+    // the calling thread is worker 0, marking goes on with fewer threads if some cannot start
+    std::size_t GarbageCollector::markParallel() {
+        if (markMode == GCMarkMode::Bitmap) {
+            ++markEpoch;
+            clearMarkBits();    // no sweeping is pending, every page is in a class list
+        }
+        std::size_t epoch = (markMode == GCMarkMode::Bitmap) ? markEpoch : 0;
+        details::GCMarkWorker::Shared shared;
+        for (auto end : rootLists()) {
+            for(auto i = end->next; i != end; i = i->next) {
+                if (i->ptr != nullptr) {
+                    shared.roots.push_back(i->ptr);
+                }
+            }
+        }
+        for (auto area : handleAreas()) {
+            area->forEach([&shared](GCObject *handle) {
+                if (handle != nullptr) {
+                    shared.roots.push_back(handle);
+                }
+            });
+        }
+        scanStacks();
+        shared.roots.insert(shared.roots.end(), stackObjects.begin(), stackObjects.end());
+        shared.nextRoot = 0;
+        shared.idleNum = 0;
+        shared.workerNum = markThreads;
+        std::vector<details::GCCensus> censuses(profiler != nullptr ? markThreads : 0,
+            details::GCCensus(allocatorType == GCAllocatorType::Pool));
+        for (std::size_t k = 0; k < markThreads; ++k) {
+            shared.workers.emplace_back(new details::GCMarkWorker(shared, k, epoch));
+            if (profiler != nullptr) {
+                shared.workers[k]->marker.census = &censuses[k];
+            }
+        }
+        std::vector<std::thread> threads;
+        for (std::size_t k = 1; k < markThreads; ++k) {
+            try {
+                auto worker = shared.workers[k].get();
+                threads.emplace_back([worker] { worker->run(); });
+            } catch (const std::system_error&) {
+                shared.workerNum -= markThreads - k;
+                break;
+            }
+        }
+        shared.workers[0]->run();
+        for (auto &t : threads) {
+            t.join();
+        }
+        // ephemerons are traced serially, the marks are complete
+        GCMarker weak(epoch, markReserve);
+        weak.census = startCensus();
+        for (auto &c : censuses) {
+            weak.census->merge(c);
+        }
+        processWeak(weak);
+        std::size_t markedNum = weak.markedNum;
+        for (auto &w : shared.workers) {
+            markedNum += w->marker.markedNum;
+        }
+        return markedNum;
+    }
+
+    void GarbageCollector::setMarkThreads(unsigned n) {
+        if (n == 0) {
+            n = std::thread::hardware_concurrency();
+        }
+        markThreads = (n > 0) ? n : 1;
+    }
+
+    void GarbageCollector::setMarkStackReserve(std::size_t segments) {
+        if (markReserve == nullptr) {
+            markReserve = new details::GCMarkReserve();
+            marker.reserve = markReserve;
+        }
+        markReserve->resize(segments);
+    }
+
+    void GarbageCollector::scanRoots(GCMarker &m) {
+        scanStacks();
+        for (auto obj : stackObjects) {
+            m.markOneObject(obj);
+        }
+        auto end = &listHead;
+        for(auto i = listHead.next; i != end; i = i->next) {
+            m.markOneObject(i->ptr);
+        }
+        handles.forEach([&m](GCObject *handle) { m.markOneObject(handle); });
+    }
+
+    // roots are scanned once here and again by finishMarking,
+    // so only stores into objects need the write barrier
+    void GarbageCollector::startMarking() {
+        if (marking || sharedHeap) {
+            return;
+        }
+        sweepSome(SIZE_MAX);
+        notify(GCEvent::CollectionStart);
+        if (markMode == GCMarkMode::Bitmap) {
+            ++markEpoch;
+        }
+        marker.reset(markMode == GCMarkMode::Bitmap ? markEpoch : 0);
+        marker.census = startCensus();
+        marking = true;
+        cycleTime = 0;
+        scanRoots(marker);
+    }
+
+    void GarbageCollector::finishMarking(std::size_t pauseStart) {
+        scanRoots(marker);
+        marker.clearStack();
+        processWeak(marker);
+        marking = false;
+        auto notCollected = marker.markedNum;
+        auto totalNum = objectNum;
+        auto totalBytes = objectBytes;
+        auto sweepStart = Clock::now().time_since_epoch().count();
+        sweepMajor();
+        auto end = Clock::now().time_since_epoch().count();
+        recordPause(end - pauseStart);
+        endCycle(totalNum, totalBytes, notCollected, lazySweep, cycleTime + (sweepStart - pauseStart), 
+            cycleTime + (end - pauseStart), end);
+        reportCycle();
+    }
+
+    void GarbageCollector::sweepMajor() {
+        if (generational) {
+            dropDeadRemembered();
+        }
+        if (lazySweep) {
+            startSweep();
+        } else {
+            sweep();
+        }
+        if (generational) {
+            // with lazy sweeping, oldNum still counts the unswept dead objects
+            majorThreshold = std::max<std::size_t>(2 * oldNum, MinMajorThreshold);
+        }
+    }
+
+    void GarbageCollector::endCycle(std::size_t totalNum, std::size_t totalBytes, std::size_t notCollected,
+            bool deferred, std::size_t markTime, std::size_t elapsedTime, std::size_t endTime) {
+        lastGC.mutatorTime = lastGC.hasValue ? endTime - elapsedTime - lastGC.endTime : 0;
+        lastGC.allocatedBytes = allocatedBytes;
+        // dead objects left to lazy sweeping are assumed to be of the average size
+        lastGC.liveBytes = (!deferred || totalNum == 0) ? objectBytes 
+            : static_cast<std::size_t>(static_cast<double>(objectBytes) * notCollected / totalNum);
+        lastGC.collectedBytes = totalBytes - lastGC.liveBytes;
+        lastGC.markTime = markTime;
+        lastGC.sweepTime = elapsedTime - markTime;
+        auto finalizeTime = (finalizer != nullptr) ? finalizer->getBusyTime() : finalizeTimeSeen;
+        lastGC.finalizeTime = finalizeTime - finalizeTimeSeen;
+        finalizeTimeSeen = finalizeTime;
+        lastGC.elapsedTime = elapsedTime;
+        lastGC.endTime = endTime;
+        lastGC.collected =  totalNum - notCollected; 
+        lastGC.notCollected =  notCollected;
+        lastGC.deferred = deferred ? totalNum - notCollected : 0;
+        lastGC.promoted = 0;
+        lastGC.compactedBytes = 0;
+        lastGC.fragmentation = 0;
+        lastGC.weakCleared = weakCleared;
+        weakCleared = 0;
+        lastGC.largeNum = pool.largeNum;
+        lastGC.largeBytes = pool.largeBytes;
+        lastGC.decommittedBytes = pool.decommitIdle();
+        lastGC.minor = false;
+        lastGC.hasValue =  true;
+    }
+
+    // after the caller has completed lastGC
+    void GarbageCollector::reportCycle() {
+        ++(totals.collections);
+        totals.minorCollections += lastGC.minor;
+        totals.pauseTime += lastGC.elapsedTime;
+        totals.markTime += lastGC.markTime;
+        totals.sweepTime += lastGC.sweepTime;
+        totals.finalizeTime += lastGC.finalizeTime;
+        totals.collected += lastGC.collected;
+        totals.collectedBytes += lastGC.collectedBytes;
+        totals.allocatedBytes += lastGC.allocatedBytes;
+        totals.compactedBytes += lastGC.compactedBytes;
+        totals.decommittedBytes += lastGC.decommittedBytes;
+        nextSample -= std::min(nextSample, allocatedBytes);
+        nextReport = groupMember != nullptr ? GroupReportStep : SIZE_MAX;
+        allocatedBytes = 0;
+        updateBudget();
+        collectDue.store(allocationBudget == 0, std::memory_order_relaxed);
+        if (groupMember != nullptr) {
+            groupMember->state->collected(*groupMember, lastGC, objectBytes);
+        }
+        notify(GCEvent::CollectionEnd);
+    }
+
+    void GarbageCollector::recordPause(std::size_t elapsedTime) noexcept {
+        totals.pauses.add(static_cast<std::size_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(Duration(elapsedTime)).count()));
+    }
+
+    void GarbageCollector::notify(GCEvent event) {
+        for (auto &callback : callbacks) {
+            callback.second(event, lastGC);
+        }
+    }
+
+    std::size_t GarbageCollector::addEventCallback(GCEventCallback callback) {
+        callbacks.emplace_back(nextCallbackId, std::move(callback));
+        return nextCallbackId++;
+    }
+
+    void GarbageCollector::removeEventCallback(std::size_t id) {
+        callbacks.erase(std::remove_if(callbacks.begin(), callbacks.end(),
+            [id](const std::pair<std::size_t, GCEventCallback> &c) { return c.first == id; }), callbacks.end());
+    }
+
+    void GCPauseHistogram::add(std::size_t microseconds) noexcept {
+        std::size_t i = 0;
+        while (i + 1 < BucketNum && microseconds >= bucketLimit(i)) {
+            ++i;
+        }
+        ++buckets[i];
+        ++total;
+    }
+
+    std::size_t GCPauseHistogram::percentile(double p) const noexcept {
+        auto wanted = static_cast<std::size_t>(p * total + 0.5);
+        std::size_t seen = 0;
+        for (std::size_t i = 0; i < BucketNum; ++i) {
+            seen += buckets[i];
+            if (seen >= wanted && seen > 0) {
+                return bucketLimit(i);
+            }
+        }
+        return 0;
+    }
+
+    GCTraceRecorder::GCTraceRecorder(GarbageCollector &gc) : gc(gc) {
+        callbackId = gc.addEventCallback([this](GCEvent event, const GCStatistics &stats) {
+            if (event == GCEvent::CollectionEnd) {
+                std::lock_guard<std::mutex> guard(lock);
+                records.push_back(Record{ stats, std::hash<std::thread::id>()(std::this_thread::get_id()) });
+            }
+        });
+    }
+
+    GCTraceRecorder::~GCTraceRecorder() {
+        gc.removeEventCallback(callbackId);
+    }
+
+    void GCTraceRecorder::clear() {
+        std::lock_guard<std::mutex> guard(lock);
+        records.clear();
+    }
+
+    // a complete event for the pause, containing one for each phase
+    void GCTraceRecorder::write(std::ostream &out) const {
+        auto us = [](std::size_t ticks) {
+            return std::chrono::duration<double, std::micro>(Duration(ticks)).count();
+        };
+        std::lock_guard<std::mutex> guard(lock);
+        out << "{\"traceEvents\": [";
+        const char *separator = "\n";
+        for (auto &r : records) {
+            auto &stats = r.stats;
+            auto start = us(stats.endTime - stats.elapsedTime);
+            auto event = [&](const char *name, double ts, double dur) {
+                out << separator << "{\"name\": \"" << name << "\", \"cat\": \"gc\", \"ph\": \"X\", \"pid\": 1"
+                    << ", \"tid\": " << (r.thread % 1000000) << ", \"ts\": " << ts << ", \"dur\": " << dur;
+                separator = ",\n";
+            };
+            event(stats.minor ? "minor collection" : "collection", start, us(stats.elapsedTime));
+            out << ", \"args\": {\"collected\": " << stats.collected << ", \"notCollected\": " << stats.notCollected
+                << ", \"collectedBytes\": " << stats.collectedBytes << ", \"liveBytes\": " << stats.liveBytes
+                << ", \"promoted\": " << stats.promoted << "}}";
+            event("mark", start, us(stats.markTime));
+            out << "}";
+            event("sweep", start + us(stats.markTime), us(stats.sweepTime));
+            out << "}";
+        }
+        out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    }
+
+    namespace details {
+        std::string demangle(const char *name) {
+#ifdef __GNUG__
+            int status = 0;
+            char *readable = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+            if (readable != nullptr) {
+                std::string result(readable);
+                std::free(readable);
+                return result;
+            }
+#endif
+            return name;
+        }
+
+        // return addresses of the calling thread without its innermost `skip` frames
+        static std::vector<void*> captureStack(std::size_t depth, std::size_t skip) {
+            std::vector<void*> frames;
+            if (depth == 0) {
+                return frames;
+            }
+            frames.resize(depth + skip);
+#if defined(_WIN32)
+            frames.resize(CaptureStackBackTrace(0, static_cast<DWORD>(frames.size()), frames.data(), nullptr));
+#elif defined(__GLIBC__) || defined(__APPLE__)
+            frames.resize(static_cast<std::size_t>(backtrace(frames.data(), static_cast<int>(frames.size()))));
+#else
+            frames.clear();
+#endif
+            frames.erase(frames.begin(), frames.begin() + std::min(skip, frames.size()));
+            return frames;
+        }
+
+        void GCCensus::add(GCObject *object) {
+            auto type = vtableOf(object);
+            if (type != lastType) {
+                auto found = counts.find(type);
+                if (found == counts.end()) {
+#ifdef TINYGC_RTTI
+                    found = counts.emplace(type, Count{ demangle(typeid(*object).name()), 0, 0 }).first;
+#else
+                    std::ostringstream name;
+                    name << "vtable " << type;
+                    found = counts.emplace(type, Count{ name.str(), 0, 0 }).first;
+#endif
+                }
+                lastType = type;
+                last = &(found->second);
+            }
+            ++(last->objects);
+            last->bytes += pooled ? GCPage::of(object)->objectSize : object->GCObjectSize();
+        }
+
+        void GCCensus::merge(const GCCensus &other) {
+            for (auto &c : other.counts) {
+                auto found = counts.find(c.first);
+                if (found == counts.end()) {
+                    counts.insert(c);
+                } else {
+                    found->second.objects += c.second.objects;
+                    found->second.bytes += c.second.bytes;
+                }
+            }
+        }
+
+        void GCCensus::clear() noexcept {
+            counts.clear();
+            lastType = nullptr;
+            last = nullptr;
+        }
+
+#ifdef TINYGC_COMPACT_HEADER
+        GCTypeTable::Entry GCTypeTable::entries[GCTypeTable::Capacity];
+        std::size_t GCTypeTable::typeNum = 0;
+        std::mutex GCTypeTable::lock;
+
+        // types without a descriptor are left out, they are not found either
+        bool GCTypeTable::add(const void *type, const GCTraceDescriptor *descriptor) {
+            if (descriptor == nullptr) {
+                return false;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            auto i = hash(type);
+            for (; entries[i].type.load(std::memory_order_relaxed) != nullptr; i = (i + 1) % Capacity) {
+                if (entries[i].type.load(std::memory_order_relaxed) == type) {
+                    return true;
+                }
+            }
+            if (typeNum == MaxTypes) {
+                return false;
+            }
+            entries[i].descriptor = descriptor;
+            entries[i].type.store(type, std::memory_order_release);
+            ++typeNum;
+            return true;
+        }
+#endif
+    }
+
+    GCHeapProfiler::GCHeapProfiler(GarbageCollector &gc, std::size_t sampleBytes, std::size_t stackDepth)
+        : gc(gc), sampleBytes(std::max<std::size_t>(sampleBytes, 1)), stackDepth(stackDepth),
+          random((0x9E3779B97F4A7C15ull ^ reinterpret_cast<std::uintptr_t>(this)) | 1) {
+        gc.setProfiler(this);
+    }
+
+    GCHeapProfiler::~GCHeapProfiler() {
+        gc.setProfiler(nullptr);
+    }
+
+    // a sample point falls on every byte with the same chance, so that an allocation of
+    // `size` bytes is sampled with probability 1 - exp(-size / sampleBytes)
+    std::size_t GCHeapProfiler::nextInterval() {
+        random ^= random << 13;     // xorshift64
+        random ^= random >> 7;
+        random ^= random << 17;
+        double u = (static_cast<double>(random >> 11) + 1) / 9007199254740992.0;   // in (0, 1]
+        return static_cast<std::size_t>(-std::log(u) * static_cast<double>(sampleBytes)) + 1;
+    }
+
+    double GCHeapProfiler::scale(std::size_t num, std::size_t bytes) const {
+        if (num == 0) {
+            return 0;
+        }
+        double size = static_cast<double>(bytes) / static_cast<double>(num);
+        return 1 / (1 - std::exp(-size / static_cast<double>(sampleBytes)));
+    }
+
+    // called from allocationEvent, whose frame and this one are left out of the stack
+    void GCHeapProfiler::sample(GCObject *object, std::size_t bytes, const char *type) {
+        auto stack = details::captureStack(stackDepth, 2);
+        std::string key(reinterpret_cast<const char*>(&type), sizeof(type));   // one name per type
+        key.append(reinterpret_cast<const char*>(stack.data()), stack.size() * sizeof(void*));
+        auto found = siteIndex.find(key);
+        if (found == siteIndex.end()) {
+            found = siteIndex.emplace(std::move(key), sites.size()).first;
+            sites.push_back(Site{ type, std::move(stack), 0, 0, 0, 0 });
+        }
+        auto &site = sites[found->second];
+        ++(site.sampledNum);
+        site.sampledBytes += bytes;
+        ++(site.liveNum);
+        site.liveBytes += bytes;
+        samples.push_back(Sample{ object, found->second, bytes });
+    }
+
+    void GCHeapProfiler::collected(GCMarker &m) {
+        std::size_t kept = 0;
+        for (auto &s : samples) {
+            if (m.isLive(s.object)) {
+                samples[kept++] = s;
+            } else {
+                --(sites[s.site].liveNum);
+                sites[s.site].liveBytes -= s.bytes;
+            }
+        }
+        samples.resize(kept);
+        if (m.census == &marking) {
+            census.counts.swap(marking.counts);
+            marking.clear();
+            m.census = nullptr;
+        }
+    }
+
+    void GCHeapProfiler::clear() {
+        sites.clear();
+        siteIndex.clear();
+        samples.clear();
+    }
+
+    std::vector<GCHeapProfiler::TypeCount> GCHeapProfiler::getCensus() const {
+        std::vector<TypeCount> result;
+        for (auto &c : census.counts) {
+            result.push_back(TypeCount{ c.second.type, c.second.objects, c.second.bytes });
+        }
+        std::sort(result.begin(), result.end(), [](const TypeCount &a, const TypeCount &b) {
+            return a.bytes > b.bytes;
+        });
+        return result;
+    }
+
+    void GCHeapProfiler::write(std::ostream &out) const {
+        struct Estimate {
+            const Site *site;
+            double liveNum, liveBytes, allocatedNum, allocatedBytes;
+        };
+        std::vector<Estimate> estimates;
+        for (auto &site : sites) {
+            auto liveScale = scale(site.liveNum, site.liveBytes);
+            auto allocatedScale = scale(site.sampledNum, site.sampledBytes);
+            estimates.push_back(Estimate{ &site, site.liveNum * liveScale, site.liveBytes * liveScale,
+                site.sampledNum * allocatedScale, site.sampledBytes * allocatedScale });
+        }
+        std::sort(estimates.begin(), estimates.end(), [](const Estimate &a, const Estimate &b) {
+            return a.liveBytes != b.liveBytes ? a.liveBytes > b.liveBytes : a.allocatedBytes > b.allocatedBytes;
+        });
+        out << "heap profile: " << samples.size() << " live samples, one every " << sampleBytes 
+            << " allocated bytes on average\n"
+            << "live bytes, live objects, allocated bytes, allocated objects, type [@ stack]\n";
+        auto round = [](double x) { return static_cast<std::size_t>(x + 0.5); };
+        for (auto &e : estimates) {
+            out << round(e.liveBytes) << ", " << round(e.liveNum) << ", " 
+                << round(e.allocatedBytes) << ", " << round(e.allocatedNum) << ", " << e.site->type;
+            if (!e.site->stack.empty()) {
+                out << " @";
+                for (auto address : e.site->stack) {
+                    out << " 0x" << std::hex << reinterpret_cast<std::uintptr_t>(address) << std::dec;
+                }
+            }
+            out << "\n";
+        }
+    }
+
+    // the counts are those of the samples, pprof scales them by the rate in the header
+    void GCHeapProfiler::writePprof(std::ostream &out) const {
+        std::size_t liveNum = 0, liveBytes = 0, sampledNum = 0, sampledBytes = 0;
+        for (auto &site : sites) {
+            liveNum += site.liveNum;
+            liveBytes += site.liveBytes;
+            sampledNum += site.sampledNum;
+            sampledBytes += site.sampledBytes;
+        }
+        out << "heap profile: " << liveNum << ": " << liveBytes << " [" << sampledNum << ": " << sampledBytes 
+            << "] @ heap_v2/" << sampleBytes << "\n";
+        for (auto &site : sites) {
+            out << site.liveNum << ": " << site.liveBytes << " [" << site.sampledNum << ": " << site.sampledBytes << "] @";
+            for (auto address : site.stack) {
+                out << " 0x" << std::hex << reinterpret_cast<std::uintptr_t>(address) << std::dec;
+            }
+            out << "\n";
+        }
+#ifdef __linux__
+        std::ifstream maps("/proc/self/maps");
+        if (maps) {
+            out << "\nMAPPED_LIBRARIES:\n" << maps.rdbuf();
+        }
+#endif
+    }
+
+    void GCHeapProfiler::writeCensus(std::ostream &out) const {
+        auto counts = getCensus();
+        std::size_t objects = 0, bytes = 0;
+        for (auto &c : counts) {
+            objects += c.objects;
+            bytes += c.bytes;
+        }
+        out << "census: " << objects << " live objects, " << bytes << " bytes\n"
+            << "bytes, objects, type\n";
+        for (auto &c : counts) {
+            out << c.bytes << ", " << c.objects << ", " << c.type << "\n";
+        }
+    }
+
+    void GarbageCollector::setPolicy(std::unique_ptr<GCPolicy> p) {
+        policy = (p != nullptr) ? std::move(p) : std::unique_ptr<GCPolicy>(new GCDefaultPolicy());
+        updateBudget();
+        collectDue.store(allocatedBytes >= allocationBudget, std::memory_order_relaxed);
+    }
+
+    void GarbageCollector::setHeapLimit(std::size_t soft, std::size_t hard) {
+        softLimit = soft;
+        hardLimit = (hard != 0) ? hard : SIZE_MAX;
+        allocationLimit = sharedHeap ? SIZE_MAX : hardLimit;
+        updateBudget();
+        collectDue.store(allocatedBytes >= allocationBudget, std::memory_order_relaxed);
+    }
+
+    // the policy's budget, cut down to what is left below the soft limit
+    void GarbageCollector::updateBudget() {
+        allocationBudget = policy->allocationBudget(lastGC);
+        if (softLimit != 0) {
+            auto room = objectBytes < softLimit ? softLimit - objectBytes : 0;
+            allocationBudget = std::min(allocationBudget, allocatedBytes + room);
+        }
+        updateEventBytes();
+    }
+
+    // once the budget is used up collectDue stays set until the next collection
+    void GarbageCollector::updateEventBytes() noexcept {
+        eventBytes = allocatedBytes < allocationBudget ? allocationBudget : SIZE_MAX;
+        if (profiler != nullptr) {
+            eventBytes = std::min(eventBytes, nextSample);
+        }
+        eventBytes = std::min(eventBytes, nextReport);
+    }
+
+    // the allocation used up the budget, is sampled or reports the heap to the group
+    void GarbageCollector::allocationEvent(GCObject *p, std::size_t bytes, const char* (*type)()) {
+        if (allocatedBytes >= allocationBudget) {
+            collectDue.store(true, std::memory_order_relaxed);
+        }
+        if (profiler != nullptr && allocatedBytes >= nextSample) {
+            profiler->sample(p, bytes, type());
+            nextSample = allocatedBytes + profiler->nextInterval();
+        }
+        if (groupMember != nullptr && allocatedBytes >= nextReport) {
+            nextReport = allocatedBytes + GroupReportStep;
+            groupMember->state->report(*groupMember, objectBytes);
+        }
+        updateEventBytes();
+    }
+
+    void GarbageCollector::setProfiler(GCHeapProfiler *p) {
+        if (p != nullptr && profiler != nullptr) {
+            throw std::logic_error("TinyGC: the collector has a heap profiler already");
+        }
+        profiler = p;
+        marker.census = nullptr;    // a running incremental cycle is not counted
+        nextSample = (p != nullptr) ? allocatedBytes + p->nextInterval() : SIZE_MAX;
+        updateEventBytes();
+    }
+
+    details::GCCensus* GarbageCollector::startCensus() {
+        if (profiler == nullptr) {
+            return nullptr;
+        }
+        profiler->marking.clear();
+        profiler->marking.pooled = allocatorType == GCAllocatorType::Pool;
+        return &(profiler->marking);
+    }
+
+    void* GarbageCollector::allocateMemory(std::size_t bytes) {
+        try {
+            return ::operator new(bytes);
+        } catch (const std::bad_alloc &) {
+            relieveMemory(bytes, true);
+            return ::operator new(bytes);
+        }
+    }
+
+    // nothing is traced unless allocations may collect, every pointer held across them is then rooted;
+    // a thread of a shared heap runs out of pages under the heap lock and can only return free pages
+    void GarbageCollector::relieveMemory(std::size_t bytes, bool outOfMemory) {
+        ++(totals.pressureEvents);
+        if (sharedHeap) {
+            pool.trim();
+            return;
+        }
+        if (sweepPending) {
+            sweepSome(SIZE_MAX);
+        }
+        if (finalizer != nullptr) {
+            waitFinalization();
+            reclaimFinalized();
+        }
+        if (autoCollect && (outOfMemory || objectBytes + bytes > hardLimit)) {
+            collect();
+            sweepSome(SIZE_MAX);
+            if (finalizer != nullptr) {
+                waitFinalization();
+                reclaimFinalized();
+            }
+        }
+        pool.trim();
+        if (!outOfMemory && objectBytes + bytes > hardLimit) {
+            throw std::bad_alloc();
+        }
+    }
+
+    std::size_t GarbageCollector::bytesOf(GCObject *obj) const noexcept {
+        return allocatorType == GCAllocatorType::Pool ? details::GCPage::of(obj)->objectSize 
+            : obj->GCObjectSize();
+    }
+
+    void GarbageCollector::countAllocated(std::size_t bytes) noexcept {
+        objectBytes += bytes;
+        allocatedBytes += bytes;
+        if (allocatedBytes >= allocationBudget) {
+            collectDue.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    std::size_t GCDefaultPolicy::allocationBudget(const GCStatistics &last) {
+        if (!last.hasValue) {
+            return heapLimit != 0 ? std::min(minBudget, heapLimit) : minBudget;
+        }
+        auto budget = std::max(minBudget, static_cast<std::size_t>(last.liveBytes * (growthFactor - 1.0)));
+        // allocating at the last rate, the next pause is due after enough mutator time
+        if (targetGCFraction > 0.0 && targetGCFraction < 1.0 && last.mutatorTime > 0) {
+            double mutatorTime = last.elapsedTime * (1.0 - targetGCFraction) / targetGCFraction;
+            double paced = last.allocatedBytes * (mutatorTime / last.mutatorTime);
+            if (paced > budget) {
+                budget = paced < static_cast<double>(SIZE_MAX / 2) ? static_cast<std::size_t>(paced) : SIZE_MAX / 2;
+            }
+        }
+        if (heapLimit != 0) {
+            budget = std::min(budget, last.liveBytes < heapLimit ? heapLimit - last.liveBytes : 0);
+        }
+        return budget;
+    }
+
+    // destroy the unmarked objects of a page and clear the marks of the others
+    // in GCMarkMode::Bitmap only the dead objects are touched
+    void GarbageCollector::sweepPage(details::GCPage *page) {
+        auto words = page->usedWords();
+        if (details::isTrivialClass(page->sizeClass)) {
+            sweepTrivialPage(page, words);
+        } else {
+            bool bitmap = (markMode == GCMarkMode::Bitmap);
+            bool anyMarked = bitmap && (page->markEpoch == markEpoch);
+            for (std::size_t w = 0; w < words; ++w) {
+                auto bits = page->allocBits[w];
+                if (bitmap) {
+                    bits &= anyMarked ? ~(page->markBits[w]) : ~std::uint64_t(0);
+                }
+                for (; bits != 0; bits &= bits - 1) {
+                    auto index = w * 64 + details::lowestBit(bits);
+                    auto obj = reinterpret_cast<GCObject*>(page->begin + index * page->objectSize);
+#ifndef TINYGC_COMPACT_HEADER
+                    if (!bitmap && getMark(obj->GCMaster) != 0) {
+                        obj->GCMaster = clearMark(obj->GCMaster);
+                        continue;
+                    }
+#endif
+                    page->allocBits[w] &= ~(std::uint64_t(1) << (index % 64));
+                    finalizeObject(obj);
+                    --objectNum;
+                    if (generational) {
+                        releaseGenerations(page, index);
+                    }
+                }
+            }
+        }
+        // a major collection promotes every survivor, see startSweep
+        if (generational && page->youngNum > 0) {
+            for (std::size_t w = 0; w < words; ++w) {
+                auto young = page->allocBits[w] & ~(page->oldBits[w]);
+                page->oldBits[w] |= young;
+                page->ageBits[0][w] = page->ageBits[1][w] = 0;
+                oldNum += details::popCount(young);
+            }
+            page->youngNum = 0;
+        }
+    }
+
+    // objects without destructors die a bitmap word at a time, in GCMarkMode::Bitmap the
+    // dead ones are only touched to link their slots, and not at all when the whole page dies
+    void GarbageCollector::sweepTrivialPage(details::GCPage *page, std::size_t words) {
+        bool bitmap = (markMode == GCMarkMode::Bitmap);
+        bool anyMarked = bitmap && (page->markEpoch == markEpoch);
+        std::uint64_t dead[details::BitmapWords];
+        std::size_t deadNum = 0;
+        for (std::size_t w = 0; w < words; ++w) {
+            auto live = page->allocBits[w];
+            if (bitmap) {
+                live &= anyMarked ? page->markBits[w] : std::uint64_t(0);
+            } else {
+#ifndef TINYGC_COMPACT_HEADER
+                for (auto bits = live; bits != 0; bits &= bits - 1) {
+                    auto index = w * 64 + details::lowestBit(bits);
+                    auto obj = reinterpret_cast<GCObject*>(page->begin + index * page->objectSize);
+                    if (getMark(obj->GCMaster) != 0) {
+                        obj->GCMaster = clearMark(obj->GCMaster);
+                    } else {
+                        live &= ~(std::uint64_t(1) << (index % 64));
+                    }
+                }
+#endif
+            }
+            dead[w] = page->allocBits[w] & ~live;
+            deadNum += details::popCount(dead[w]);
+            if (generational && dead[w] != 0) {
+                auto old = details::popCount(dead[w] & page->oldBits[w]);
+                oldNum -= old;
+                page->youngNum -= details::popCount(dead[w]) - old;
+                page->oldBits[w] &= ~dead[w];
+                page->ageBits[0][w] &= ~dead[w];
+                page->ageBits[1][w] &= ~dead[w];
+                page->rememberedBits[w] &= ~dead[w];
+            }
+        }
+        if (deadNum != page->usedNum) {
+            for (std::size_t w = 0; w < words; ++w) {
+                releaseTrivial(page, w, dead[w]);
+            }
+            return;
+        }
+        // nothing survived nor is under construction, the page goes back whole
+        std::memset(page->allocBits, 0, words * sizeof(std::uint64_t));
+        page->usedNum = 0;
+        objectNum -= deadNum;
+        objectBytes -= deadNum * page->objectSize;
+    }
+
+    // the slots of dead objects without destructors join the free list at once,
+    // also with background finalization
+    void GarbageCollector::releaseTrivial(details::GCPage *page, std::size_t word, std::uint64_t dead) noexcept {
+        if (dead == 0) {
+            return;
+        }
+        auto deadNum = details::popCount(dead);
+        page->allocBits[word] &= ~dead;
+        page->usedNum -= deadNum;
+        objectNum -= deadNum;
+        objectBytes -= deadNum * page->objectSize;
+        for (; dead != 0; dead &= dead - 1) {
+            auto slot = page->begin + (word * 64 + details::lowestBit(dead)) * page->objectSize;
+            *reinterpret_cast<void**>(slot) = page->freeList;
+            page->freeList = slot;
+        }
+    }
+
+    // the generation bits of a dead object
+    void GarbageCollector::releaseGenerations(details::GCPage *page, std::size_t index) noexcept {
+        if (details::testBit(page->oldBits, index)) {
+            details::clearBit(page->oldBits, index);
+            --oldNum;
+        } else {
+            details::clearBit(page->ageBits[0], index);
+            details::clearBit(page->ageBits[1], index);
+            --(page->youngNum);
+        }
+        details::clearBit(page->rememberedBits, index);
+    }
+
+    // sweep one unswept page of a size class, SizeClassNum for large pages,
+    // pages left empty go back to the pool
+    // returns the number of objects examined, 0 if there was no unswept page
+    std::size_t GarbageCollector::sweepNextPage(std::size_t sizeClass) {
+        auto &unswept = (sizeClass == details::SizeClassNum) 
+            ? pool.unsweptLarge : pool.classes[sizeClass].unswept;
+        auto page = unswept;
+        if (page == nullptr) {
+            return 0;
+        }
+        unswept = page->next;
+        auto examined = page->usedNum;
+        sweepPage(page);
+        if (page->usedNum == 0) {
+            pool.releasePage(page);
+        } else if (page->sizeClass != details::SizeClassNum || page->allocBits[0] != 0) {
+            pool.append(page);
+        }   // else the finalizer frees the large page with its object
+        if (finalizeBatch.size() >= FinalizeBatchSize) {
+            submitFinalization();
+        }
+        return examined > 0 ? examined : 1;
+    }
+
+    // objects allocated from now on are not swept in this cycle
+    void GarbageCollector::startSweep() {
+        if (allocatorType == GCAllocatorType::Pool) {
+            if (generational) {
+                clearNursery();     // objects allocated from now on are young again
+            }
+            pool.detach();
+            nextSweepClass = 0;
+        } else {
+            unsweptObjects = listHead.ptr;
+            listHead.ptr = nullptr;
+        }
+        sweepPending = true;
+    }
+
+    std::size_t GarbageCollector::sweepSome(std::size_t budget) {
+        if (!sweepPending) {
+            return 0;
+        }
+        auto before = objectNum;
+        std::size_t examined = 0;
+        if (allocatorType == GCAllocatorType::Pool) {
+            while (examined < budget && pool.unsweptLarge != nullptr) {
+                examined += sweepNextPage(details::SizeClassNum);
+            }
+            while (examined < budget && nextSweepClass < details::SizeClassNum) {
+                auto n = sweepNextPage(nextSweepClass);
+                if (n == 0) {
+                    ++nextSweepClass;
+                }
+                examined += n;
+            }
+            sweepPending = (pool.unsweptLarge != nullptr || nextSweepClass < details::SizeClassNum);
+        } else {
+#ifndef TINYGC_COMPACT_HEADER
+            for (; examined < budget && unsweptObjects != nullptr; ++examined) {
+                auto curr = unsweptObjects;
+                unsweptObjects = curr->GCNextObject;
+                if (getMark(curr->GCMaster) != 0) {
+                    curr->GCMaster = clearMark(curr->GCMaster);
+                    curr->GCNextObject = listHead.ptr;
+                    listHead.ptr = curr;
+                } else {
+                    finalizeObject(curr);
+                    --objectNum;
+                }
+            }
+#endif
+            sweepPending = (unsweptObjects != nullptr);
+        }
+        if (!sweepPending) {
+            submitFinalization();
+        }
+        return before - objectNum;
+    }
+
+    void GarbageCollector::sweep() {
+        if (allocatorType == GCAllocatorType::Pool) {
+            startSweep();
+            sweepSome(SIZE_MAX);
+            return;
+        }
+#ifndef TINYGC_COMPACT_HEADER
+        auto objectListHead = listHead.ptr;
+        auto prev = objectListHead;
+        if(prev != nullptr) {
+            for(auto curr = prev->GCNextObject; curr != nullptr; ) {
+                auto next = curr->GCNextObject;
+                if(getMark(curr->GCMaster) != 0) {
+                    curr->GCMaster = clearMark(curr->GCMaster);
+                    prev = curr;
+                } else { // collect
+                    prev->GCNextObject = next;
+                    finalizeObject(curr);
+                    --objectNum;
+                }
+                curr = next;
+            }
+
+            if(getMark(objectListHead->GCMaster) != 0) {
+                objectListHead->GCMaster = clearMark(objectListHead->GCMaster);
+            } else {
+                auto temp = objectListHead->GCNextObject;
+                finalizeObject(objectListHead);
+                --objectNum;
+                listHead.ptr = temp;
+            }
+        }
+        submitFinalization();
+#endif
+    }
+
+    // the object is no longer reachable from the lists or bitmaps of the collector,
+    // a pooled slot stays out of its free list until the object is destroyed
+    // and pooled batches are handed over between pages, as the finalizer frees large pages
+    void GarbageCollector::finalizeObject(GCObject *obj) {
+        objectBytes -= bytesOf(obj);
+        if (allocatorType == GCAllocatorType::Pool && details::GCPage::of(obj)->sizeClass == details::SizeClassNum) {
+            --(pool.largeNum);
+            pool.largeBytes -= details::GCPage::of(obj)->objectSize;
+        }
+        if (finalizer != nullptr) {
+            finalizeBatch.push_back(obj);
+            if (allocatorType != GCAllocatorType::Pool && finalizeBatch.size() >= FinalizeBatchSize) {
+                submitFinalization();
+            }
+        } else if (allocatorType == GCAllocatorType::Pool) {
+            auto page = details::GCPage::of(obj);
+            obj->~GCObject();
+            *reinterpret_cast<void**>(obj) = page->freeList;
+            page->freeList = obj;
+            --(page->usedNum);
+        } else {
+            delete obj;
+        }
+    }
+
+    void GarbageCollector::submitFinalization() {
+        if (finalizer != nullptr) {
+            finalizer->submit(finalizeBatch);
+        }
+    }
+
+    // the destroyed slots join the free lists of their pages
+    void GarbageCollector::reclaimFinalized() {
+        if (finalizer == nullptr || allocatorType != GCAllocatorType::Pool) {
+            return;
+        }
+        std::vector<void*> slots;
+        finalizer->takeFinalized(slots);
+        for (auto slot : slots) {
+            auto page = details::GCPage::of(slot);
+            *static_cast<void**>(slot) = page->freeList;
+            page->freeList = slot;
+            --(page->usedNum);
+            pool.classes[page->sizeClass].current = nullptr;    // the page may lie behind the cursor
+        }
+    }
+
+    void GarbageCollector::setBackgroundFinalization(bool enable) {
+        if (enable == (finalizer != nullptr)) {
+            return;
+        }
+        if (enable) {
+            finalizer = new details::GCFinalizer(allocatorType == GCAllocatorType::Pool);
+        } else {
+            waitFinalization();
+            delete finalizer;
+            finalizer = nullptr;
+        }
+    }
+
+    void GarbageCollector::waitFinalization() {
+        if (finalizer != nullptr) {
+            submitFinalization();
+            finalizer->wait();
+            if (!sharedHeap) {
+                reclaimFinalized();     // a shared heap reclaims while the world is stopped
+            }
+        }
+    }
+
+    std::size_t GarbageCollector::getFinalizationBacklog() const {
+        return finalizeBatch.size() + (finalizer != nullptr ? finalizer->getBacklog() : 0);
+    }
+
+    GarbageCollector::~GarbageCollector() {
+        if (groupMember != nullptr) {
+            groupMember->state->remove(*this);
+        }
+        if (finalizer != nullptr) {
+            submitFinalization();
+            delete finalizer;   // destroys the queued objects
+        }
+        delete threads;
+        delete ownerStack;
+        marker.releaseSegments();
+        delete markReserve;
+        if (allocatorType == GCAllocatorType::Pool) {
+            auto destroyAll = [](details::GCPage *page) {
+                for (; page != nullptr; page = page->next) {
+                    if (details::isTrivialClass(page->sizeClass)) {
+                        continue;
+                    }
+                    for (std::size_t w = 0; w < details::BitmapWords; ++w) {
+                        for (auto bits = page->allocBits[w]; bits != 0; bits &= bits - 1) {
+                            auto index = w * 64 + details::lowestBit(bits);
+                            reinterpret_cast<GCObject*>(page->begin + index * page->objectSize)->~GCObject();
+                        }
+                    }
+                }
+            };
+            for (auto &c : pool.classes) {
+                destroyAll(c.head);
+                destroyAll(c.unswept);
+            }
+            destroyAll(pool.largePages);
+            destroyAll(pool.unsweptLarge);
+#ifdef TINYGC_HEAP_IMAGE
+            for (auto &image : images) {
+                munmap(image.first, image.second);
+            }
+#endif
+            return;
+        }
+#ifndef TINYGC_COMPACT_HEADER
+        for (auto objectListHead : { listHead.ptr, unsweptObjects }) {
+            for(auto p = objectListHead; p != nullptr;) {
+                auto next = p->GCNextObject;
+                destroyObject(p);
+                p = next;
+            }
+        }
+#endif
+    }
+
+    void GarbageCollector::setMarkMode(GCMarkMode mode) {
+        if (allocatorType == GCAllocatorType::Pool) {
+            if (marking) {
+                finishMarking(Clock::now().time_since_epoch().count());
+            }
+            sweepSome(SIZE_MAX);    // pending sweeping reads the marks of the old mode
+            if (!generational && !details::CompactHeader) {
+                markMode = mode;
+            }
+        }
+    }
+
+    void GarbageCollector::collect() {
+        if (!sharedHeap) {
+            collectNow();
+            return;
+        }
+        if (!stopTheWorld()) {
+            return;     // another thread has just collected
+        }
+        try {
+            collectNow();
+        } catch (...) {
+            resumeTheWorld();
+            throw;
+        }
+        resumeTheWorld();
+    }
+
+    void GarbageCollector::collectNow() {
+        auto start = Clock::now();
+        if (marking) {
+            finishMarking(start.time_since_epoch().count());
+            return;
+        }
+        sweepSome(SIZE_MAX);    // leftovers of the previous cycle
+        reclaimFinalized();
+        notify(GCEvent::CollectionStart);
+        auto totalNum = objectNum;
+        auto totalBytes = objectBytes;
+
+        auto markStart = Clock::now();
+        auto notCollected = mark();
+        auto sweepStart = Clock::now();
+        sweepMajor();
+        std::size_t compactedBytes = 0;
+        double fragmentation = 0;
+        if (compactRequested) {
+            sweepSome(SIZE_MAX);    // the pages are back in their lists
+            compactedBytes = compactPages(fragmentation);
+        }
+
+        auto end = Clock::now();
+        recordPause((end - start).count());
+        endCycle(totalNum, totalBytes, notCollected, lazySweep && !compactRequested, 
+            (sweepStart - markStart).count(), (end - start).count(), end.time_since_epoch().count());
+        lastGC.compactedBytes = compactedBytes;
+        lastGC.fragmentation = fragmentation;
+        reportCycle();
+    }
+
+    void GarbageCollector::compact() {
+        if (allocatorType != GCAllocatorType::Pool) {
+            collect();
+            return;
+        }
+        if (marking) {
+            collect();      // the gray objects of the running cycle are not relocated
+        }
+        compactRequested = true;
+        try {
+            collect();
+        } catch (...) {
+            compactRequested = false;
+            throw;
+        }
+        compactRequested = false;
+    }
+
+    // survivors of sparse pages move to other pages of their size class and leave a
+    // forwarding address in their old slot, then every reference is updated and the
+    // emptied pages are freed; returns the bytes moved
+    std::size_t GarbageCollector::compactPages(double &fragmentation) {
+        if (finalizer != nullptr) {     // slots waiting for destructors would keep pages alive
+            submitFinalization();
+            finalizer->wait();
+            reclaimFinalized();
+        }
+        pinPages();
+        std::size_t moved = 0;
+        for (std::size_t k = 0; k < details::SizeClassNum; ++k) {
+            moved += evacuate(k);
+        }
+        if (moved > 0) {
+            relocateReferences();
+        }
+        std::size_t slotBytes = 0, freeBytes = 0;
+        for (std::size_t k = 0; k < details::SizeClassNum; ++k) {
+            if (moved > 0) {
+                pool.dropEvacuated(k);
+            }
+            for (auto page = pool.classes[k].head; page != nullptr; page = page->next) {
+                slotBytes += page->end - page->begin;
+                freeBytes += page->end - page->begin - page->usedNum * page->objectSize;
+            }
+        }
+        pool.trim();
+        fragmentation = slotBytes > 0 ? static_cast<double>(freeBytes) / slotBytes : 0;
+        return moved;
+    }
+
+    // objects without a descriptor, or of a pinned type, stay in place, and so do the
+    // children passed by hooks that do not expose the fields themselves
+    void GarbageCollector::pinPages() {
+        GCMarker pinner;
+        pinner.visit = [](GCMarker &, GCObject *child) {
+            auto page = details::GCPage::of(child);
+            if (!page->image) {     // read-only, and never moved anyway
+                page->pinned = true;
+            }
+        };
+        auto pin = [&pinner](GCObject *obj) {
+            auto descriptor = descriptorOf(obj);
+            if (descriptor == nullptr || descriptor->pinned) {
+                details::GCPage::of(obj)->pinned = true;
+            }
+            if (descriptor == nullptr && !obj->GCChildrenMovable()) {
+                obj->GCMarkAllChildren(pinner);
+            }
+        };
+        for (auto &c : pool.classes) {
+            for (auto page = c.head; page != nullptr; page = page->next) {
+                page->pinned = page->evacuating = false;
+            }
+        }
+        for (auto obj : stackObjects) {
+            details::GCPage::of(obj)->pinned = true;    // conservative roots cannot be updated
+        }
+        for (auto &c : pool.classes) {
+            for (auto page = c.head; page != nullptr; page = page->next) {
+                details::forEachObject(page, pin);
+            }
+        }
+        for (auto page = pool.largePages; page != nullptr; page = page->next) {
+            details::forEachObject(page, pin);
+        }
+    }
+
+    // the sparsest pages of a size class are evacuated while their objects
+    // fit into the free slots of the others, returns the bytes moved
+    std::size_t GarbageCollector::evacuate(std::size_t sizeClass) {
+        struct Candidate {
+            details::GCPage *page;
+            std::size_t live;
+        };
+        std::vector<Candidate> candidates;
+        std::size_t freeSlots = 0;
+        for (auto page = pool.classes[sizeClass].head; page != nullptr; page = page->next) {
+            auto capacity = static_cast<std::size_t>(page->end - page->begin) / page->objectSize;
+            freeSlots += capacity - page->usedNum;
+            std::size_t live = 0;
+            for (std::size_t w = 0; w < page->usedWords(); ++w) {
+                live += details::popCount(page->allocBits[w]);
+            }
+            // slots under construction or waiting for destructors are not in allocBits
+            if (!page->pinned && !page->claimed && !page->inNursery && live == page->usedNum 
+                    && live * 100 < capacity * CompactOccupancy) {
+                candidates.push_back(Candidate{ page, live });
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+            return a.live < b.live;
+        });
+        std::size_t movedNum = 0, selected = 0;
+        for (auto &candidate : candidates) {
+            auto capacity = static_cast<std::size_t>(candidate.page->end - candidate.page->begin) 
+                / candidate.page->objectSize;
+            auto remaining = freeSlots - (capacity - candidate.live);
+            if (movedNum + candidate.live > remaining) {
+                break;
+            }
+            freeSlots = remaining;
+            movedNum += candidate.live;
+            candidate.page->evacuating = true;
+            ++selected;
+        }
+        if (selected == 0) {
+            return 0;
+        }
+        auto dest = pool.classes[sizeClass].head;
+        std::size_t moved = 0;
+        for (std::size_t i = 0; i < selected; ++i) {
+            auto page = candidates[i].page;
+            auto words = page->usedWords();
+            for (std::size_t w = 0; w < words; ++w) {
+                for (auto bits = page->allocBits[w]; bits != 0; bits &= bits - 1) {
+                    auto index = w * 64 + details::lowestBit(bits);
+                    auto slot = page->begin + index * page->objectSize;
+                    void *target;
+                    while ((target = dest->evacuating ? nullptr : dest->take()) == nullptr) {
+                        dest = dest->next;  // the selection left enough free slots
+                    }
+                    std::memcpy(target, slot, page->objectSize);
+                    pool.commit(target);
+                    details::copyGenerations(page, index, dest, dest->indexOf(target));
+                    *reinterpret_cast<void**>(slot) = target;
+                    moved += page->objectSize;
+                }
+            }
+        }
+        return moved;
+    }
+
+    // fields of the objects left in place, roots, handles and the remembered sets
+    // take the forwarding addresses
+    void GarbageCollector::relocateReferences() {
+        GCMarker relocator;
+        relocator.relocate = [](GCMarker &, GCObject *child, const void *) {
+            return GCMarker::relocated(child);
+        };
+        auto relocate = [&relocator](GCObject *obj) {
+            auto descriptor = descriptorOf(obj);
+            if (descriptor != nullptr) {
+                auto base = reinterpret_cast<char*>(obj);
+                for (std::size_t i = 0; i < descriptor->fieldNum; ++i) {
+                    auto &field = *reinterpret_cast<GCObject**>(base + descriptor->offsets[i]);
+                    field = GCMarker::relocated(field);
+                }
+            } else if (obj->GCChildrenMovable()) {
+                obj->GCMarkAllChildren(relocator);
+            }
+        };
+        for (auto &c : pool.classes) {
+            for (auto page = c.head; page != nullptr; page = page->next) {
+                if (!page->evacuating) {
+                    details::forEachObject(page, relocate);
+                }
+            }
+        }
+        for (auto page = pool.largePages; page != nullptr; page = page->next) {
+            details::forEachObject(page, relocate);
+        }
+        for (auto end : rootLists()) {
+            for (auto i = end->next; i != end; i = i->next) {
+                i->ptr = GCMarker::relocated(i->ptr);
+            }
+        }
+        for (auto area : handleAreas()) {
+            area->forEach([](GCObject *&handle) { handle = GCMarker::relocated(handle); });
+        }
+        for (auto end : weakLists()) {
+            for (auto i = end->next; i != end; i = i->next) {
+                i->ptr = GCMarker::relocated(i->ptr);
+            }
+        }
+        for (auto set : { &rememberedOwners, &rememberedTargets }) {
+            for (auto &obj : *set) {
+                obj = GCMarker::relocated(obj);
+            }
+        }
+        if (profiler != nullptr) {
+            for (auto &s : profiler->samples) {
+                s.object = GCMarker::relocated(s.object);
+            }
+        }
+    }
+
+    bool GarbageCollector::shouldCollect() const {
+        return collectDue.load(std::memory_order_relaxed);
+    }
+
+    // in generational mode a major collection runs once the old generation has doubled
+    bool GarbageCollector::checkPoint(){
+        if (sharedHeap) {
+            safepoint();
+            if (!shouldCollect()) {
+                return false;
+            }
+            collect();
+            return true;
+        }
+        if (marking || shouldCollect()) {
+            if (generational && oldNum <= majorThreshold && !marking) {
+                collectMinor();
+            } else {
+                collect();
+            }
+            return true;
+        }
+        sweepSome(CheckPointSweepBudget);
+        reclaimFinalized();
+        return false;
+    }
+
+    bool GarbageCollector::checkPoint(std::chrono::microseconds budget) {
+        if (sharedHeap) {
+            return checkPoint();
+        }
+        auto start = Clock::now();
+        if (!marking) {
+            if (!shouldCollect()) {
+                sweepSome(CheckPointSweepBudget);
+                return false;
+            }
+            startMarking();
+        }
+        auto deadline = start + budget;
+        do {
+            if (marker.clearStack(MarkSliceStep)) {
+                finishMarking(start.time_since_epoch().count());
+                return true;
+            }
+        } while (Clock::now() < deadline);
+        auto slice = (Clock::now() - start).count();
+        cycleTime += slice;
+        recordPause(slice);
+        return false;
+    }
+
+    void GarbageCollector::remember(GCObject *obj, std::vector<GCObject*> &set) {
+        auto page = details::GCPage::of(obj);
+        auto index = page->indexOf(obj);
+        if (!details::testBit(page->rememberedBits, index)) {
+            details::setBit(page->rememberedBits, index);
+            set.push_back(obj);
+        }
+    }
+
+    void GarbageCollector::barrierSlow(const GCObject *owner, const GCObject *target) {
+        auto object = const_cast<GCObject*>(target);
+        if (marking) {
+            marker.markOneObject(object);
+        }
+        if (!generational) {
+            return;
+        }
+        auto page = details::GCPage::of(object);
+        if (details::testBit(page->oldBits, page->indexOf(object))) {
+            return;
+        }
+        if (owner == nullptr) {
+            remember(object, rememberedTargets);
+        } else {
+            auto ownerPage = details::GCPage::of(owner);
+            if (details::testBit(ownerPage->oldBits, ownerPage->indexOf(owner))) {
+                remember(const_cast<GCObject*>(owner), rememberedOwners);
+            }
+        }
+    }
+
+    bool GarbageCollector::hasYoungChild(GCObject *obj) {
+        bool found = false;
+        GCMarker visitor;
+        visitor.context = &found;
+        visitor.visit = [](GCMarker &m, GCObject *child) {
+            auto page = details::GCPage::of(child);
+            if (!details::testBit(page->oldBits, page->indexOf(child))) {
+                *static_cast<bool*>(m.context) = true;
+            }
+        };
+        visitor.traceChildren(obj);
+        return found;
+    }
+
+    // destroys the unmarked young objects and ages the marked ones,
+    // objects surviving `promotionAge` minor collections become old
+    void GarbageCollector::sweepNursery(std::vector<GCObject*> &promoted) {
+        auto age0Mask = (promotionAge & 1) ? ~std::uint64_t(0) : std::uint64_t(0);
+        auto age1Mask = (promotionAge & 2) ? ~std::uint64_t(0) : std::uint64_t(0);
+        auto link = &pool.nursery;
+        while (*link != nullptr) {
+            auto page = *link;
+            auto words = page->usedWords();
+            bool anyMarked = (page->markEpoch == markEpoch);
+            for (std::size_t w = 0; w < words; ++w) {
+                auto young = page->allocBits[w] & ~(page->oldBits[w]);
+                if (young == 0) {
+                    continue;
+                }
+                auto live = anyMarked ? (young & page->markBits[w]) : std::uint64_t(0);
+                auto dead = young & ~live;
+                // bit-sliced increment of the 2-bit ages of the live objects
+                auto age0 = page->ageBits[0][w] ^ live;
+                auto age1 = page->ageBits[1][w] ^ (page->ageBits[0][w] & live);
+                auto promote = live & ~(age0 ^ age0Mask) & ~(age1 ^ age1Mask);
+                page->oldBits[w] |= promote;
+                page->ageBits[0][w] = age0 & ~(promote | dead);
+                page->ageBits[1][w] = age1 & ~(promote | dead);
+                page->rememberedBits[w] &= ~dead;
+                page->youngNum -= details::popCount(promote | dead);
+                oldNum += details::popCount(promote);
+                for (auto bits = promote; bits != 0; bits &= bits - 1) {
+                    auto index = w * 64 + details::lowestBit(bits);
+                    promoted.push_back(reinterpret_cast<GCObject*>(page->begin + index * page->objectSize));
+                }
+                if (details::isTrivialClass(page->sizeClass)) {
+                    releaseTrivial(page, w, dead);
+                    continue;
+                }
+                for (auto bits = dead; bits != 0; bits &= bits - 1) {
+                    auto index = w * 64 + details::lowestBit(bits);
+                    auto obj = reinterpret_cast<GCObject*>(page->begin + index * page->objectSize);
+                    page->allocBits[w] &= ~(std::uint64_t(1) << (index % 64));
+                    --objectNum;
+                    finalizeObject(obj);
+                    if (page->sizeClass == details::SizeClassNum) {
+                        *link = page->nextNursery;
+                        pool.unlinkLarge(page);
+                        if (finalizer == nullptr) {
+                            pool.releasePage(page);
+                        }
+                        page = nullptr;
+                        break;
+                    }
+                }
+                if (page == nullptr) {
+                    break;
+                }
+            }
+            if (page != nullptr) {
+                if (page->youngNum == 0) {
+                    *link = page->nextNursery;
+                    page->inNursery = false;
+                } else {
+                    link = &(page->nextNursery);
+                }
+            }
+            if (finalizeBatch.size() >= FinalizeBatchSize) {
+                submitFinalization();
+            }
+        }
+        for (auto &c : pool.classes) {
+            c.current = nullptr;    // reuse the freed slots from the first page on
+        }
+        submitFinalization();
+    }
+
+    // old objects stay remembered while they point to young objects,
+    // young objects stored by an unknown owner stay remembered until promoted
+    void GarbageCollector::updateRemembered(const std::vector<GCObject*> &promoted) {
+        auto isOld = [](GCObject *obj) {
+            auto page = details::GCPage::of(obj);
+            return details::testBit(page->oldBits, page->indexOf(obj));
+        };
+        auto forget = [](GCObject *obj) {
+            auto page = details::GCPage::of(obj);
+            details::clearBit(page->rememberedBits, page->indexOf(obj));
+        };
+        auto targetEnd = std::remove_if(rememberedTargets.begin(), rememberedTargets.end(),
+            [&](GCObject *obj) { return isOld(obj) && (forget(obj), true); });
+        rememberedTargets.erase(targetEnd, rememberedTargets.end());
+        auto ownerEnd = std::remove_if(rememberedOwners.begin(), rememberedOwners.end(),
+            [&](GCObject *obj) { return !hasYoungChild(obj) && (forget(obj), true); });
+        rememberedOwners.erase(ownerEnd, rememberedOwners.end());
+        for (auto obj : promoted) {
+            if (hasYoungChild(obj)) {
+                remember(obj, rememberedOwners);
+            }
+        }
+    }
+
+    // after a major marking, the sweeper clears the bits of the dead entries
+    void GarbageCollector::dropDeadRemembered() {
+        auto isDead = [this](GCObject *obj) {
+            auto page = details::GCPage::of(obj);
+            return page->markEpoch != markEpoch || !details::testBit(page->markBits, page->indexOf(obj));
+        };
+        for (auto set : { &rememberedOwners, &rememberedTargets }) {
+            set->erase(std::remove_if(set->begin(), set->end(), isDead), set->end());
+        }
+    }
+
+    void GarbageCollector::clearNursery() noexcept {
+        while (pool.nursery != nullptr) {
+            auto page = pool.nursery;
+            pool.nursery = page->nextNursery;
+            page->inNursery = false;
+        }
+    }
+
+    // every object becomes old, the remembered set starts empty
+    void GarbageCollector::promoteAll() {
+        clearNursery();
+        for (auto &c : pool.classes) {
+            for (auto page = c.head; page != nullptr; page = page->next) {
+                details::resetGenerations(page, true);
+            }
+        }
+        for (auto page = pool.largePages; page != nullptr; page = page->next) {
+            details::resetGenerations(page, true);
+        }
+        rememberedOwners.clear();
+        rememberedTargets.clear();
+        oldNum = objectNum;
+        majorThreshold = std::max<std::size_t>(2 * oldNum, MinMajorThreshold);
+    }
+
+    void GarbageCollector::setGenerational(bool enable, unsigned age) {
+        if (allocatorType != GCAllocatorType::Pool || enable == generational || (enable && sharedHeap)) {
+            return;
+        }
+        if (enable) {
+            setMarkMode(GCMarkMode::Bitmap);
+            collect();
+            sweepSome(SIZE_MAX);
+            promotionAge = age < 1 ? 1 : (age > 3 ? 3 : age);
+            promoteAll();
+            generational = true;
+        } else {
+            if (marking) {
+                finishMarking(Clock::now().time_since_epoch().count());
+            }
+            sweepSome(SIZE_MAX);    // pending sweeping updates the generations
+            generational = false;
+            clearNursery();
+            rememberedOwners.clear();
+            rememberedTargets.clear();
+        }
+    }
+
+    void GarbageCollector::collectMinor() {
+        if (!generational || marking) {
+            collect();
+            return;
+        }
+        auto start = Clock::now();
+        sweepSome(SIZE_MAX);    // leftovers of the previous major cycle
+        notify(GCEvent::CollectionStart);
+        auto totalNum = objectNum;
+        auto totalBytes = objectBytes;
+
+        ++markEpoch;
+        GCMarker m(markEpoch, markReserve);
+        m.youngOnly = true;
+        scanStacks();
+        for (auto obj : stackObjects) {
+            m.markOneObject(obj);
+            m.clearStack();
+        }
+        auto end = &listHead;
+        for(auto i = listHead.next; i != end; i = i->next) {
+            m.markOneObject(i->ptr);
+            m.clearStack();
+        }
+        handles.forEach([&m](GCObject *handle) {
+            m.markOneObject(handle);
+            m.clearStack();
+        });
+        for (auto owner : rememberedOwners) {
+            m.traceChildren(owner);
+            m.clearStack();
+        }
+        for (auto target : rememberedTargets) {
+            m.markOneObject(target);
+            m.clearStack();
+        }
+        processWeak(m);
+        std::vector<GCObject*> promoted;
+        auto sweepStart = Clock::now();
+        sweepNursery(promoted);
+        updateRemembered(promoted);
+        reclaimFinalized();     // slots the background finalizer has destroyed meanwhile
+
+        auto finish = Clock::now();
+        recordPause((finish - start).count());
+        endCycle(totalNum, totalBytes, objectNum, false, (sweepStart - start).count(), 
+            (finish - start).count(), finish.time_since_epoch().count());
+        lastGC.promoted = promoted.size();
+        lastGC.minor = true;
+        reportCycle();
+    }
+
+    void GarbageCollector::setSharedHeap(bool enable) {
+        if (allocatorType != GCAllocatorType::Pool || enable == sharedHeap) {
+            return;
+        }
+        if (enable) {
+            if (marking) {
+                finishMarking(Clock::now().time_since_epoch().count());
+            }
+            sweepSome(SIZE_MAX);
+            setGenerational(false);
+            lazySweep = false;
+            for (auto &c : pool.classes) {
+                c.current = nullptr;    // threads claim pages of their own
+            }
+            threads = new details::GCThreadRegistry();
+            sharedHeap = true;
+        } else if (threads->contexts.empty()) {
+            sharedHeap = false;
+            delete threads;
+            threads = nullptr;
+        }
+        allocationLimit = sharedHeap ? SIZE_MAX : hardLimit;
+    }
+
+    details::GCThreadContext* GarbageCollector::findContext() const noexcept {
+        for (auto context = details::threadContexts; context != nullptr; context = context->next) {
+            if (context->owner == this) {
+                return context;
+            }
+        }
+        return nullptr;
+    }
+
+    details::GCThreadContext* GarbageCollector::threadContext() {
+        auto context = findContext();
+        if (context == nullptr) {
+            throw std::logic_error("TinyGC: the thread is not attached to the shared heap");
+        }
+        return context;
+    }
+
+    std::vector<details::GCRootPtrBase*> GarbageCollector::rootLists() {
+        std::vector<details::GCRootPtrBase*> lists(1, &listHead);
+        if (sharedHeap) {
+            for (auto context : threads->contexts) {
+                lists.push_back(&(context->roots));
+            }
+        }
+        return lists;
+    }
+
+    std::vector<details::GCRootPtrBase*> GarbageCollector::weakLists() {
+        std::vector<details::GCRootPtrBase*> lists(1, &weakHead);
+        if (sharedHeap) {
+            for (auto context : threads->contexts) {
+                lists.push_back(&(context->weakRefs));
+            }
+        }
+        return lists;
+    }
+
+    void GarbageCollector::addWeakTable(GCWeakTable *table, std::true_type) {
+        if (sharedHeap) {
+            std::lock_guard<std::mutex> guard(threads->heapLock);
+            weakTables.push_back(table);
+        } else {
+            weakTables.push_back(table);
+        }
+    }
+
+    // after marking and before sweeping: values of ephemerons with live keys are traced
+    // until no more are found, then dead tables are forgotten, live ones drop the entries
+    // of dead objects and weak pointers to dead objects are cleared
+    void GarbageCollector::processWeak(GCMarker &m) {
+        for (bool traced = !weakTables.empty(); traced; ) {
+            traced = false;
+            for (auto table : weakTables) {
+                if (m.isLive(table) && table->GCTraceEphemerons(m)) {
+                    traced = true;
+                }
+            }
+            m.clearStack();
+        }
+        std::size_t kept = 0;
+        for (auto table : weakTables) {
+            if (m.isLive(table)) {
+                weakCleared += table->GCClearDead(m);
+                weakTables[kept++] = table;
+            }
+        }
+        weakTables.resize(kept);
+        for (auto end : weakLists()) {
+            for (auto i = end->next; i != end; i = i->next) {
+                if (i->ptr != nullptr && !m.isLive(i->ptr)) {
+                    i->ptr = nullptr;
+                    ++weakCleared;
+                }
+            }
+        }
+        if (profiler != nullptr) {
+            profiler->collected(m);
+        }
+    }
+
+    std::vector<details::GCHandleArea*> GarbageCollector::handleAreas() {
+        std::vector<details::GCHandleArea*> areas(1, &handles);
+        if (sharedHeap) {
+            for (auto context : threads->contexts) {
+                areas.push_back(&(context->handles));
+            }
+        }
+        return areas;
+    }
+
+    void GarbageCollector::attachThread() {
+        if (!sharedHeap) {
+            return;
+        }
+        auto context = findContext();
+        if (context != nullptr) {
+            ++(context->attachNum);
+            return;
+        }
+        context = new details::GCThreadContext(this);
+        std::unique_lock<std::mutex> guard(threads->lock);
+        threads->changed.wait(guard, [this] { return !stopRequested.load(); });
+        threads->contexts.push_back(context);
+        context->next = details::threadContexts;
+        details::threadContexts = context;
+    }
+
+    // the claimed pages go back to the pool, remaining roots move to the collector
+    void GarbageCollector::detachThread() {
+        if (!sharedHeap) {
+            return;
+        }
+        auto context = threadContext();
+        if (--(context->attachNum) > 0) {
+            return;
+        }
+        saveStack(context->stack, TINYGC_FRAME_ADDRESS());
+        std::unique_lock<std::mutex> guard(threads->lock);
+        while (stopRequested.load()) {
+            ++(threads->parkedNum);
+            threads->changed.notify_all();
+            threads->changed.wait(guard, [this] { return !stopRequested.load(); });
+            --(threads->parkedNum);
+        }
+        {
+            std::lock_guard<std::mutex> heapGuard(threads->heapLock);
+            for (auto page : context->current) {
+                if (page != nullptr) {
+                    page->claimed = false;
+                }
+            }
+            countAllocated(context->allocatedBytes);
+        }
+        objectNum += context->allocatedNum;
+        auto splice = [](details::GCRootPtrBase &from, details::GCRootPtrBase &to) {
+            if (from.next != &from) {
+                auto first = from.next;
+                auto last = from.prev;
+                first->prev = &to;
+                last->next = to.next;
+                to.next->prev = last;
+                to.next = first;
+                from.next = from.prev = &from;
+            }
+        };
+        splice(context->roots, listHead);
+        splice(context->weakRefs, weakHead);
+        auto &contexts = threads->contexts;
+        contexts.erase(std::find(contexts.begin(), contexts.end(), context));
+        for (auto link = &details::threadContexts; *link != nullptr; link = &((*link)->next)) {
+            if (*link == context) {
+                *link = context->next;
+                break;
+            }
+        }
+        delete context->stack;
+        delete context;
+    }
+
+    void GarbageCollector::park() {
+        auto context = findContext();
+        if (context == nullptr) {
+            return;     // only attached threads are waited for
+        }
+        saveStack(context->stack, TINYGC_FRAME_ADDRESS());
+        std::unique_lock<std::mutex> guard(threads->lock);
+        if (stopRequested.load()) {
+            ++(threads->parkedNum);
+            threads->changed.notify_all();
+            threads->changed.wait(guard, [this] { return !stopRequested.load(); });
+            --(threads->parkedNum);
+        }
+        releaseStack(context->stack);
+    }
+
+    void GarbageCollector::enterSafeRegion() {
+        if (!sharedHeap && groupMember != nullptr) {
+            saveStack(ownerStack, TINYGC_FRAME_ADDRESS());
+            groupMember->state->park(*groupMember);
+        }
+        auto context = sharedHeap ? findContext() : nullptr;
+        if (context == nullptr) {
+            return;
+        }
+        saveStack(context->stack, TINYGC_FRAME_ADDRESS());
+        std::lock_guard<std::mutex> guard(threads->lock);
+        ++(threads->parkedNum);
+        threads->changed.notify_all();
+    }
+
+    void GarbageCollector::leaveSafeRegion() {
+        if (!sharedHeap && groupMember != nullptr) {
+            groupMember->state->unpark(*groupMember);
+            releaseStack(ownerStack);
+        }
+        auto context = sharedHeap ? findContext() : nullptr;
+        if (context == nullptr) {
+            return;
+        }
+        std::unique_lock<std::mutex> guard(threads->lock);
+        threads->changed.wait(guard, [this] { return !stopRequested.load(); });
+        --(threads->parkedNum);
+        releaseStack(context->stack);
+    }
+
+    // false if another thread was collecting, the calling thread has waited for it instead
+    bool GarbageCollector::stopTheWorld() {
+        auto self = findContext();
+        if (self != nullptr) {
+            saveStack(self->stack, TINYGC_FRAME_ADDRESS());
+        }
+        std::unique_lock<std::mutex> guard(threads->lock);
+        if (stopRequested.load()) {
+            if (self != nullptr) {
+                ++(threads->parkedNum);
+                threads->changed.notify_all();
+            }
+            threads->changed.wait(guard, [this] { return !stopRequested.load(); });
+            if (self != nullptr) {
+                --(threads->parkedNum);
+                releaseStack(self->stack);
+            }
+            return false;
+        }
+        if (self != nullptr) {
+            releaseStack(self->stack);
+        }
+        stopRequested.store(true);
+        auto others = threads->contexts.size() - (self != nullptr ? 1 : 0);
+        threads->changed.wait(guard, [this, others] { return threads->parkedNum == others; });
+        // sweeping may release the claimed pages, threads claim new ones afterwards
+        for (auto context : threads->contexts) {
+            for (auto &page : context->current) {
+                if (page != nullptr) {
+                    page->claimed = false;
+                    page = nullptr;
+                }
+            }
+            objectNum += context->allocatedNum;
+            context->allocatedNum = 0;
+            countAllocated(context->allocatedBytes);
+            context->allocatedBytes = 0;
+        }
+        return true;
+    }
+
+    void GarbageCollector::resumeTheWorld() {
+        {
+            std::lock_guard<std::mutex> guard(threads->lock);
+            stopRequested.store(false);
+        }
+        threads->changed.notify_all();
+    }
+
+    // claims the next page of the size class with free slots that no thread allocates from
+    void* GarbageCollector::allocateSharedSlow(details::GCThreadContext *context,
+            std::size_t sizeClass, std::size_t size, std::size_t alignment) {
+        std::lock_guard<std::mutex> guard(threads->heapLock);
+        countAllocated(context->allocatedBytes);
+        context->allocatedBytes = 0;
+        if (sizeClass == details::SizeClassNum) {
+            return pool.allocateLarge(size, alignment);
+        }
+        auto &c = pool.classes[sizeClass];
+        auto &claimed = context->current[sizeClass];
+        if (claimed != nullptr) {
+            claimed->claimed = false;
+        }
+        auto page = (c.current != nullptr) ? c.current->next : c.head;
+        while (page != nullptr && (page->claimed || !page->hasFreeSlot())) {
+            page = page->next;
+        }
+        if (page == nullptr) {
+            page = pool.newPage(sizeClass);
+        }
+        c.current = page;
+        page->claimed = true;
+        claimed = page;
+        return page->take();
+    }
+
+    void GarbageCollector::releaseSlot(void *slot) noexcept {
+        if (sharedHeap && details::GCPage::of(slot)->sizeClass == details::SizeClassNum) {
+            std::lock_guard<std::mutex> guard(threads->heapLock);
+            pool.release(slot);
+        } else {
+            pool.release(slot);
+        }
+    }
+
+    GCGroup::GCGroup(unsigned threads) 
+        : state(new details::GCGroupState(threads != 0 ? threads 
+            : std::max(1u, std::thread::hardware_concurrency()))) {}
+
+    GCGroup::~GCGroup() {
+        delete state;
+    }
+
+    void GCGroup::add(GarbageCollector &gc) {
+        state->add(gc);
+    }
+
+    void GCGroup::remove(GarbageCollector &gc) {
+        state->remove(gc);
+    }
+
+    void GCGroup::setHeapLimit(std::size_t bytes) {
+        state->setHeapLimit(bytes);
+    }
+
+    void GCGroup::setIdleThreshold(std::size_t bytes) {
+        state->setIdleThreshold(bytes);
+    }
+
+    void GCGroup::wait() {
+        state->wait();
+    }
+
+    GCGroupStatistics GCGroup::getStatistics() const {
+        return state->getStatistics();
+    }
+
+    void GarbageCollector::setStackScan(bool enable) {
+#ifdef TINYGC_STACK_SCAN
+        stackScan = enable && allocatorType == GCAllocatorType::Pool;
+#else
+        (void)enable;
+#endif
+        stackObjects.clear();
+    }
+
+    // a thread stops once per depth, a nested safe region keeps the outer snapshot
+    void GarbageCollector::saveStack(details::GCStackSnapshot *&snapshot, const void *live) {
+#ifdef TINYGC_STACK_SCAN
+        if (!stackScan) {
+            return;
+        }
+        if (snapshot == nullptr) {
+            snapshot = new details::GCStackSnapshot();
+        }
+        if (snapshot->depth++ == 0) {
+            details::takeSnapshot(*snapshot, static_cast<const char*>(live));
+        }
+#else
+        (void)snapshot;
+        (void)live;
+#endif
+    }
+
+    void GarbageCollector::releaseStack(details::GCStackSnapshot *snapshot) noexcept {
+        if (snapshot != nullptr && snapshot->depth > 0 && --(snapshot->depth) == 0) {
+            snapshot->valid = false;
+        }
+    }
+
+    // the collecting thread is scanned from here, the others from their snapshots;
+    // pages are indexed afresh, sweeping is complete and no page changes until marking ends
+    void GarbageCollector::scanStacks() {
+        stackObjects.clear();
+#ifdef TINYGC_STACK_SCAN
+        if (!stackScan) {
+            return;
+        }
+        details::GCPageIndex pages;
+        for (auto &c : pool.classes) {
+            pages.add(c.head);
+            pages.add(c.unswept);
+        }
+        pages.add(pool.largePages);
+        pages.add(pool.unsweptLarge);
+        pages.sort();
+        ucontext_t registers;
+        getcontext(&registers);
+        auto sp = reinterpret_cast<const char*>(registers.uc_mcontext.gregs[REG_RSP]);
+        details::scanWords(sp, details::stackBase(), pages, stackObjects);
+        details::scanSnapshot(ownerStack, pages, stackObjects);
+        if (sharedHeap) {
+            auto self = findContext();
+            for (auto context : threads->contexts) {
+                if (context != self) {
+                    details::scanSnapshot(context->stack, pages, stackObjects);
+                }
+            }
+        }
+        std::sort(stackObjects.begin(), stackObjects.end());
+        stackObjects.erase(std::unique(stackObjects.begin(), stackObjects.end()), stackObjects.end());
+#endif
+    }
+
+    // objects are laid out in the order they are found from the roots, filling a page of their
+    // size class at a time or taking a page each if large; the fields of the copies take the
+    // new addresses and are listed, so loading elsewhere only adds the difference to them
+    void GarbageCollector::saveImage(const std::string &path, const std::vector<GCObject*> &roots) {
+#ifndef TINYGC_HEAP_IMAGE
+        (void)path;
+        (void)roots;
+        throw std::logic_error("TinyGC: heap images are not supported on this platform");
+#else
+        if (allocatorType != GCAllocatorType::Pool) {
+            throw std::logic_error("TinyGC: heap images require the pool");
+        }
+        struct Layout {
+            // offsets in the pages of the image by slot of the source pages, Unseen until found
+            std::unordered_map<details::GCPage*, std::vector<std::uint64_t>> slots;
+            details::GCPage *lastPage = nullptr;
+            std::vector<std::uint64_t> *lastSlots = nullptr;
+            std::vector<GCObject*> objects;     // in the order they were found
+            std::vector<std::uint64_t> fields;  // offsets of the pointers that are not null
+            char *pages = nullptr;
+
+            enum : std::uint64_t { Unseen = UINT64_MAX };
+
+            std::uint64_t& offsetOf(GCObject *obj) {
+                auto page = details::GCPage::of(obj);
+                if (page != lastPage) {
+                    lastPage = page;
+                    lastSlots = &slots[page];
+                    if (lastSlots->empty()) {
+                        auto capacity = page->divMagic == 0 ? 1 : (page->end - page->begin) / page->objectSize;
+                        lastSlots->assign(static_cast<std::size_t>(capacity), Unseen);
+                    }
+                }
+                return (*lastSlots)[page->indexOf(obj)];
+            }
+
+            void add(GCObject *obj) {
+                if (obj != nullptr) {
+                    auto &offset = offsetOf(obj);
+                    if (offset == Unseen) {
+                        offset = 0;
+                        objects.push_back(obj);
+                    }
+                }
+            }
+
+            // the copy, moved to the address of the image once every field is listed
+            GCObject* moved(GCObject *obj, const void *field) {
+                if (obj == nullptr) {
+                    return nullptr;
+                }
+                fields.push_back(static_cast<std::uint64_t>(static_cast<const char*>(field) - pages));
+                return reinterpret_cast<GCObject*>(pages + offsetOf(obj));
+            }
+        } layout;
+        for (auto obj : roots) {
+            layout.add(obj);
+        }
+        GCMarker finder;
+        finder.context = &layout;
+        finder.visit = [](GCMarker &m, GCObject *child) {
+            static_cast<Layout*>(m.context)->add(child);
+        };
+        for (std::size_t i = 0; i < layout.objects.size(); ++i) {
+            auto obj = layout.objects[i];
+            if (details::GCPage::of(obj)->image) {
+                throw std::logic_error("TinyGC: objects of a loaded heap image are not written again");
+            }
+            auto descriptor = descriptorOf(obj);
+            if (descriptor != nullptr ? descriptor->pinned : !obj->GCImageable()) {
+                throw std::logic_error("TinyGC: " + details::demangle(typeid(*obj).name()) 
+                    + " cannot be written to a heap image");
+            }
+            if (descriptor == nullptr) {
+                obj->GCMarkAllChildren(finder);
+                continue;
+            }
+            auto base = reinterpret_cast<char*>(obj);
+            for (std::size_t k = 0; k < descriptor->fieldNum; ++k) {
+                layout.add(*reinterpret_cast<GCObject**>(base + descriptor->offsets[k]));
+            }
+        }
+
+        struct Page {
+            std::uint64_t offset;
+            details::GCPage *source;    // a page of the size class, or of the large object
+            std::size_t used;
+        };
+        std::vector<Page> pages;
+        std::vector<std::size_t> filling(details::SizeClassNum, SIZE_MAX);
+        std::uint64_t pageBytes = 0;
+        for (auto obj : layout.objects) {
+            auto source = details::GCPage::of(obj);
+            auto slots = static_cast<std::uint64_t>(source->begin - reinterpret_cast<char*>(source));
+            if (source->sizeClass == details::SizeClassNum) {
+                layout.offsetOf(obj) = pageBytes + slots;
+                pages.push_back(Page{ pageBytes, source, 1 });
+                pageBytes += details::roundUp(slots + source->objectSize, details::PageSize);
+                continue;
+            }
+            auto &current = filling[source->sizeClass];
+            if (current == SIZE_MAX || pages[current].used == (details::PageSize - slots) / source->objectSize) {
+                current = pages.size();
+                pages.push_back(Page{ pageBytes, source, 0 });
+                pageBytes += details::PageSize;
+            }
+            auto &page = pages[current];
+            layout.offsetOf(obj) = page.offset + slots + page.used++ * source->objectSize;
+        }
+
+        std::vector<char> image(static_cast<std::size_t>(pageBytes));   // zeros: null, false
+        layout.pages = image.data();
+        for (auto &page : pages) {
+            auto header = reinterpret_cast<details::GCPage*>(image.data() + page.offset);
+            auto source = page.source;
+            auto slots = static_cast<std::size_t>(source->begin - reinterpret_cast<char*>(source));
+            auto large = source->sizeClass == details::SizeClassNum;
+            header->begin = reinterpret_cast<char*>(details::ImageBase + page.offset + slots);
+            header->unused = header->begin + page.used * source->objectSize;
+            header->end = large ? header->unused 
+                : header->begin + (details::PageSize - slots) / source->objectSize * source->objectSize;
+            header->objectSize = source->objectSize;
+            header->chunkSize = large ? details::roundUp(slots + source->objectSize, details::PageSize) 
+                : details::PageSize;
+            header->sizeClass = source->sizeClass;
+            header->usedNum = page.used;
+            header->divMagic = source->divMagic;
+            header->image = true;
+            for (std::size_t k = 0; k < page.used; ++k) {
+                details::setBit(header->allocBits, k);  // marked and old for good
+                details::setBit(header->markBits, k);
+                details::setBit(header->oldBits, k);
+            }
+        }
+
+        std::unordered_map<const void*, std::size_t> typeIndex;
+        std::vector<details::GCImageType> types;
+        std::string names;
+        GCMarker relocator;
+        relocator.context = &layout;
+        relocator.relocate = [](GCMarker &m, GCObject *child, const void *field) {
+            return static_cast<Layout*>(m.context)->moved(child, field);
+        };
+        for (auto obj : layout.objects) {
+            auto copy = reinterpret_cast<GCObject*>(image.data() + layout.offsetOf(obj));
+            std::memcpy(static_cast<void*>(copy), obj, details::GCPage::of(obj)->objectSize);
+            auto vtable = details::vtableOf(obj);
+            if (typeIndex.emplace(vtable, types.size()).second) {
+                types.push_back(details::GCImageType{ reinterpret_cast<std::uintptr_t>(vtable), names.size() });
+                names += typeid(*obj).name();
+                names += '\0';
+            }
+#ifndef TINYGC_COMPACT_HEADER
+            copy->GCNextObject = nullptr;   // never traced
+            copy->GCMaster = nullptr;       // the loading collector, marked
+#endif
+        }
+        for (auto obj : layout.objects) {
+            auto copy = reinterpret_cast<GCObject*>(image.data() + layout.offsetOf(obj));
+            auto descriptor = descriptorOf(obj);
+            if (descriptor == nullptr) {
+                copy->GCMarkAllChildren(relocator);
+                continue;
+            }
+            auto base = reinterpret_cast<char*>(copy);
+            for (std::size_t k = 0; k < descriptor->fieldNum; ++k) {
+                auto &field = *reinterpret_cast<GCObject**>(base + descriptor->offsets[k]);
+                field = layout.moved(field, &field);
+            }
+        }
+        for (auto field : layout.fields) {
+            auto &word = *reinterpret_cast<std::uintptr_t*>(image.data() + field);
+            word = word - reinterpret_cast<std::uintptr_t>(image.data()) + details::ImageBase;
+        }
+        std::vector<std::uint64_t> rootOffsets;
+        for (auto obj : roots) {
+            rootOffsets.push_back(obj != nullptr ? layout.offsetOf(obj) : details::NullRoot);
+        }
+
+        details::GCImageHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, details::ImageMagic, sizeof(header.magic));
+        header.version = details::ImageVersion;
+        header.compactHeader = details::CompactHeader;
+        header.pointerSize = sizeof(void*);
+        header.pageHeaderSize = details::PageHeaderSize;
+        header.base = details::ImageBase;
+        header.anchor = reinterpret_cast<std::uintptr_t>(&details::imageAnchor);
+        header.program = details::programOf(reinterpret_cast<std::uintptr_t>(&details::imageAnchor));
+        header.pageBytes = pageBytes;
+        header.typeNum = types.size();
+        header.nameBytes = names.size();
+        header.rootNum = rootOffsets.size();
+        header.fieldNum = layout.fields.size();
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        auto write = [&out](const void *data, std::size_t size) {
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        };
+        std::vector<char> padding(details::PageSize - sizeof(header));
+        write(&header, sizeof(header));
+        write(padding.data(), padding.size());
+        write(image.data(), image.size());
+        write(types.data(), types.size() * sizeof(details::GCImageType));
+        write(names.data(), names.size());
+        write(rootOffsets.data(), rootOffsets.size() * sizeof(std::uint64_t));
+        write(layout.fields.data(), layout.fields.size() * sizeof(std::uint64_t));
+        out.close();
+        if (!out) {
+            throw std::runtime_error("TinyGC: cannot write the heap image " + path);
+        }
+#endif
+    }
+
+    // the pages are mapped privately at the address they were laid out for if it is free, and
+    // elsewhere otherwise; page headers are always written, objects only when they must be
+    std::vector<GCObject*> GarbageCollector::loadImage(const std::string &path) {
+#ifndef TINYGC_HEAP_IMAGE
+        (void)path;
+        throw std::logic_error("TinyGC: heap images are not supported on this platform");
+#else
+        if (allocatorType != GCAllocatorType::Pool) {
+            throw std::logic_error("TinyGC: heap images require the pool");
+        }
+        struct File {
+            int fd;
+            ~File() {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        } file{ open(path.c_str(), O_RDONLY | O_CLOEXEC) };
+        if (file.fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "TinyGC: cannot open the heap image " + path);
+        }
+        details::GCImageHeader header;
+        auto anchor = reinterpret_cast<std::uintptr_t>(&details::imageAnchor);
+        if (!details::readAt(file.fd, &header, sizeof(header), 0)
+                || std::memcmp(header.magic, details::ImageMagic, sizeof(header.magic)) != 0
+                || header.version != details::ImageVersion || header.compactHeader != details::CompactHeader
+                || header.pointerSize != sizeof(void*) || header.pageHeaderSize != details::PageHeaderSize
+                || header.program != details::programOf(anchor)) {
+            throw std::runtime_error("TinyGC: " + path + " is not a heap image of this program");
+        }
+        // the tables must fill the rest of the file, before anything is allocated for them
+        struct stat status;
+        if (fstat(file.fd, &status) != 0) {
+            throw std::system_error(errno, std::generic_category(), "TinyGC: cannot read the heap image " + path);
+        }
+        auto fileBytes = static_cast<std::uint64_t>(status.st_size);
+        auto rest = fileBytes < details::PageSize ? 0 : fileBytes - details::PageSize;
+        auto tableBytes = [&rest](std::uint64_t num, std::uint64_t bytes) {
+            if (num > rest / bytes) {
+                return false;
+            }
+            rest -= num * bytes;
+            return true;
+        };
+        if (!tableBytes(header.pageBytes, 1) || !tableBytes(header.typeNum, sizeof(details::GCImageType))
+                || !tableBytes(header.nameBytes, 1) || !tableBytes(header.rootNum, sizeof(std::uint64_t))
+                || !tableBytes(header.fieldNum, sizeof(std::uint64_t)) || rest != 0 
+                || header.pageBytes > SIZE_MAX / 2) {
+            throw std::runtime_error("TinyGC: the heap image " + path + " is damaged");
+        }
+        auto size = static_cast<std::size_t>(header.pageBytes);
+        std::vector<details::GCImageType> types(static_cast<std::size_t>(header.typeNum));
+        std::string names(static_cast<std::size_t>(header.nameBytes), '\0');
+        std::vector<std::uint64_t> roots(static_cast<std::size_t>(header.rootNum));
+        std::vector<std::uint64_t> fields(static_cast<std::size_t>(header.fieldNum));
+        std::uint64_t offset = details::PageSize + header.pageBytes;
+        auto read = [&](void *to, std::size_t bytes) {
+            bool done = details::readAt(file.fd, to, bytes, offset);
+            offset += bytes;
+            return done;
+        };
+        bool valid = read(types.data(), types.size() * sizeof(details::GCImageType)) 
+            && read(&names[0], names.size()) && read(roots.data(), roots.size() * sizeof(std::uint64_t))
+            && read(fields.data(), fields.size() * sizeof(std::uint64_t)) 
+            && (names.empty() || names.back() == '\0') && size % details::PageSize == 0;
+        for (auto root : roots) {
+            valid = valid && (root == details::NullRoot || root < size);
+        }
+        for (auto field : fields) {
+            valid = valid && field % sizeof(void*) == 0 && field < size;
+        }
+        for (auto &type : types) {
+            valid = valid && type.name < names.size();
+        }
+        if (!valid) {
+            throw std::runtime_error("TinyGC: the heap image " + path + " is damaged");
+        }
+        // the ABI puts the type_info of a class right before the address point of its vtable, and
+        // its name right after the vtable pointer of the type_info; all of them are read through
+        // the probe. The name may start with '*', which name() skips, and libc++ may tag its top bit
+        auto bias = anchor - static_cast<std::uintptr_t>(header.anchor);
+        details::GCProbe probe;
+        auto isNamed = [&probe, bias](std::uint64_t vtable, const char *expected) {
+            auto address = static_cast<std::uintptr_t>(vtable) + bias;
+            std::uintptr_t info;
+            std::uintptr_t words[2];
+            char first;
+            if (address % alignof(void*) != 0 || address < sizeof(void*)
+                    || !probe.copy(&info, reinterpret_cast<const void*>(address - sizeof(void*)), sizeof(info))
+                    || !probe.copy(words, reinterpret_cast<const void*>(info), sizeof(words))) {
+                return false;
+            }
+            auto name = words[1] & (UINTPTR_MAX >> 1);
+            if (!probe.copy(&first, reinterpret_cast<const void*>(name), 1)) {
+                return false;
+            }
+            if (first == '*' && expected[0] != '*') {
+                ++name;
+            }
+            std::string copied(std::strlen(expected) + 1, '\0');
+            return probe.copy(&copied[0], reinterpret_cast<const void*>(name), copied.size()) 
+                && std::strcmp(copied.c_str(), expected) == 0;
+        };
+        std::vector<std::uint64_t> vtables;
+        for (auto &type : types) {
+            if (!isNamed(type.vtable, names.c_str() + type.name)) {
+                throw std::runtime_error("TinyGC: the types of the heap image " + path + " are not those of this program");
+            }
+            vtables.push_back(type.vtable);
+        }
+        std::sort(vtables.begin(), vtables.end());
+        std::vector<GCObject*> loaded;
+        if (size == 0) {
+            loaded.assign(roots.size(), nullptr);
+            return loaded;
+        }
+
+        auto wanted = reinterpret_cast<void*>(static_cast<std::uintptr_t>(header.base));
+        auto p = mmap(wanted, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file.fd, details::PageSize);
+        if (p != MAP_FAILED && p != wanted) {
+            munmap(p, size);    // the address is taken, any aligned one will do
+            auto reserved = mmap(nullptr, size + details::PageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            p = MAP_FAILED;
+            if (reserved != MAP_FAILED) {
+                auto begin = reinterpret_cast<std::uintptr_t>(reserved);
+                auto aligned = details::roundUp(begin, details::PageSize);
+                p = mmap(reinterpret_cast<void*>(aligned), size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, 
+                    file.fd, details::PageSize);
+                auto error = errno;
+                if (p == MAP_FAILED) {
+                    munmap(reserved, size + details::PageSize);
+                } else {
+                    if (aligned != begin) {
+                        munmap(reserved, aligned - begin);
+                    }
+                    munmap(reinterpret_cast<void*>(aligned + size), begin + details::PageSize - aligned);
+                }
+                errno = error;
+            }
+        }
+        if (p == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "TinyGC: cannot map the heap image " + path);
+        }
+
+        auto image = static_cast<char*>(p);
+        auto damaged = [&] {
+            munmap(p, size);
+            return std::runtime_error("TinyGC: the heap image " + path + " is damaged");
+        };
+        // the page headers are checked against the mapping before anything is written, their
+        // addresses are still those the image was laid out for
+        std::vector<std::size_t> starts;
+        for (std::size_t at = 0; at < size; ) {
+            auto page = reinterpret_cast<const details::GCPage*>(image + at);
+            auto chunk = page->chunkSize;
+            auto base = static_cast<std::uintptr_t>(header.base) + at;
+            auto begin = reinterpret_cast<std::uintptr_t>(page->begin);
+            auto unused = reinterpret_cast<std::uintptr_t>(page->unused);
+            auto end = reinterpret_cast<std::uintptr_t>(page->end);
+            unsigned char flag;     // any byte but 0 or 1 is no bool
+            std::memcpy(&flag, &page->image, sizeof(flag));
+            if (chunk == 0 || chunk % details::PageSize != 0 || chunk > size - at || flag != 1
+                    || page->sizeClass > details::SizeClassNum || begin < base + details::PageHeaderSize 
+                    || begin > unused || unused > end || end > base + chunk) {
+                throw damaged();
+            }
+            std::size_t slotNum;
+            if (page->sizeClass == details::SizeClassNum) {
+                slotNum = 1;
+                if (page->divMagic != 0 || page->objectSize < sizeof(GCObject) || end - begin != page->objectSize
+                        || unused != end) {
+                    throw damaged();
+                }
+            } else {
+                auto objectSize = details::sizeOfClass(page->sizeClass);
+                slotNum = (unused - begin) / objectSize;
+                if (chunk != details::PageSize || page->objectSize != objectSize 
+                        || page->divMagic != ((std::uint64_t(1) << 32) + objectSize - 1) / objectSize
+                        || begin != base + details::PageHeaderSize || (unused - begin) % objectSize != 0
+                        || end != begin + (details::PageSize - details::PageHeaderSize) / objectSize * objectSize) {
+                    throw damaged();
+                }
+            }
+            // forEachObject() walks the words up to unused, no bit may lie beyond the slots
+            auto words = (slotNum + 63) / 64;
+            if (words > 0 && slotNum % 64 != 0 && (page->allocBits[words - 1] >> (slotNum % 64)) != 0) {
+                throw damaged();
+            }
+            starts.push_back(at);
+            at += chunk;
+        }
+        // the page holding an offset, whose slots are checked; pages are mostly visited in order
+        std::size_t last = 0;
+        auto pageOf = [&](std::uint64_t at) {
+            if (at < starts[last] || (last + 1 < starts.size() && at >= starts[last + 1])) {
+                last = static_cast<std::size_t>(std::upper_bound(starts.begin(), starts.end(), at) - starts.begin()) - 1;
+            }
+            return reinterpret_cast<const details::GCPage*>(image + starts[last]);
+        };
+        auto slotOffset = [&](const details::GCPage *page, std::uint64_t at) {
+            return at + static_cast<std::uintptr_t>(header.base) - reinterpret_cast<std::uintptr_t>(page->begin);
+        };
+        for (auto root : roots) {
+            if (root == details::NullRoot) {
+                continue;
+            }
+            auto page = pageOf(root);
+            auto offset = slotOffset(page, root);
+            if (root + static_cast<std::uintptr_t>(header.base) < reinterpret_cast<std::uintptr_t>(page->begin)
+                    || offset % page->objectSize != 0 || offset >= static_cast<std::uint64_t>(page->unused - page->begin)
+                    || !details::testBit(page->allocBits, static_cast<std::size_t>(offset / page->objectSize))) {
+                throw damaged();
+            }
+        }
+        for (auto field : fields) {
+            auto page = pageOf(field);
+            if (field + static_cast<std::uintptr_t>(header.base) < reinterpret_cast<std::uintptr_t>(page->begin)
+                    || slotOffset(page, field) >= static_cast<std::uint64_t>(page->unused - page->begin)) {
+                throw damaged();
+            }
+        }
+
+        auto delta = reinterpret_cast<std::uintptr_t>(image) - static_cast<std::uintptr_t>(header.base);
+        auto move = [delta](char *&address) {
+            address = reinterpret_cast<char*>(reinterpret_cast<std::uintptr_t>(address) + delta);
+        };
+        // objects that are written anyway must be of the checked types
+        bool typed = true;
+        auto patch = [&](GCObject *obj) {
+            auto &vtable = *reinterpret_cast<std::uintptr_t*>(obj);
+            if (!std::binary_search(vtables.begin(), vtables.end(), static_cast<std::uint64_t>(vtable))) {
+                typed = false;
+                return;
+            }
+            if (bias != 0) {
+                vtable += bias;
+            }
+#ifndef TINYGC_COMPACT_HEADER
+            obj->GCMaster = setMark(this);  // always marked, never swept
+#endif
+        };
+        for (auto at : starts) {
+            auto page = reinterpret_cast<details::GCPage*>(image + at);
+            page->owner = this;
+            // the rest of the header is rebuilt from the alloc bits rather than trusted
+            page->next = nullptr;
+            page->freeList = nullptr;
+            page->nextNursery = nullptr;
+            page->markEpoch = 0;
+            page->youngNum = 0;
+            page->usedNum = 0;
+            page->inNursery = page->claimed = page->pinned = page->evacuating = false;
+            page->mapped = page->idle = page->decommitted = false;
+            for (std::size_t w = 0; w < details::BitmapWords; ++w) {
+                page->markBits[w] = page->oldBits[w] = page->allocBits[w];
+                page->ageBits[0][w] = page->ageBits[1][w] = page->rememberedBits[w] = 0;
+                page->usedNum += details::popCount(page->allocBits[w]);
+            }
+            if (delta != 0) {
+                move(page->begin);
+                move(page->unused);
+                move(page->end);
+            }
+            if (bias != 0 || !details::CompactHeader) {
+                details::forEachObject(page, patch);
+            }
+        }
+        if (!typed) {
+            throw damaged();
+        }
+        if (delta != 0) {
+            for (auto field : fields) {
+                *reinterpret_cast<std::uintptr_t*>(image + field) += delta;
+            }
+        }
+        mprotect(p, size, PROT_READ);
+        images.emplace_back(image, size);
+        imageBytes += size;
+        for (auto root : roots) {
+            loaded.push_back(root != details::NullRoot ? reinterpret_cast<GCObject*>(image + root) : nullptr);
+        }
+        return loaded;
+#endif
     }
 }
@@ -1,7 +1,20 @@
 #ifndef _TINYGC_H_
 #define _TINYGC_H_
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
 #include <utility>
 #include <type_traits>
+#include <vector>
 
 namespace TinyGC
 {
@@ -11,13 +24,35 @@ namespace TinyGC
     class GCObject;
     template <typename T>
     class GCValue;
+    template <typename T>
+    class GCArray;
+    class GCWeakTable;
     class GCReachableSet;
     class GarbageCollector;
+    class GCPolicy;
+    class GCTraceDescriptor;
     template <typename Ty>
     class GCRootPtr;
+    template <typename T>
+    class GCField;
+    class GCHandleScope;
+    class GCHeapProfiler;
+    class GCGroup;
 
     namespace details {
         class GCRootPtrBase;
+        struct GCPage;
+        class GCPagePool;
+        class GCMarkWorker;
+        struct GCMarkSegment;
+        class GCMarkReserve;
+        class GCFinalizer;
+        class GCThreadRegistry;
+        struct GCThreadContext;
+        class GCCensus;
+        struct GCGroupMember;
+        class GCGroupState;
+        struct GCStackSnapshot;
     }
 
     //===================================
@@ -35,68 +70,208 @@ namespace TinyGC
     // * Class GCMarker
     //===================================
     class GCMarker {
-        enum { MaxSize = 1024 };
-        GCObject* objects[MaxSize];
-        std::size_t size;
+        enum { MaxSize = 1024, PrefetchDepth = 8 };
+        GCObject* bottom[MaxSize];  // first segment of the mark stack
+        GCObject** objects;         // the top segment
+        std::size_t size;           // objects in the top segment, the segments below it are full
+        details::GCMarkSegment *segment;    // the top segment unless it is `bottom`
+        details::GCMarkSegment *spare;      // an emptied segment kept for the next overflow
+        details::GCMarkReserve *reserve;    // segments preallocated by the collector
+        std::size_t epoch;      // marks live in page bitmaps of this epoch, 0 for object headers
+        std::size_t markedNum;
+        bool youngOnly;         // old objects count as marked, for minor collections
+        void (*visit)(GCMarker &marker, GCObject *child);   // replaces marking when set
+        void *context;          // state of `visit`
+        // rewrites the children in place, for compaction and heap images; `field` is their address
+        GCObject* (*relocate)(GCMarker &marker, GCObject *child, const void *field);
+        details::GCMarkWorker *worker;      // parallel marking: atomic marks, overflow is shared
+        details::GCCensus *census;          // counts the traced objects by type, for GCHeapProfiler
 
         void clearStack();
+        bool clearStack(std::size_t budget);    // true if the stack has been emptied
         void markOneObject(GCObject* object);
+        void traceChildren(GCObject* object);   // through its GCTraceDescriptor if it has one
+        void push(GCObject* object);
+        void overflow(GCObject* object);        // the top segment is full
+        bool popSegment();                      // false if the stack is empty
+        void giveSegment(details::GCMarkSegment *s) noexcept;
+        void releaseSegments() noexcept;
+        bool empty() const noexcept { return size == 0 && segment == nullptr; }
+        bool setMarked(GCObject* object);   // false if it has been marked
+        void reset(std::size_t markEpoch) noexcept {
+            releaseSegments();
+            epoch = markEpoch;
+            markedNum = 0;
+            youngOnly = false;
+        }
+        bool setMarkedAtomic(GCObject* object);
+        bool isMarked(const GCObject* object) const noexcept;
+        static GCObject* relocated(GCObject* object) noexcept;
         friend class GarbageCollector;
+        friend class GCHeapProfiler;
+        friend class details::GCMarkWorker;
+        friend struct details::GCMarkSegment;
     public:
-        GCMarker() : size(0) {}
+        explicit GCMarker(std::size_t markEpoch = 0, details::GCMarkReserve *reserve = nullptr) 
+            : objects(bottom), size(0), segment(nullptr), spare(nullptr), reserve(reserve), 
+              epoch(markEpoch), markedNum(0), youngOnly(false), 
+              visit(nullptr), context(nullptr), relocate(nullptr), worker(nullptr), census(nullptr) {}
+        GCMarker(const GCMarker&) = delete;
+        GCMarker& operator=(const GCMarker&) = delete;
+        ~GCMarker() { releaseSegments(); }
 
         template<typename T>
         inline void markObject(T* sub) {
             CHECK_GCOBJECT_TYPE(T);  // check type
             markOneObject(static_cast<GCObject*>(const_cast<typename std::remove_cv<T>::type*>(sub)));
         }
+
+        template<typename T>
+        inline void markObject(const GCField<T> &field) {
+            markObject(field.get());
+        }
+        
+        // the references are the fields themselves, which compaction may rewrite
+        template<typename T>
+        inline void markField(T* const &sub) {
+            if (relocate != nullptr) {
+                auto object = static_cast<GCObject*>(const_cast<typename std::remove_cv<T>::type*>(sub));
+                const_cast<T*&>(sub) = static_cast<T*>(relocate(*this, object, &sub));
+            } else {
+                markObject(sub);
+            }
+        }
+
+        template<typename T>
+        inline void markField(const GCField<T> &field);
+
+        // a reference that does not keep its object alive, only seen by compaction,
+        // which then leaves the object in place
+        template<typename T>
+        inline void markWeak(T* sub) {
+            if (visit != nullptr && sub != nullptr) {
+                visit(*this, static_cast<GCObject*>(const_cast<typename std::remove_cv<T>::type*>(sub)));
+            }
+        }
+
+        // after marking, whether the object survives this collection;
+        // for weak tables, which must not keep dead objects
+        template<typename T>
+        inline bool isLive(T* sub) const noexcept {
+            return sub != nullptr && isMarked(static_cast<const GCObject*>(sub));
+        }
         
         template<typename ... T>
-        inline void markObjects(T *... sub) {
-            auto forceEvaluate = { (markObject<T>(sub), 0) ... };
+        inline void markObjects(const T &... sub) {
+            auto forceEvaluate = { (markField(sub), 0) ... };
         }
 
         template<typename Iter>
         inline void markRange(Iter begin, Iter end) {
             for(; begin != end; ++begin) {
-                markObject(*begin);
+                markField(*begin);
+            }
+        }
+
+        // contiguous pointers, runs of nulls are skipped four at a time
+        template<typename T>
+        inline void markArray(T* const *elements, std::size_t n) {
+            if (relocate != nullptr) {
+                markRange(elements, elements + n);
+                return;
+            }
+            std::size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                if ((reinterpret_cast<std::uintptr_t>(elements[i]) | reinterpret_cast<std::uintptr_t>(elements[i + 1])
+                        | reinterpret_cast<std::uintptr_t>(elements[i + 2]) 
+                        | reinterpret_cast<std::uintptr_t>(elements[i + 3])) == 0) {
+                    continue;
+                }
+                for (std::size_t k = i; k < i + 4; ++k) {
+                    if (elements[k] != nullptr) {
+                        markObject(elements[k]);
+                    }
+                }
+            }
+            for (; i < n; ++i) {
+                if (elements[i] != nullptr) {
+                    markObject(elements[i]);
+                }
             }
         }
     };
 
     //===================================
     // * Class GCObject
+    // * TINYGC_COMPACT_HEADER, defined for the whole program, leaves an object only its vtable
+    // * pointer: objects live on pool pages, the owner and the marks are found in the page header
+    // * and trace descriptors by the vtable
     //===================================
     class GCObject {
     private:
-        GCObject *GCNextObject;      // this field may be modified
+#ifndef TINYGC_COMPACT_HEADER
+        GCObject *GCNextObject;      // this field may be modified, tagged GCTraceDescriptor of a pooled object
         GarbageCollector *GCMaster;  // this field is not modified after construction, compressed with mark
+#endif
 
         friend class GarbageCollector;
         friend class GCMarker;
+        friend class details::GCCensus;
     protected:
         virtual void GCMarkAllChildren(GCMarker &marker) {}
 
+        // bytes accounted to the object by the Default allocator
+        virtual std::size_t GCObjectSize() const noexcept { return sizeof(GCObject); }
+
+        // true if GCMarkAllChildren passes the pointer fields themselves rather than copies,
+        // so compaction may rewrite them; otherwise the objects they point to are not moved
+        virtual bool GCChildrenMovable() const noexcept { return false; }
+
+        // true if a bitwise copy is valid at another address once the fields passed by
+        // GCMarkAllChildren are rewritten; heap images take such objects without a trace descriptor
+        virtual bool GCImageable() const noexcept { return false; }
+
+        // compaction moves objects bitwise, a class whose objects must stay in place declares GCPINNED
+        static constexpr bool GCPinned = false;
+#define GCPINNED static constexpr bool GCPinned = true;
+
 #define GCOBJECT(Type, Base, ...) \
         void GCMarkAllChildren(TinyGC::GCMarker &marker) override { \
             static_assert(std::is_base_of<Base, Type>::value, \
                 #Type" is not a subclass of "#Base); \
             Base::GCMarkAllChildren(marker);\
             marker.markObjects(__VA_ARGS__);\
+        } \
+        std::size_t GCObjectSize() const noexcept override { return sizeof(Type); } \
+        friend class TinyGC::GCTraceDescriptor; \
+        typedef Type GCDescribedType; \
+        void GCDescribeChildren(TinyGC::GCTraceDescriptor &descriptor) const { \
+            descriptor.addBase<Base>(this); \
+            descriptor.addFields(this, sizeof(Type), __VA_ARGS__); \
         }
     public:
+#ifdef TINYGC_COMPACT_HEADER
+        GCObject() {}
+        virtual ~GCObject() {}
+
+        // the owner of its page, objects must have been created by a collector
+        inline GarbageCollector * GCGetMaster() const noexcept;
+        void GCSetMaster(GarbageCollector *) noexcept {}
+#else
         GCObject() : GCMaster(nullptr) {}
         virtual ~GCObject() {}
 
-        // should not be called while collecting garbage
+        // the mark bit is masked, marks may outlive a pause with incremental marking or lazy sweeping
         GarbageCollector * GCGetMaster() const noexcept {
-            return GCMaster; // usually it is not marked.
+            return reinterpret_cast<GarbageCollector*>(
+                reinterpret_cast<std::uintptr_t>(GCMaster) & ~static_cast<std::uintptr_t>(1));
         }
         
         // should not be called while collecting garbage
         void GCSetMaster(GarbageCollector *master) {
             GCMaster = master; // usually it is not marked.
         }
+#endif
     };
 
     //===================================
@@ -123,10 +298,136 @@ namespace TinyGC
         T& get() noexcept { return data; }
         const T& get() const noexcept { return data; }
 
+    protected:
+        std::size_t GCObjectSize() const noexcept override { return sizeof(GCValue); }
+
+        friend class GCTraceDescriptor;
+        typedef GCValue GCDescribedType;
+        void GCDescribeChildren(GCTraceDescriptor &) const {}
+        static constexpr bool GCPinned = !std::is_trivially_copyable<T>::value;
+
     private:
         T data;
     };
 
+    //===================================
+    // * Class GCTraceDescriptor
+    // * Offsets of the pointers a type declared with GCOBJECT marks, found from its first
+    // * pooled object, so that marking scans them in a loop instead of calling GCMarkAllChildren.
+    // * Types whose chain of GCOBJECT bases is broken, or whose arguments are not data members,
+    // * e.g. std::addressof(reference), keep the virtual hook
+    //===================================
+    class GCTraceDescriptor {
+    public:
+        enum : std::size_t {
+            MaxFields = 16
+        };
+
+        // nullptr if objects of T must be traced by GCMarkAllChildren
+        template <typename T>
+        static const GCTraceDescriptor* of(const T *obj) {
+            return describe(obj, IsDescribed<T>());
+        }
+
+        template <typename Base, typename Self>
+        void addBase(const Self *self) {
+            addBase(static_cast<const Base*>(self), 
+                std::integral_constant<bool, std::is_same<Base, GCObject>::value>(), IsDescribed<Base>());
+        }
+
+        template <typename Self, typename... Fields>
+        void addFields(const Self *self, std::size_t size, const Fields &... fields) {
+            auto forceEvaluate = { (addField(static_cast<const GCObject*>(self), 
+                reinterpret_cast<const char*>(self), size, fields), 0) ... };
+            (void)forceEvaluate;
+        }
+
+    private:
+        friend class GCMarker;
+        friend class GarbageCollector;
+
+        std::int32_t offsets[MaxFields];    // from the GCObject base
+        std::size_t fieldNum;
+        bool valid;
+        bool pinned;        // objects are not moved by compaction
+
+        GCTraceDescriptor() noexcept : fieldNum(0), valid(true), pinned(false) {}
+
+        template <typename T, typename = void>
+        struct IsDescribed : std::false_type {};
+
+        template <typename T>
+        struct IsDescribed<T, typename std::enable_if<
+            std::is_same<typename T::GCDescribedType, T>::value>::type> : std::true_type {};
+
+        template <typename T>
+        static const GCTraceDescriptor* describe(const T *obj, std::true_type) {
+            static const GCTraceDescriptor descriptor = build(obj);
+            return descriptor.valid ? &descriptor : nullptr;
+        }
+
+        template <typename T>
+        static const GCTraceDescriptor* describe(const T *, std::false_type) {
+            return nullptr;
+        }
+
+        template <typename T>
+        static GCTraceDescriptor build(const T *obj) {
+            GCTraceDescriptor descriptor;
+            obj->GCDescribeChildren(descriptor);
+            descriptor.pinned = T::GCPinned;
+            return descriptor;
+        }
+
+        template <typename Base, typename Described>
+        void addBase(const Base *, std::true_type, Described) {}
+
+        template <typename Base>
+        void addBase(const Base *base, std::false_type, std::true_type) {
+            base->Base::GCDescribeChildren(*this);
+        }
+
+        template <typename Base>
+        void addBase(const Base *, std::false_type, std::false_type) {
+            valid = false;  // its children are marked by a hook of its own
+        }
+
+        // the pointer can be read as a GCObject* without adjustment, never with a virtual base
+        template <typename T>
+        static auto samePointer(int) -> decltype(static_cast<T*>(std::declval<GCObject*>()), bool()) {
+            auto p = reinterpret_cast<T*>(static_cast<std::uintptr_t>(4096));
+            return reinterpret_cast<std::uintptr_t>(static_cast<GCObject*>(p)) == 4096;
+        }
+
+        template <typename T>
+        static bool samePointer(...) { return false; }
+
+        void addAddress(const GCObject *object, const char *self, std::size_t size, const void *field, bool plain) {
+            auto address = static_cast<const char*>(field);
+            if (!plain || fieldNum == MaxFields || address < self || address >= self + size) {
+                valid = false;  // a temporary or a pointer that needs adjustment
+                return;
+            }
+            offsets[fieldNum++] = static_cast<std::int32_t>(address - reinterpret_cast<const char*>(object));
+        }
+
+        template <typename T>
+        void addField(const GCObject *object, const char *self, std::size_t size, T* const &field) {
+            addAddress(object, self, size, &field, samePointer<typename std::remove_cv<T>::type>(0));
+        }
+
+        template <typename T>
+        void addField(const GCObject *object, const char *self, std::size_t size, const GCField<T> &field) {
+            static_assert(sizeof(GCField<T>) == sizeof(T*), "GCField holds a single pointer");
+            addAddress(object, self, size, &field, samePointer<typename std::remove_cv<T>::type>(0));
+        }
+
+        template <typename Other>
+        void addField(const GCObject *, const char *, std::size_t, const Other &) {
+            valid = false;
+        }
+    };
+
     //===================================
     // * Class GCContainer
     //===================================
@@ -146,190 +447,1695 @@ namespace TinyGC
         virtual void GCMarkAllChildren(GCMarker &marker) override {
             marker.markRange(std::begin(this->get()), std::end(this->get()));
         }
+
+        // not the elements of sets, which are ordered by address
+        bool GCChildrenMovable() const noexcept override {
+            return !std::is_const<typename std::remove_reference<
+                decltype(*std::begin(std::declval<C&>()))>::type>::value;
+        }
     };
 
     //===================================
-    // * Struct GCStatistics
+    // * Class GCArray
+    // * Fixed-length array stored inline after the object header, created by newArray
+    // * Pointers to collectable objects are marked in a loop, other elements are never scanned
     //===================================
-    struct GCStatistics {
-        GCStatistics(): hasValue(false) {}
-        std::size_t elapsedTime;
-        std::size_t endTime;
-        std::size_t collected;
-        std::size_t notCollected;
-        bool hasValue;
-    };
+    template <typename T>
+    class GCArray : public GCObject {
+        static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_destructible<T>::value,
+            "GCArray elements must be trivially copyable and destructible");
+        static_assert(!std::is_pointer<T>::value 
+            || std::is_base_of<GCObject, typename std::remove_cv<typename std::remove_pointer<T>::type>::type>::value,
+            "GCArray of pointers must point to subclasses of GCObject");
+    public:
+        typedef T value_type;
+        typedef T* iterator;
+        typedef const T* const_iterator;
 
-    
-    namespace details {
-        //===================================
-        // * Class GCRootPtrBase
-        // * Not a template class
-        // * Does not guarantee type safety
-        //===================================
-        class GCRootPtrBase {
-        protected:
-            friend class ::TinyGC::GarbageCollector;
+        // bytes of an array of `n` elements, which newArray checks not to wrap
+        static std::size_t bytesFor(std::size_t n) noexcept { return HeaderSize + n * sizeof(T); }
 
-            GCObject* ptr;
-            GCRootPtrBase *prev;
-            GCRootPtrBase *next;
+        std::size_t size() const noexcept { return length; }
+        T* data() noexcept { return reinterpret_cast<T*>(reinterpret_cast<char*>(this) + HeaderSize); }
+        const T* data() const noexcept { 
+            return reinterpret_cast<const T*>(reinterpret_cast<const char*>(this) + HeaderSize); 
+        }
+        T& operator[](std::size_t i) noexcept { return data()[i]; }
+        const T& operator[](std::size_t i) const noexcept { return data()[i]; }
+        iterator begin() noexcept { return data(); }
+        iterator end() noexcept { return data() + length; }
+        const_iterator begin() const noexcept { return data(); }
+        const_iterator end() const noexcept { return data() + length; }
 
-            GCRootPtrBase() :ptr(nullptr), prev(this), next(this) {}
+        // stores with the write barrier, plain stores through operator[] need writeBarrier
+        void set(std::size_t i, T value);
 
-            template<typename Collector>
-            GCRootPtrBase(GCObject *p, Collector *master): ptr(p) {
-                master->addRoot(this);
-            }
-            
-            // copy is relatively more expensive than raw pointers
-            // if used as return value, it relies on compiler optimizations to eliminate copy
-            GCRootPtrBase(const GCRootPtrBase & root) :
-                ptr(root.ptr){
-                insert_into(root.next->prev, root.next);
-            }
-        
-            void insert_into(GCRootPtrBase *p, GCRootPtrBase *n) {
-                this->prev = p;
-                this->next = n;
-                p->next = this;
-                n->prev = this;
-            }
+        // the Default allocator created it with the global operator new of its full size
+        static void operator delete(void *p) noexcept { ::operator delete(p); }
 
-            ~GCRootPtrBase() {
-                this->next->prev = this->prev;
-                this->prev->next = this->next;
-            }
+    protected:
+        void GCMarkAllChildren(GCMarker &marker) override {
+            markElements(marker, std::is_pointer<T>());
+        }
+        std::size_t GCObjectSize() const noexcept override { return bytesFor(length); }
+        bool GCChildrenMovable() const noexcept override { return true; }
+        bool GCImageable() const noexcept override { return true; }
+
+        // arrays of data are traced through an empty descriptor, without the virtual call
+        friend class GCTraceDescriptor;
+        typedef typename std::conditional<std::is_pointer<T>::value, void, GCArray>::type GCDescribedType;
+        void GCDescribeChildren(GCTraceDescriptor &) const {}
+
+    private:
+        friend class GarbageCollector;
+        enum : std::size_t {
+            HeaderSize = (sizeof(GCObject) + sizeof(std::size_t) + alignof(T) - 1) / alignof(T) * alignof(T)
         };
-    }
+
+        std::size_t length;
+
+        GCArray(std::size_t n, const T &value) noexcept : length(n) {
+            for (auto &element : *this) {
+                ::new (static_cast<void*>(&element)) T(value);
+            }
+        }
+
+        void markElements(GCMarker &marker, std::true_type) { marker.markArray(data(), length); }
+        void markElements(GCMarker &, std::false_type) {}
+        void barrier(T value, std::true_type) { writeBarrier(this, value); }
+        void barrier(T, std::false_type) {}
+    };
 
     //===================================
-    // * Class GarbageCollector
+    // * Class GCWeakTable
+    // * Collectable table whose entries do not keep their objects alive, every live table
+    // * drops the entries of dead objects after marking, before anything is swept
     //===================================
-    class GarbageCollector
-    {
-    public:
-        bool checkPoint();
-        ~GarbageCollector();
+    class GCWeakTable : public GCObject {
+    protected:
+        friend class GarbageCollector;
 
-        GarbageCollector() : objectNum(0) {}
+        // marks the values of the entries whose keys are live, true if one was newly marked
+        virtual bool GCTraceEphemerons(GCMarker &) { return false; }
 
-        template <typename T, typename... Args>
-        T* newObject(Args &&... args) {
-            CHECK_GCOBJECT_TYPE(T);
-            auto p = allocateObject<T>(std::forward<Args>(args)...);
-            addObject(p);
-            p->GCSetMaster(this);
-            return p;
-        }
+        // removes the entries of objects that are not live, returns their number
+        virtual std::size_t GCClearDead(const GCMarker &marker) = 0;
+    };
 
-        template <typename T, typename... Args>
-        GCValue<T> *newValue(Args &&... args) {
-            return newObject<GCValue<T>>(std::forward<Args>(args)...);
+    //===================================
+    // * Class GCWeakMap
+    // * Map with weak values, e.g. a cache: an entry is removed once its value is collected
+    // * Keys are not traced, no write barrier is needed
+    //===================================
+    template <typename K, typename V, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+    class GCWeakMap : public GCWeakTable {
+        CHECK_GCOBJECT_TYPE(V);
+    public:
+        typedef std::unordered_map<K, V*, Hash, KeyEqual> Map;
+
+        V* find(const K &key) const {
+            auto it = map.find(key);
+            return it != map.end() ? it->second : nullptr;
         }
-        
-        template <typename C, typename... Args>
-        GCContainer<C> *newContainer(Args &&... args) {
-            return newObject<GCContainer<C>>(std::forward<Args>(args)...);
+        void set(const K &key, V *value) { map[key] = value; }
+        bool erase(const K &key) { return map.erase(key) > 0; }
+        std::size_t size() const noexcept { return map.size(); }
+        const Map& get() const noexcept { return map; }
+
+    protected:
+        void GCMarkAllChildren(GCMarker &marker) override {
+            for (auto &entry : map) {
+                marker.markWeak(entry.second);
+            }
         }
 
-        void addRoot(details::GCRootPtrBase* p) {
-            p->insert_into(&listHead, listHead.next);
+        std::size_t GCClearDead(const GCMarker &marker) override {
+            std::size_t cleared = 0;
+            for (auto it = map.begin(); it != map.end(); ) {
+                if (marker.isLive(it->second)) {
+                    ++it;
+                } else {
+                    it = map.erase(it);
+                    ++cleared;
+                }
+            }
+            return cleared;
         }
 
     private:
-        void addObject(GCObject *p) {
-            p->GCNextObject = listHead.ptr;
-            listHead.ptr = p;
-            ++objectNum;
+        Map map;
+    };
+
+    //===================================
+    // * Class GCEphemeronMap
+    // * Map from objects to objects, a value stays alive while its key is reachable
+    // * from elsewhere, and the entry is removed once the key is collected
+    //===================================
+    template <typename K, typename V>
+    class GCEphemeronMap : public GCWeakTable {
+        CHECK_GCOBJECT_TYPE(K);
+        CHECK_GCOBJECT_TYPE(V);
+    public:
+        typedef std::unordered_map<K*, V*> Map;
+
+        V* find(K *key) const {
+            auto it = map.find(key);
+            return it != map.end() ? it->second : nullptr;
         }
+        void set(K *key, V *value) { map[key] = value; }
+        bool erase(K *key) { return map.erase(key) > 0; }
+        std::size_t size() const noexcept { return map.size(); }
+        const Map& get() const noexcept { return map; }
 
-        // reserved to implement allocators
-        template <typename T, typename... Args>
-        T* allocateObject(Args &&... args) {
-            return new T(std::forward<Args>(args)...);
+    protected:
+        void GCMarkAllChildren(GCMarker &marker) override {
+            for (auto &entry : map) {
+                marker.markWeak(entry.first);
+                marker.markWeak(entry.second);
+            }
         }
 
-        // reserved to implement allocators
-        void destroyObject(GCObject *obj) {
-            delete obj;
+        bool GCTraceEphemerons(GCMarker &marker) override {
+            bool marked = false;
+            for (auto &entry : map) {
+                if (entry.second != nullptr && !marker.isLive(entry.second) && marker.isLive(entry.first)) {
+                    marker.markObject(entry.second);
+                    marked = true;
+                }
+            }
+            return marked;
         }
 
-        // The object `listHead` is the head of root pointers
-        // The object `listHead.ptr` points to is the head of all objects;
-        details::GCRootPtrBase listHead; 
+        std::size_t GCClearDead(const GCMarker &marker) override {
+            std::size_t cleared = 0;
+            for (auto it = map.begin(); it != map.end(); ) {
+                if (marker.isLive(it->first)) {
+                    ++it;
+                } else {
+                    it = map.erase(it);
+                    ++cleared;
+                }
+            }
+            return cleared;
+        }
 
-        std::size_t objectNum;
-        GCStatistics lastGC;
+    private:
+        Map map;
+    };
 
-        void mark();
-        void sweep();    
-        void collect();
-        bool shouldCollect() const ;
+    //===================================
+    // * Struct GCStatistics
+    //===================================
+    struct GCStatistics {
+        GCStatistics(): hasValue(false) {}
+        std::size_t elapsedTime;
+        std::size_t endTime;
+        std::size_t collected;
+        std::size_t notCollected;
+        std::size_t deferred;       // dead objects left to lazy sweeping when the pause ended
+        std::size_t promoted;       // objects promoted to the old generation by a minor collection
+        std::size_t liveBytes;      // bytes of the survivors, estimated when sweeping is lazy
+        std::size_t collectedBytes;
+        std::size_t allocatedBytes; // bytes allocated since the previous collection
+        std::size_t mutatorTime;    // between the end of the previous collection and this one
+        std::size_t markTime;       // part of elapsedTime, with the slices of incremental marking
+        std::size_t sweepTime;      // rest of elapsedTime, destructors run here unless in the background
+        std::size_t finalizeTime;   // spent by the background thread on destructors since the previous one
+        std::size_t compactedBytes; // moved by compact()
+        std::size_t weakCleared;    // weak pointers and weak table entries cleared
+        std::size_t largeNum;       // objects of the large object space not yet swept, with the pool
+        std::size_t largeBytes;     // their part of liveBytes, the rest is in small object pages
+        std::size_t decommittedBytes;   // of empty pages, given back to the system
+        double fragmentation;       // share of free slot bytes in small object pages after compact()
+        bool minor;                 // only the young generation was collected
+        bool hasValue;
     };
 
     //===================================
-    // * Class GCRootPtr
-    // * Template class, object type is specified 
-    // * supposed to guarantee type safety
+    // * Class GCPauseHistogram
+    // * Pause counts in power-of-two buckets of microseconds
     //===================================
-    template <typename Ty = GCObject>
-    class GCRootPtr: public details::GCRootPtrBase
-    {
-        CHECK_GCOBJECT_TYPE(Ty);
+    class GCPauseHistogram {
     public:
-        explicit GCRootPtr(GarbageCollector *master)
-            : GCRootPtrBase(nullptr, master) {}
-        GCRootPtr(Ty *ptr)
-            : GCRootPtrBase(ptr, ptr->GCGetMaster()) {}
-
-        GCRootPtr() = delete;
-        GCRootPtr(const GCRootPtr<Ty> & gcrp)
-            : GCRootPtrBase(gcrp) {}
-
-        template <typename Object>
-        GCRootPtr(const GCRootPtr<Object> & gcrp)
-            : GCRootPtrBase(gcrp) {
-            CHECK_POINTER_CONVERTIBLE(Object, Ty);
-        }
+        enum : std::size_t {
+            BucketNum = 32
+        };
 
-        GCRootPtr<Ty>& operator=(std::nullptr_t) noexcept {
-            this->ptr = nullptr;
-            return *this;
+        GCPauseHistogram() noexcept : total(0) {
+            for (auto &b : buckets) {
+                b = 0;
+            }
         }
 
-        GCRootPtr<Ty>& operator=(const GCRootPtr<Ty> & gcrp) noexcept {
-            this->ptr = gcrp.get();
-            return *this;
-        }
+        void add(std::size_t microseconds) noexcept;
+        std::size_t count() const noexcept { return total; }
 
-        template <typename Object>
-        GCRootPtr<Ty>& operator=(const GCRootPtr<Object> & gcrp) noexcept {
-            CHECK_POINTER_CONVERTIBLE(Object, Ty);
-            this->ptr = gcrp.get();
-            return *this;
-        }
+        // pauses shorter than bucketLimit(i) microseconds and at least bucketLimit(i - 1)
+        std::size_t bucket(std::size_t i) const noexcept { return buckets[i]; }
+        static std::size_t bucketLimit(std::size_t i) noexcept { return std::size_t(1) << i; }
 
-        // NOTICE: *objp MUST be allocated by the same GarbageCollector
-        template <typename Object>
-        GCRootPtr<Ty>& operator=(Object* objp) noexcept {
-            CHECK_POINTER_CONVERTIBLE(Object, Ty);
-            this->ptr = objp;
-            return *this;
-        }
+        // bucket limit below which at least the fraction `p` of the pauses fall
+        std::size_t percentile(double p) const noexcept;
 
-        template <typename Object>
-        void reset(Object* objp) noexcept {
-            CHECK_POINTER_CONVERTIBLE(Object, Ty);
-            this->ptr = objp;
-        }
+    private:
+        std::size_t buckets[BucketNum];
+        std::size_t total;
+    };
 
-        void reset() noexcept {  this->ptr = nullptr;  }
+    //===================================
+    // * Struct GCTotals
+    // * Sums over every collection, times in the ticks of GCStatistics
+    //===================================
+    struct GCTotals {
+        GCTotals() : collections(0), minorCollections(0), pauseTime(0), markTime(0), sweepTime(0), 
+            finalizeTime(0), collected(0), collectedBytes(0), allocatedBytes(0), compactedBytes(0),
+            decommittedBytes(0), pressureEvents(0) {}
+        std::size_t collections;        // minor ones included
+        std::size_t minorCollections;
+        std::size_t pauseTime;
+        std::size_t markTime;
+        std::size_t sweepTime;
+        std::size_t finalizeTime;
+        std::size_t collected;
+        std::size_t collectedBytes;
+        std::size_t allocatedBytes;     // up to the last collection
+        std::size_t compactedBytes;
+        std::size_t decommittedBytes;
+        std::size_t pressureEvents;     // allocations that ran out of memory or reached the hard limit
+        GCPauseHistogram pauses;        // every slice of incremental marking counts as a pause
+    };
 
-        void swap(GCRootPtr<Ty>& r) noexcept {
-            auto tmp = r.ptr;
-            r.ptr = this->ptr;
-            this->ptr = tmp;
+    //===================================
+    // * Enum GCEvent
+    //===================================
+    enum class GCEvent {
+        CollectionStart,    // statistics of the previous collection
+        CollectionEnd       // statistics of this one
+    };
+
+    // runs on the collecting thread, must neither allocate nor register callbacks
+    typedef std::function<void(GCEvent, const GCStatistics&)> GCEventCallback;
+
+    //===================================
+    // * Class GCPolicy
+    // * Decides how many bytes may be allocated before the next collection is due
+    //===================================
+    class GCPolicy {
+    public:
+        virtual ~GCPolicy() {}
+
+        // called after every collection, and by setPolicy() with statistics
+        // that have no value before the first collection
+        virtual std::size_t allocationBudget(const GCStatistics &last) = 0;
+    };
+
+    //===================================
+    // * Class GCDefaultPolicy
+    //===================================
+    class GCDefaultPolicy : public GCPolicy {
+    public:
+        enum : std::size_t {
+            DefaultMinBudget = 4 * 1024 * 1024
+        };
+
+        // the heap may grow to `growthFactor` times the live bytes, by at least `minBudget` bytes;
+        // a non-zero `heapLimit` caps live plus allocated bytes, and a non-zero `targetGCFraction`
+        // (below 1) enlarges the budget until pauses take about that fraction of the run time
+        explicit GCDefaultPolicy(double growthFactor = 2.0, std::size_t minBudget = DefaultMinBudget,
+            std::size_t heapLimit = 0, double targetGCFraction = 0.0) noexcept
+            : growthFactor(growthFactor), minBudget(minBudget), 
+              heapLimit(heapLimit), targetGCFraction(targetGCFraction) {}
+
+        std::size_t allocationBudget(const GCStatistics &last) override;
+
+    private:
+        double growthFactor;
+        std::size_t minBudget;
+        std::size_t heapLimit;
+        double targetGCFraction;
+    };
+
+    //===================================
+    // * Enum GCAllocatorType
+    //===================================
+    enum class GCAllocatorType {
+        Default,    // global operator new and delete
+        Pool        // size-class segregated pages owned by the collector
+    };
+
+    //===================================
+    // * Enum GCMarkMode
+    //===================================
+    enum class GCMarkMode {
+        Header,     // lowest bit of GCObject::GCMaster, written twice per live object
+        Bitmap      // side bitmap in the page header, requires GCAllocatorType::Pool
+    };
+
+    namespace details {
+        //===================================
+        // * Size classes of GCPagePool
+        // * 16-byte steps up to 128 bytes, then 4 classes per power of two,
+        // * each size once for objects with destructors and once for those without
+        //===================================
+        enum : std::size_t {
+            PageSize = 64 * 1024,       // pages are aligned to their size
+            SlotAlignment = 16,
+            SlotSizeNum = 32,
+            SizeClassNum = 2 * SlotSizeNum,     // classes from SlotSizeNum on need no destructor
+            MaxSmallSize = 8192,
+            MapThreshold = 128 * 1024,  // large pages of this size or more are mapped one by one by default
+            MaxSlotNum = PageSize / SlotAlignment,
+            BitmapWords = MaxSlotNum / 64
+        };
+
+        // objects without a header word require the pool and page bitmaps
+#ifdef TINYGC_COMPACT_HEADER
+        constexpr bool CompactHeader = true;
+#else
+        constexpr bool CompactHeader = false;
+#endif
+
+        constexpr std::size_t sizeOfClass(std::size_t c) {
+            return c >= SlotSizeNum ? sizeOfClass(c - SlotSizeNum)
+                : c < 8 ? SlotAlignment * (c + 1)
+                : (std::size_t(128) << ((c - 8) / 4)) + ((c - 8) % 4 + 1) * (std::size_t(32) << ((c - 8) / 4));
+        }
+
+        constexpr std::size_t classOfSize(std::size_t size, std::size_t c = 0) {
+            return (c == SlotSizeNum || sizeOfClass(c) >= size) ? c : classOfSize(size, c + 1);
+        }
+
+        // pages of such a class are swept a bitmap word at a time, without destructor calls
+        constexpr bool isTrivialClass(std::size_t c) {
+            return c >= SlotSizeNum && c < SizeClassNum;
+        }
+
+        template <typename T>
+        struct IsSmallObject : std::integral_constant<bool,
+            (sizeof(T) <= MaxSmallSize && alignof(T) <= SlotAlignment)> {};
+
+        // nothing but GCObject's empty destructor runs, classes derived from GCValue may add one
+        template <typename T>
+        struct IsTrivialObject : std::false_type {};
+
+        template <typename T>
+        struct IsTrivialObject<GCValue<T>> : std::is_trivially_destructible<T> {};
+
+        template <typename T>
+        struct IsTrivialObject<GCArray<T>> : std::true_type {};
+
+        template <typename T>
+        struct SizeClassOf : std::integral_constant<std::size_t, 
+            classOfSize(sizeof(T)) + (IsTrivialObject<T>::value ? SlotSizeNum : 0)> {};
+
+        // bytes a pooled object occupies, a large object page also has its header
+        template <typename T>
+        struct SlotSizeOf : std::integral_constant<std::size_t, 
+            IsSmallObject<T>::value ? sizeOfClass(SizeClassOf<T>::value) : sizeof(T)> {};
+
+        //===================================
+        // * Struct GCPage
+        // * Header at the beginning of every page, found by masking an object address
+        // * A large object occupies a page of its own, which may be longer than PageSize
+        //===================================
+        struct GCPage {
+            GarbageCollector *owner;
+            GCPage *next;               // next page in the same list
+            void *freeList;             // free slots, linked through their first word
+            char *begin;                // first slot
+            char *unused;               // slots in [unused, end) were never allocated
+            char *end;
+            std::size_t objectSize;
+            std::size_t chunkSize;      // bytes reserved for the page
+            std::size_t sizeClass;      // SizeClassNum for a large object page
+            std::size_t usedNum;        // slots handed out, including objects under construction
+            std::uint64_t divMagic;     // ceil(2^32 / objectSize), 0 for a large object page
+            std::size_t markEpoch;      // markBits are valid only in this epoch
+            std::size_t youngNum;       // objects not yet promoted by generational collection
+            GCPage *nextNursery;        // next page holding young objects
+            bool inNursery;
+            bool claimed;               // a thread of a shared heap allocates from it
+            bool pinned;                // compaction: holds objects that must not move
+            bool evacuating;            // compaction: its objects have moved, each slot forwards
+            bool mapped;                // mapped from the system on its own, not taken from malloc
+            bool idle;                  // a free page that stayed free since the last collection
+            bool decommitted;           // a free page whose memory went back to the system
+            bool image;                 // of a loaded heap image: read-only, always live, never swept
+            std::uint64_t allocBits[BitmapWords];   // slots holding constructed objects
+            std::uint64_t markBits[BitmapWords];
+            std::uint64_t oldBits[BitmapWords];     // promoted objects
+            std::uint64_t ageBits[2][BitmapWords];  // bit-sliced count of minor collections survived
+            std::uint64_t rememberedBits[BitmapWords];
+
+            static GCPage* of(const void *obj) noexcept {
+                return reinterpret_cast<GCPage*>(
+                    reinterpret_cast<std::uintptr_t>(obj) & ~static_cast<std::uintptr_t>(PageSize - 1));
+            }
+
+            // exact for offsets below 2^16, which covers every small slot
+            std::size_t indexOf(const void *obj) const noexcept {
+                auto offset = static_cast<std::uint64_t>(static_cast<const char*>(obj) - begin);
+                return static_cast<std::size_t>((offset * divMagic) >> 32);
+            }
+
+            bool hasFreeSlot() const noexcept {
+                return freeList != nullptr || unused != end;
+            }
+
+            // a free slot, nullptr if the page is full
+            void* take() noexcept {
+                void *slot = freeList;
+                if (slot != nullptr) {
+                    freeList = *static_cast<void**>(slot);
+                    ++usedNum;
+                    return slot;
+                }
+                if (unused != end) {
+                    slot = unused;
+                    unused += objectSize;
+                    ++usedNum;
+                    return slot;
+                }
+                return nullptr;
+            }
+
+            // bitmap words covering the slots handed out so far
+            std::size_t usedWords() const noexcept {
+                return divMagic == 0 ? 1 : (indexOf(unused) + 63) / 64;
+            }
+        };
+
+        // the first word of a GCObject tells its dynamic type
+        inline const void* vtableOf(const GCObject *object) noexcept {
+            return *reinterpret_cast<const void* const*>(object);
+        }
+
+#ifdef TINYGC_COMPACT_HEADER
+        //===================================
+        // * Class GCTypeTable
+        // * Trace descriptors by vtable, for objects that have no room for theirs;
+        // * the first allocation of a type adds it, marking reads without locks
+        //===================================
+        class GCTypeTable {
+        public:
+            enum : std::size_t {
+                Capacity = 4096,
+                MaxTypes = Capacity / 4 * 3     // types beyond it are traced by their hook
+            };
+
+            static bool add(const void *type, const GCTraceDescriptor *descriptor);
+
+            static const GCTraceDescriptor* find(const void *type) noexcept {
+                for (auto i = hash(type); ; i = (i + 1) % Capacity) {
+                    auto key = entries[i].type.load(std::memory_order_acquire);
+                    if (key == type) {
+                        return entries[i].descriptor;
+                    }
+                    if (key == nullptr) {
+                        return nullptr;
+                    }
+                }
+            }
+
+        private:
+            struct Entry {
+                std::atomic<const void*> type;      // published after the descriptor
+                const GCTraceDescriptor *descriptor;
+            };
+
+            static Entry entries[Capacity];
+            static std::size_t typeNum;
+            static std::mutex lock;
+
+            static std::size_t hash(const void *type) noexcept {
+                return static_cast<std::size_t>((static_cast<std::uint64_t>(
+                    reinterpret_cast<std::uintptr_t>(type)) * 0x9E3779B97F4A7C15ull) >> 52) % Capacity;
+            }
+        };
+#endif
+    }
+
+#ifdef TINYGC_COMPACT_HEADER
+    inline GarbageCollector * GCObject::GCGetMaster() const noexcept {
+        return details::GCPage::of(this)->owner;
+    }
+#endif
+
+    namespace details {
+        //===================================
+        // * Class GCPagePool
+        // * Per-collector allocator, objects are tracked by their pages
+        // * so they never need to be linked into the object list
+        //===================================
+        class GCPagePool {
+            struct SizeClass {
+                GCPage *head;           // swept pages
+                GCPage *tail;
+                GCPage *current;        // allocation cursor, pages before it are full
+                GCPage *unswept;        // pages waiting for lazy sweeping
+            };
+
+            GarbageCollector *owner;
+            SizeClass classes[SizeClassNum];
+            GCPage *largePages;
+            GCPage *unsweptLarge;
+            GCPage *freePages;          // empty pages kept for reuse
+            GCPage *nursery;            // pages holding young objects, linked by nextNursery
+            std::size_t mapThreshold;   // large pages of at least this many bytes are mapped
+            std::size_t largeNum;       // large objects not yet swept
+            std::size_t largeBytes;
+
+            void* allocateSlow(std::size_t sizeClass);
+            GCPage* newPage(std::size_t sizeClass);
+            void* allocateChunk(std::size_t size, std::size_t alignment, bool mapped);
+            void initPage(GCPage *page, std::size_t sizeClass);
+
+            friend class ::TinyGC::GarbageCollector;
+        public:
+            explicit GCPagePool(GarbageCollector *master);
+            ~GCPagePool();  // objects must have been destroyed
+            GCPagePool(const GCPagePool&) = delete;
+            GCPagePool& operator=(const GCPagePool&) = delete;
+
+            void* allocate(std::size_t sizeClass) {
+                auto page = classes[sizeClass].current;
+                if (page != nullptr) {
+                    void *slot = page->take();
+                    if (slot != nullptr) {
+                        return slot;
+                    }
+                }
+                return allocateSlow(sizeClass);
+            }
+
+            void* allocateLarge(std::size_t size, std::size_t alignment);
+
+            // the slot holds a constructed object from now on
+            void commit(void *slot) noexcept {
+                auto page = GCPage::of(slot);
+                auto index = page->indexOf(slot);
+                page->allocBits[index / 64] |= std::uint64_t(1) << (index % 64);
+            }
+
+            // a committed object is young, its page joins the nursery
+            void addYoung(void *slot) noexcept {
+                auto page = GCPage::of(slot);
+                ++(page->youngNum);
+                if (!page->inNursery) {
+                    page->inNursery = true;
+                    page->nextNursery = nursery;
+                    nursery = page;
+                }
+            }
+
+            // give back a slot that does not hold a constructed object
+            void release(void *slot) noexcept;
+
+            // remove a large page from its list without freeing it
+            void unlinkLarge(GCPage *page) noexcept;
+
+            // give back an empty page, large pages are freed at once
+            void releasePage(GCPage *page) noexcept;
+
+            // move every page to the unswept lists, nothing is allocated from them until swept
+            void detach() noexcept;
+
+            // put a swept page back
+            void append(GCPage *page) noexcept;
+
+            // free the evacuated pages of a size class and restart its allocation cursor
+            void dropEvacuated(std::size_t sizeClass) noexcept;
+
+            // give the empty pages kept for reuse back to the system
+            void trim() noexcept;
+
+            // empty pages that stayed unused since the previous call keep only their header
+            // in memory, returns the bytes given back
+            std::size_t decommitIdle() noexcept;
+        };
+    }
+
+    namespace details {
+        //===================================
+        // * Class GCRootPtrBase
+        // * Not a template class
+        // * Does not guarantee type safety
+        //===================================
+        class GCRootPtrBase {
+        protected:
+            friend class ::TinyGC::GarbageCollector;
+            friend struct GCThreadContext;
+
+            GCObject* ptr;
+            GCRootPtrBase *prev;
+            GCRootPtrBase *next;
+
+            GCRootPtrBase() :ptr(nullptr), prev(this), next(this) {}
+
+            template<typename Collector>
+            GCRootPtrBase(GCObject *p, Collector *master): ptr(p) {
+                master->addRoot(this);
+            }
+            
+            // copy is relatively more expensive than raw pointers
+            // if used as return value, it relies on compiler optimizations to eliminate copy
+            GCRootPtrBase(const GCRootPtrBase & root) :
+                ptr(root.ptr){
+                insert_into(root.next->prev, root.next);
+            }
+
+            // takes the place of `root` in its list, `root` is left detached and null
+            GCRootPtrBase(GCRootPtrBase && root) noexcept :
+                ptr(root.ptr) {
+                if (root.next == &root) {
+                    prev = next = this;
+                } else {
+                    insert_into(root.prev, root.next);
+                    root.prev = root.next = &root;
+                }
+                root.ptr = nullptr;
+            }
+
+            bool detached() const noexcept { return next == this; }
+        
+            void insert_into(GCRootPtrBase *p, GCRootPtrBase *n) {
+                this->prev = p;
+                this->next = n;
+                p->next = this;
+                n->prev = this;
+            }
+
+            ~GCRootPtrBase() {
+                this->next->prev = this->prev;
+                this->prev->next = this->next;
+            }
+        };
+
+        //===================================
+        // * Class GCHandleArea
+        // * Slots of the handles of GCHandleScope, taken and given back by moving a bump pointer;
+        // * the blocks are kept for later scopes
+        //===================================
+        class GCHandleArea {
+        public:
+            GCHandleArea() noexcept : top(nullptr), limit(nullptr), used(0) {}
+            ~GCHandleArea() {
+                for (auto block : blocks) {
+                    delete[] block;
+                }
+            }
+            GCHandleArea(const GCHandleArea&) = delete;
+            GCHandleArea& operator=(const GCHandleArea&) = delete;
+
+            GCObject** push(GCObject *object) {
+                if (top == limit) {
+                    nextBlock();
+                }
+                *top = object;
+                return top++;
+            }
+
+            template <typename Visitor>
+            void forEach(Visitor visit) const {
+                for (std::size_t k = 0; k < used; ++k) {
+                    auto end = (k + 1 == used) ? top : blocks[k] + BlockSize;
+                    for (auto slot = blocks[k]; slot != end; ++slot) {
+                        visit(*slot);
+                    }
+                }
+            }
+
+        private:
+            friend class ::TinyGC::GCHandleScope;
+            enum : std::size_t { BlockSize = 1024 };
+
+            GCObject **top;
+            GCObject **limit;
+            std::size_t used;               // blocks holding handles, the last one up to `top`
+            std::vector<GCObject**> blocks;
+
+            void nextBlock() {
+                if (used == blocks.size()) {
+                    blocks.push_back(new GCObject*[BlockSize]);
+                }
+                top = blocks[used++];
+                limit = top + BlockSize;
+            }
+
+            void restore(std::size_t usedBlocks, GCObject **oldTop) noexcept {
+                used = usedBlocks;
+                top = oldTop;
+                limit = (used > 0) ? blocks[used - 1] + BlockSize : nullptr;
+            }
+        };
+
+        //===================================
+        // * Struct GCThreadContext
+        // * A thread attached to a shared heap, the pages it allocates from and its roots
+        //===================================
+        struct GCThreadContext {
+            explicit GCThreadContext(GarbageCollector *master) noexcept
+                : owner(master), allocatedNum(0), allocatedBytes(0), attachNum(1), stack(nullptr), next(nullptr) {
+                for (auto &page : current) {
+                    page = nullptr;
+                }
+            }
+
+            GarbageCollector *owner;
+            GCPage *current[SizeClassNum];  // claimed pages, given back by every collection
+            std::size_t allocatedNum;       // objects committed since the last collection
+            std::size_t allocatedBytes;     // their bytes not yet counted by the collector
+            std::size_t attachNum;          // nested attachThread() calls
+            GCRootPtrBase roots;
+            GCRootPtrBase weakRefs;
+            GCHandleArea handles;
+            GCStackSnapshot *stack;         // of the thread while stopped, when stacks are scanned
+            GCThreadContext *next;          // contexts of the same thread for other collectors
+        };
+
+#if defined(__GXX_RTTI) || defined(_CPPRTTI) || defined(__cpp_rtti)
+#define TINYGC_RTTI
+#endif
+
+        // the readable form of a mangled name, where the ABI offers one
+        std::string demangle(const char *name);
+
+        // of sampled allocations, computed once per type
+        template <typename T>
+        const char* typeName() {
+#ifdef TINYGC_RTTI
+            static const std::string name = demangle(typeid(T).name());
+            return name.c_str();
+#else
+            return "?";
+#endif
+        }
+
+        //===================================
+        // * Class GCCensus
+        // * Live objects and bytes by dynamic type, the marker adds every object it traces;
+        // * types are told apart by their vtable, the first word of a GCObject
+        //===================================
+        class GCCensus {
+        public:
+            struct Count {
+                std::string type;
+                std::size_t objects;
+                std::size_t bytes;
+            };
+
+            explicit GCCensus(bool pooled = false) noexcept : pooled(pooled), lastType(nullptr), last(nullptr) {}
+            GCCensus(const GCCensus &other) : counts(other.counts), pooled(other.pooled), lastType(nullptr), last(nullptr) {}
+            GCCensus& operator=(const GCCensus&) = delete;
+
+            void add(GCObject *object);
+            void merge(const GCCensus &other);
+            void clear() noexcept;
+
+            std::unordered_map<const void*, Count> counts;
+            bool pooled;            // sizes are those of the slots
+
+        private:
+            const void *lastType;   // objects of a type often come in runs
+            Count *last;
+        };
+    }
+
+    //===================================
+    // * Class GarbageCollector
+    //===================================
+    class GarbageCollector
+    {
+    public:
+        bool checkPoint();
+        void collect();     // unconditional full collection, completes incremental marking
+        ~GarbageCollector();
+
+        // a full collection that also moves the survivors of sparse pool pages into the free slots
+        // of others and frees the emptied pages; roots, handles and fields are updated, other raw
+        // pointers to collectable objects are invalid afterwards. Objects of GCPINNED classes, of
+        // GCValue<T> with a T that is not trivially copyable, without a trace descriptor, or pointed
+        // to by hooks that do not expose their fields, stay in place. Just collect() without the pool.
+        void compact();
+
+        // incremental marking: starts a cycle when a collection is due, then marks for
+        // about `budget` per call, returns true when the call has completed a cycle;
+        // between calls every pointer stored into a collectable object must pass writeBarrier
+        bool checkPoint(std::chrono::microseconds budget);
+        bool isMarking() const noexcept { return marking; }
+
+        // starts an incremental cycle now, only scans the roots
+        void startMarking();
+
+        // called after storing `target` into a field of the collectable object `owner`,
+        // shades it for incremental marking and records old-to-young references
+        void writeBarrier(const GCObject *owner, const GCObject *target) {
+            if ((marking || generational) && target != nullptr) {
+                barrierSlow(owner, target);
+            }
+        }
+
+        // when the owner is unknown, a young target is remembered until it is promoted
+        void writeBarrier(const GCObject *target) {
+            writeBarrier(nullptr, target);
+        }
+
+        // generational collection, requires the pool and switches to GCMarkMode::Bitmap;
+        // enabling runs a full collection that promotes every survivor,
+        // then young objects are promoted after surviving `promotionAge` (1 to 3) minor collections
+        void setGenerational(bool enable, unsigned promotionAge = 2);
+        bool isGenerational() const noexcept { return generational; }
+
+        // collects the young generation only, traced from the roots and the remembered set;
+        // a full collection when generational collection is disabled
+        void collectMinor();
+
+        // stop-the-world marking of full collections runs on `n` threads sharing work by stealing,
+        // 0 for one per hardware thread, 1 marks serially
+        void setMarkThreads(unsigned n);
+        unsigned getMarkThreads() const noexcept { return markThreads; }
+
+        // gray objects that overflow the marker go to segments of 1024, `segments` of them
+        // are allocated in advance so marking a deep or wide graph does not depend on malloc
+        void setMarkStackReserve(std::size_t segments);
+
+        // pooled objects larger than 8 KiB get a page of their own, freed when the object is swept;
+        // large pages of at least `bytes` are mapped from the system one by one and unmapped at once
+        void setMapThreshold(std::size_t bytes) noexcept { pool.mapThreshold = bytes; }
+        std::size_t getMapThreshold() const noexcept { return pool.mapThreshold; }
+
+        // conservative roots: collections also keep the objects that words on the stacks and in the
+        // registers of the mutator threads point into, so raw pointers in locals need no GCRootPtr.
+        // Scanned are the collecting thread, the owner parked in a safe region while its GCGroup
+        // collects and the attached threads of a shared heap; found objects are not moved by compact().
+        // Requires the pool, on Linux on x86-64 with glibc, ignored elsewhere
+        void setStackScan(bool enable);
+        bool isStackScan() const noexcept { return stackScan; }
+
+        // heap images: saveImage() writes the objects reachable from `roots` to `path` as pool pages
+        // laid out for a fixed address, with a table of their pointer fields. loadImage() maps such
+        // a file back as read-only pages whose objects are always live, never swept or moved, and
+        // returns the roots in their order; objects are only written to when the image could not
+        // be mapped at its address, when the program was loaded elsewhere (vtables) and, without
+        // TINYGC_COMPACT_HEADER, for their header. Objects must have a trace descriptor, or be a
+        // GCArray, and be neither GCPINNED nor a GCValue<T> of a T that is not trivially copyable,
+        // e.g. a GCContainer; their destructors never run and loaded fields must not be assigned.
+        // Only the program that wrote an image loads it. Requires the pool, on POSIX with GCC or Clang
+        void saveImage(const std::string &path, const std::vector<GCObject*> &roots);
+        std::vector<GCObject*> loadImage(const std::string &path);
+
+        // bytes mapped by the loaded heap images, not a part of getHeapBytes()
+        std::size_t getImageBytes() const noexcept { return imageBytes; }
+
+        // bytes of the objects in the large object space, a part of getHeapBytes()
+        std::size_t getLargeObjectBytes() const noexcept { return pool.largeBytes; }
+
+        // destructors of dead objects run on a background thread and their memory
+        // is reused afterwards, such destructors must not touch other collectable objects
+        void setBackgroundFinalization(bool enable);
+        bool isBackgroundFinalization() const noexcept { return finalizer != nullptr; }
+
+        // waits until the background thread has destroyed every dead object handed to it
+        void waitFinalization();
+
+        // dead objects not yet destroyed by the background thread
+        std::size_t getFinalizationBacklog() const;
+
+        // a heap shared by threads, requires the pool; every thread using it attaches itself,
+        // e.g. with GCThreadScope, then allocates from pages it has claimed and registers its roots
+        // in its own list. collect() stops the other attached threads at their next safepoint.
+        // Incremental marking, lazy sweeping and generational collection are not used.
+        void setSharedHeap(bool enable);
+        bool isSharedHeap() const noexcept { return sharedHeap; }
+
+        // root pointers are destroyed before their thread detaches
+        void attachThread();
+        void detachThread();
+
+        // waits here while another thread collects, checkPoint() is a safepoint too;
+        // attached threads reach one regularly, allocations are not safepoints
+        void safepoint() {
+            if (stopRequested.load(std::memory_order_acquire)) {
+                park();
+            }
+        }
+
+        // between them the thread counts as stopped, e.g. while blocking,
+        // and must not touch collectable objects or root pointers;
+        // the owner thread of a heap in a GCGroup parks it this way
+        void enterSafeRegion();
+        void leaveSafeRegion();
+
+        // collections are due once the policy's allocation budget is used up, checkPoint()
+        // only tests a flag; nullptr restores GCDefaultPolicy
+        void setPolicy(std::unique_ptr<GCPolicy> policy);
+        GCPolicy& getPolicy() const noexcept { return *policy; }
+
+        // a collection is due once the heap reaches `softLimit` bytes, whatever the policy grants;
+        // an allocation that would take it beyond `hardLimit` or runs out of memory completes
+        // sweeping, waits for background finalization, gives free pages back and, with
+        // setAutoCollect(true), collects; then it tries again or throws std::bad_alloc.
+        // 0 for no limit, the hard limit is not checked in a shared heap
+        void setHeapLimit(std::size_t softLimit, std::size_t hardLimit = 0);
+
+        // newObject() runs checkPoint() itself when a collection is due, so every pointer
+        // held across an allocation must be rooted
+        void setAutoCollect(bool enable) noexcept { autoCollect = enable; }
+        bool isAutoCollect() const noexcept { return autoCollect; }
+
+        // bytes of objects not yet destroyed, and allocated since the last collection;
+        // threads of a shared heap report theirs when they claim a page or collect
+        std::size_t getHeapBytes() const noexcept { return objectBytes; }
+        std::size_t getAllocatedBytes() const noexcept { return allocatedBytes; }
+
+        const GCTotals& getTotals() const noexcept { return totals; }
+
+        // returns an id for removeEventCallback()
+        std::size_t addEventCallback(GCEventCallback callback);
+        void removeEventCallback(std::size_t id);
+
+        // with TINYGC_COMPACT_HEADER always the pool in GCMarkMode::Bitmap
+        explicit GarbageCollector(GCAllocatorType type = GCAllocatorType::Default)
+            : allocatorType(details::CompactHeader ? GCAllocatorType::Pool : type), 
+              markMode(details::CompactHeader ? GCMarkMode::Bitmap : GCMarkMode::Header), pool(this), 
+              markEpoch(0), lazySweep(false), sweepPending(false), unsweptObjects(nullptr),
+              nextSweepClass(0), marking(false), cycleTime(0), generational(false), promotionAge(2),
+              oldNum(0), majorThreshold(MinMajorThreshold), compactRequested(false), 
+              markThreads(1), markReserve(nullptr),
+              finalizer(nullptr), sharedHeap(false), stopRequested(false), threads(nullptr), 
+              policy(new GCDefaultPolicy()), autoCollect(false), collectDue(false),
+              objectBytes(0), allocatedBytes(0), nextCallbackId(0), finalizeTimeSeen(0), 
+              weakCleared(0), softLimit(0), hardLimit(SIZE_MAX), allocationLimit(SIZE_MAX), 
+              profiler(nullptr), nextSample(SIZE_MAX), groupMember(nullptr), nextReport(SIZE_MAX), 
+              stackScan(false), ownerStack(nullptr), imageBytes(0), objectNum(0) {
+            allocationBudget = policy->allocationBudget(lastGC);
+            eventBytes = allocationBudget;
+            setMarkStackReserve(DefaultMarkReserve);
+        }
+        GarbageCollector(const GarbageCollector&) = delete;
+        GarbageCollector& operator=(const GarbageCollector&) = delete;
+
+        GCAllocatorType getAllocatorType() const noexcept { return allocatorType; }
+
+        // GCMarkMode::Bitmap is ignored without the pool, a running cycle is completed first
+        void setMarkMode(GCMarkMode mode);
+        GCMarkMode getMarkMode() const noexcept { return markMode; }
+
+        // when enabled, collect() only marks and dead objects are reclaimed by
+        // later allocations, checkPoint() and sweepSome()
+        void setLazySweep(bool enable) noexcept { lazySweep = enable && !sharedHeap; }
+        bool isSweepPending() const noexcept { return sweepPending; }
+
+        // sweep about `budget` objects left by the last collection, returns the number reclaimed
+        std::size_t sweepSome(std::size_t budget);
+
+        const GCStatistics& getLastGC() const noexcept { return lastGC; }
+
+        template <typename T, typename... Args>
+        T* newObject(Args &&... args) {
+            CHECK_GCOBJECT_TYPE(T);
+            auto bytes = allocatorType == GCAllocatorType::Pool ? details::SlotSizeOf<T>::value : sizeof(T);
+            beforeAllocation(bytes);
+            auto p = allocateObject<T>(std::forward<Args>(args)...);
+            return adoptObject(p, bytes);
+        }
+
+        // `n` elements stored inline, all initialized to `value`
+        template <typename T>
+        GCArray<T> *newArray(std::size_t n, const T &value = T()) {
+            if (n > (SIZE_MAX - GCArray<T>::HeaderSize) / sizeof(T)) {
+                throw std::bad_alloc();     // the size in bytes would wrap
+            }
+            auto bytes = GCArray<T>::bytesFor(n);
+            beforeAllocation(bytes);
+            void *slot;
+            std::size_t slotBytes = bytes;
+            if (allocatorType != GCAllocatorType::Pool) {
+                slot = allocateMemory(bytes);
+            } else {
+                auto alignment = alignof(T) > alignof(GCArray<T>) ? alignof(T) : alignof(GCArray<T>);
+                auto sizeClass = (bytes <= details::MaxSmallSize && alignment <= details::SlotAlignment)
+                    ? details::classOfSize(bytes) + details::SlotSizeNum : std::size_t(details::SizeClassNum);
+                if (sizeClass < details::SizeClassNum) {
+                    slotBytes = details::sizeOfClass(sizeClass);
+                }
+                slot = allocateSlot(sizeClass, bytes, alignment);
+            }
+            return adoptObject(::new (slot) GCArray<T>(n, value), slotBytes);
+        }
+
+        template <typename T, typename... Args>
+        GCValue<T> *newValue(Args &&... args) {
+            return newObject<GCValue<T>>(std::forward<Args>(args)...);
+        }
+        
+        template <typename C, typename... Args>
+        GCContainer<C> *newContainer(Args &&... args) {
+            return newObject<GCContainer<C>>(std::forward<Args>(args)...);
+        }
+
+        void addRoot(details::GCRootPtrBase* p) {
+            auto head = sharedHeap ? &(threadContext()->roots) : &listHead;
+            p->insert_into(head, head->next);
+        }
+
+        void addWeakRef(details::GCRootPtrBase* p) {
+            auto head = sharedHeap ? &(threadContext()->weakRefs) : &weakHead;
+            p->insert_into(head, head->next);
+        }
+
+    private:
+        void beforeAllocation(std::size_t bytes) {
+            if (autoCollect && (collectDue.load(std::memory_order_relaxed) 
+                    || stopRequested.load(std::memory_order_relaxed))) {
+                checkPoint();
+            }
+            if (sweepPending && allocatorType == GCAllocatorType::Default) {
+                sweepSome(LazySweepStep);   // pool pages are swept when their size class runs out
+            }
+            if (objectBytes + bytes > allocationLimit) {
+                relieveMemory(bytes, false);
+            }
+        }
+
+        // an allocation ran out of memory, or would pass the hard limit and then throws
+        // std::bad_alloc unless enough is freed
+        void relieveMemory(std::size_t bytes, bool outOfMemory);
+
+        // global operator new, tried again once memory has been relieved
+        void* allocateMemory(std::size_t bytes);
+
+        // a constructed object joins the heap
+        template <typename T>
+        T* adoptObject(T *p, std::size_t bytes) {
+#ifdef TINYGC_COMPACT_HEADER
+            static const bool added = details::GCTypeTable::add(details::vtableOf(p), GCTraceDescriptor::of(p));
+            (void)added;
+#else
+            if (allocatorType == GCAllocatorType::Pool) {
+                setDescriptor(p, GCTraceDescriptor::of(p));
+            }
+#endif
+            addWeakTable(p, std::is_base_of<GCWeakTable, T>());
+            addObject(p, bytes, &details::typeName<T>);
+            p->GCSetMaster(this);
+            if (marking) {
+                marker.markOneObject(p);    // allocated gray, its fields were stored without barrier
+            }
+            return p;
+        }
+
+#ifndef TINYGC_COMPACT_HEADER
+        // pooled objects are not linked, the low bit tells a descriptor from nullptr
+        static void setDescriptor(GCObject *p, const GCTraceDescriptor *descriptor) noexcept {
+            p->GCNextObject = descriptor == nullptr ? nullptr : reinterpret_cast<GCObject*>(
+                reinterpret_cast<std::uintptr_t>(descriptor) | 1);
+        }
+#endif
+
+        // `type` names the object if it is sampled
+        void addObject(GCObject *p, std::size_t bytes, const char* (*type)()) {
+            if (allocatorType == GCAllocatorType::Pool) {
+                pool.commit(p);     // pooled objects are found through their pages
+                if (generational) {
+                    pool.addYoung(p);
+                }
+            } else {
+#ifndef TINYGC_COMPACT_HEADER
+                p->GCNextObject = listHead.ptr;
+                listHead.ptr = p;
+#endif
+            }
+            if (sharedHeap) {
+                auto context = threadContext();
+                ++(context->allocatedNum);
+                context->allocatedBytes += bytes;
+            } else {
+                ++objectNum;
+                objectBytes += bytes;
+                allocatedBytes += bytes;
+                if (allocatedBytes >= eventBytes) {
+                    allocationEvent(p, bytes, type);
+                }
+            }
+        }
+
+        template <typename T, typename... Args>
+        T* allocateObject(Args &&... args) {
+            if (allocatorType != GCAllocatorType::Pool) {
+                void *memory = allocateMemory(sizeof(T));
+                try {
+                    return ::new (memory) T(std::forward<Args>(args)...);
+                } catch (...) {
+                    ::operator delete(memory);
+                    throw;
+                }
+            }
+            void *slot = allocateSlot(details::IsSmallObject<T>::value 
+                ? details::SizeClassOf<T>::value : details::SizeClassNum, sizeof(T), alignof(T));
+            try {
+                return ::new (slot) T(std::forward<Args>(args)...);
+            } catch (...) {
+                releaseSlot(slot);
+                throw;
+            }
+        }
+
+        // SizeClassNum for a large object
+        void* allocateSlot(std::size_t sizeClass, std::size_t size, std::size_t alignment) {
+            if (sharedHeap) {
+                return allocateShared(sizeClass, size, alignment);
+            }
+            return sizeClass < details::SizeClassNum ? pool.allocate(sizeClass) : pool.allocateLarge(size, alignment);
+        }
+
+        // lock-free from the page the calling thread has claimed
+        void* allocateShared(std::size_t sizeClass, std::size_t size, std::size_t alignment) {
+            auto context = threadContext();
+            if (sizeClass < details::SizeClassNum && context->current[sizeClass] != nullptr) {
+                void *slot = context->current[sizeClass]->take();
+                if (slot != nullptr) {
+                    return slot;
+                }
+            }
+            return allocateSharedSlow(context, sizeClass, size, alignment);
+        }
+
+        void destroyObject(GCObject *obj) {
+            if (allocatorType == GCAllocatorType::Pool) {
+                obj->~GCObject();
+                pool.release(obj);
+            } else {
+                delete obj;
+            }
+        }
+
+        GCAllocatorType allocatorType;
+        GCMarkMode markMode;
+        details::GCPagePool pool;
+        std::size_t markEpoch;      // bumped by every marking in GCMarkMode::Bitmap
+
+        enum : std::size_t {
+            LazySweepStep = 1,              // objects swept by each allocation, reclaims at the allocation rate
+            CheckPointSweepBudget = 4096    // objects swept by a checkPoint() that does not collect
+        };
+        bool lazySweep;
+        bool sweepPending;
+        GCObject *unsweptObjects;   // objects of the Default allocator waiting for sweeping
+        std::size_t nextSweepClass; // size classes below it have no unswept pages
+        friend class details::GCPagePool;
+
+        enum : std::size_t {
+            MarkSliceStep = 256     // objects traced between two clock reads
+        };
+        bool marking;               // an incremental marking cycle is in progress
+        GCMarker marker;            // gray objects of incremental marking
+        std::size_t cycleTime;      // pauses of the running incremental cycle
+
+        enum : std::size_t {
+            MinMajorThreshold = 4096    // old objects before checkPoint() runs a major collection
+        };
+        bool generational;
+        unsigned promotionAge;
+        std::size_t oldNum;             // promoted objects
+        std::size_t majorThreshold;     // checkPoint() collects fully when oldNum exceeds it
+        std::vector<GCObject*> rememberedOwners;    // old objects that may point to young ones
+        std::vector<GCObject*> rememberedTargets;   // young objects stored by an unknown owner
+        void barrierSlow(const GCObject *owner, const GCObject *target);
+        void remember(GCObject *obj, std::vector<GCObject*> &set);
+        bool hasYoungChild(GCObject *obj);
+        void sweepNursery(std::vector<GCObject*> &promoted);
+        void updateRemembered(const std::vector<GCObject*> &promoted);
+        void dropDeadRemembered();
+        void clearNursery() noexcept;
+        void releaseGenerations(details::GCPage *page, std::size_t index) noexcept;
+        void promoteAll();
+        void sweepMajor();
+
+        enum : std::size_t {
+            CompactOccupancy = 75       // percentage of used slots below which a page is evacuated
+        };
+        bool compactRequested;
+        std::size_t compactPages(double &fragmentation);
+        void pinPages();
+        std::size_t evacuate(std::size_t sizeClass);
+        void relocateReferences();
+        static const GCTraceDescriptor* descriptorOf(GCObject *obj) noexcept {
+#ifdef TINYGC_COMPACT_HEADER
+            return details::GCTypeTable::find(details::vtableOf(obj));
+#else
+            auto tagged = reinterpret_cast<std::uintptr_t>(obj->GCNextObject);
+            return (tagged & 1) != 0 ? reinterpret_cast<const GCTraceDescriptor*>(tagged - 1) : nullptr;
+#endif
+        }
+
+        unsigned markThreads;
+        std::size_t markParallel();
+        void clearMarkBits();
+
+        enum : std::size_t {
+            DefaultMarkReserve = 4      // mark stack segments allocated in advance
+        };
+        details::GCMarkReserve *markReserve;
+
+        enum : std::size_t {
+            FinalizeBatchSize = 1024    // dead objects handed to the background thread at once
+        };
+        details::GCFinalizer *finalizer;
+        std::vector<GCObject*> finalizeBatch;   // dead objects not yet handed over
+        void finalizeObject(GCObject *obj);
+        void submitFinalization();
+        void reclaimFinalized();
+
+        bool sharedHeap;
+        std::atomic<bool> stopRequested;    // a thread is waiting to collect
+        details::GCThreadRegistry *threads;
+        details::GCThreadContext* findContext() const noexcept;   // of the calling thread
+        details::GCThreadContext* threadContext();  // throws if the calling thread is not attached
+        std::vector<details::GCRootPtrBase*> rootLists();
+        void collectNow();
+        void* allocateSharedSlow(details::GCThreadContext *context, 
+            std::size_t sizeClass, std::size_t size, std::size_t alignment);
+        void releaseSlot(void *slot) noexcept;
+        void park();
+        bool stopTheWorld();
+        void resumeTheWorld();
+
+        std::unique_ptr<GCPolicy> policy;
+        bool autoCollect;
+        std::atomic<bool> collectDue;       // the allocation budget is used up
+        std::size_t objectBytes;
+        std::size_t allocatedBytes;         // since the last collection
+        std::size_t allocationBudget;
+        std::size_t eventBytes;     // allocatedBytes that ends the budget or reaches the next sample
+        std::size_t bytesOf(GCObject *obj) const noexcept;
+        void countAllocated(std::size_t bytes) noexcept;
+        void updateBudget();
+
+        GCTotals totals;
+        std::vector<std::pair<std::size_t, GCEventCallback>> callbacks;
+        std::size_t nextCallbackId;
+        std::size_t finalizeTimeSeen;       // background destructor time already reported
+        void notify(GCEvent event);
+        void recordPause(std::size_t elapsedTime) noexcept;
+
+        std::vector<GCWeakTable*> weakTables;   // GCWeakTable objects not yet found dead
+        details::GCRootPtrBase weakHead;        // of GCWeakPtr, per thread in a shared heap
+        std::size_t weakCleared;                // by the weak phase of the running collection
+        void addWeakTable(GCObject *, std::false_type) noexcept {}
+        void addWeakTable(GCWeakTable *table, std::true_type);
+        std::vector<details::GCRootPtrBase*> weakLists();
+        void processWeak(GCMarker &m);
+
+        std::size_t softLimit;          // 0 without a limit
+        std::size_t hardLimit;          // SIZE_MAX without a limit
+        std::size_t allocationLimit;    // hardLimit, SIZE_MAX in a shared heap
+
+        GCHeapProfiler *profiler;       // nullptr unless profiling
+        std::size_t nextSample;         // allocatedBytes at which an allocation is sampled
+        friend class GCHeapProfiler;
+        void allocationEvent(GCObject *p, std::size_t bytes, const char* (*type)());
+        void updateEventBytes() noexcept;
+        void setProfiler(GCHeapProfiler *p);
+        details::GCCensus* startCensus();   // for the marker of a full collection when profiling
+
+        enum : std::size_t {
+            GroupReportStep = 1024 * 1024   // bytes allocated between two reports of the heap to its group
+        };
+        details::GCGroupMember *groupMember;    // nullptr unless in a GCGroup
+        std::size_t nextReport;         // allocatedBytes at which the heap is reported to the group
+        friend class details::GCGroupState;
+
+        bool stackScan;
+        details::GCStackSnapshot *ownerStack;   // of the thread in a safe region of an unshared heap
+        std::vector<GCObject*> stackObjects;    // found by the last scan, their pages are pinned
+        void saveStack(details::GCStackSnapshot *&snapshot, const void *live);   // before the thread stops
+        void releaseStack(details::GCStackSnapshot *snapshot) noexcept;         // after it has resumed
+        void scanStacks();
+
+        std::vector<std::pair<char*, std::size_t>> images;    // mappings of the loaded heap images
+        std::size_t imageBytes;
+
+        // The object `listHead` is the head of root pointers
+        // The object `listHead.ptr` points to is the head of all objects;
+        details::GCRootPtrBase listHead; 
+        details::GCHandleArea handles;      // of GCHandleScope, per thread in a shared heap
+        friend class GCHandleScope;
+        details::GCHandleArea* handleArea() {
+            return sharedHeap ? &(threadContext()->handles) : &handles;
+        }
+        std::vector<details::GCHandleArea*> handleAreas();
+
+        std::size_t objectNum;
+        GCStatistics lastGC;
+
+        std::size_t mark();     // returns the number of marked objects
+        void scanRoots(GCMarker &m);
+        void finishMarking(std::size_t pauseStart);
+        // `deferred`: the dead objects are left to lazy sweeping, objectBytes still counts them
+        void endCycle(std::size_t totalNum, std::size_t totalBytes, std::size_t notCollected, bool deferred,
+            std::size_t markTime, std::size_t elapsedTime, std::size_t endTime);
+        void reportCycle();
+        void sweep();
+        void startSweep();
+        void sweepPage(details::GCPage *page);
+        void sweepTrivialPage(details::GCPage *page, std::size_t words);
+        void releaseTrivial(details::GCPage *page, std::size_t word, std::uint64_t dead) noexcept;
+        std::size_t sweepNextPage(std::size_t sizeClass);
+        bool shouldCollect() const ;
+    };
+
+    //===================================
+    // * Class GCTraceRecorder
+    // * Records the collections of a collector as Chrome trace events,
+    // * for chrome://tracing or Perfetto next to traces of the program
+    //===================================
+    class GCTraceRecorder
+    {
+    public:
+        explicit GCTraceRecorder(GarbageCollector &gc);
+        ~GCTraceRecorder();     // before the collector
+        GCTraceRecorder(const GCTraceRecorder&) = delete;
+        GCTraceRecorder& operator=(const GCTraceRecorder&) = delete;
+
+        // a JSON object of the Trace Event Format, timestamps are
+        // std::chrono::steady_clock microseconds, tid is the collecting thread
+        void write(std::ostream &out) const;
+        void clear();
+
+    private:
+        struct Record {
+            GCStatistics stats;
+            std::size_t thread;
+        };
+
+        GarbageCollector &gc;
+        std::size_t callbackId;
+        mutable std::mutex lock;
+        std::vector<Record> records;
+    };
+
+    //===================================
+    // * Class GCHeapProfiler
+    // * Samples allocations by type and, optionally, call stack and counts the live objects
+    // * of each type while full collections mark; a collector has at most one.
+    // * Without a profiler allocations pay nothing for it, with one an allocation is sampled
+    // * about every `sampleBytes`; allocations of a shared heap are not sampled
+    //===================================
+    class GCHeapProfiler
+    {
+    public:
+        // up to `stackDepth` return addresses are kept with each sample where the platform
+        // captures backtraces, 0 tells sites by type only
+        explicit GCHeapProfiler(GarbageCollector &gc, 
+            std::size_t sampleBytes = 512 * 1024, std::size_t stackDepth = 0);
+        ~GCHeapProfiler();      // before the collector
+        GCHeapProfiler(const GCHeapProfiler&) = delete;
+        GCHeapProfiler& operator=(const GCHeapProfiler&) = delete;
+
+        struct TypeCount {
+            std::string type;
+            std::size_t objects;
+            std::size_t bytes;
+        };
+
+        // live objects of each type found by the last full collection, most bytes first
+        std::vector<TypeCount> getCensus() const;
+
+        // allocation sites with their estimated allocated and live objects and bytes, most live bytes first
+        void write(std::ostream &out) const;
+
+        // the legacy heap profile format read by pprof, sites are the captured stacks
+        // and the mapped libraries of the process follow, to be symbolized against the program
+        void writePprof(std::ostream &out) const;
+
+        // the census as text, most bytes first
+        void writeCensus(std::ostream &out) const;
+
+        // forgets the sites and their samples
+        void clear();
+
+    private:
+        friend class GarbageCollector;
+
+        struct Site {
+            const char *type;
+            std::vector<void*> stack;
+            std::size_t sampledNum;     // samples and the bytes of their objects
+            std::size_t sampledBytes;
+            std::size_t liveNum;        // samples not found dead
+            std::size_t liveBytes;
+        };
+
+        struct Sample {
+            GCObject *object;
+            std::size_t site;
+            std::size_t bytes;
+        };
+
+        GarbageCollector &gc;
+        std::size_t sampleBytes;
+        std::size_t stackDepth;
+        std::uint64_t random;       // state of the sampling intervals
+        std::vector<Site> sites;
+        std::unordered_map<std::string, std::size_t> siteIndex;    // by type and stack
+        std::vector<Sample> samples;        // objects live at the last collection or allocated since
+        details::GCCensus marking;          // filled by the running full collection
+        details::GCCensus census;           // of the last full collection
+
+        std::size_t nextInterval();         // exponentially distributed bytes until the next sample
+        void sample(GCObject *object, std::size_t bytes, const char *type);
+        void collected(GCMarker &m);        // drops the dead samples, takes the census of a full collection
+        double scale(std::size_t num, std::size_t bytes) const;    // inverse probability of the samples
+    };
+
+    //===================================
+    // * Class GCThreadScope
+    // * Attaches the current thread to a shared heap while in scope
+    //===================================
+    class GCThreadScope
+    {
+    public:
+        explicit GCThreadScope(GarbageCollector &gc) : gc(gc) { gc.attachThread(); }
+        ~GCThreadScope() { gc.detachThread(); }
+        GCThreadScope(const GCThreadScope&) = delete;
+        GCThreadScope& operator=(const GCThreadScope&) = delete;
+
+    private:
+        GarbageCollector &gc;
+    };
+
+    //===================================
+    // * Class GCSafeRegion
+    // * Other threads may collect while in scope, e.g. around a blocking call
+    //===================================
+    class GCSafeRegion
+    {
+    public:
+        explicit GCSafeRegion(GarbageCollector &gc) : gc(gc) { gc.enterSafeRegion(); }
+        ~GCSafeRegion() { gc.leaveSafeRegion(); }
+        GCSafeRegion(const GCSafeRegion&) = delete;
+        GCSafeRegion& operator=(const GCSafeRegion&) = delete;
+
+    private:
+        GarbageCollector &gc;
+    };
+
+    //===================================
+    // * Struct GCGroupStatistics
+    //===================================
+    struct GCGroupStatistics {
+        GCGroupStatistics() : members(0), heapBytes(0), collections(0), backgroundCollections(0),
+            failedCollections(0), limitRequests(0), pauseTime(0), collectedBytes(0) {}
+        std::size_t members;
+        std::size_t heapBytes;              // of the members, as last reported
+        std::size_t collections;            // of the members while in the group, wherever they ran
+        std::size_t backgroundCollections;  // run by the threads of the group to the end
+        std::size_t failedCollections;      // run by them and thrown out of, left to the owner
+        std::size_t limitRequests;          // collections asked for by the group heap limit
+        std::size_t pauseTime;              // of those collections, in the ticks of GCStatistics
+        std::size_t collectedBytes;
+    };
+
+    //===================================
+    // * Class GCGroup
+    // * Independent collectors whose collections are scheduled together: threads of the group
+    // * collect a member while its owner thread is parked in a GCSafeRegion, and the heaps
+    // * of the members together are kept near a group-wide limit
+    //===================================
+    class GCGroup
+    {
+    public:
+        // `threads` collect parked members, 0 for one per hardware thread
+        explicit GCGroup(unsigned threads = 1);
+        ~GCGroup();     // after its members have left it
+        GCGroup(const GCGroup&) = delete;
+        GCGroup& operator=(const GCGroup&) = delete;
+
+        // called by the owner thread of the collector, a collector is in at most one group
+        // and leaves it when destroyed; collections run by the group call the event
+        // callbacks of the member on a thread of the group
+        void add(GarbageCollector &gc);
+        void remove(GarbageCollector &gc);      // waits for a collection of the member to end
+
+        // members report their heap bytes when they collect, park or have allocated another MiB;
+        // once the reports reach `bytes` together every member collects once, a parked one
+        // on a thread of the group and a running one at its next checkPoint(); 0 for no limit
+        void setHeapLimit(std::size_t bytes);
+
+        // a member parked after allocating at least `bytes` since its last collection is
+        // collected even if its own budget is not used up; SIZE_MAX leaves it to its budget
+        void setIdleThreshold(std::size_t bytes);
+
+        // waits until no collection of a parked member is waiting or running
+        void wait();
+
+        GCGroupStatistics getStatistics() const;
+
+    private:
+        details::GCGroupState *state;
+    };
+
+    //===================================
+    // * Write barrier for pointers stored into collectable objects,
+    // * e.g. after inserting into a GCContainer
+    //===================================
+    template <typename T>
+    inline void writeBarrier(T *target) {
+        if (target != nullptr) {
+            target->GCGetMaster()->writeBarrier(target);
+        }
+    }
+
+    // precise form for generational collection
+    template <typename T>
+    inline void writeBarrier(const GCObject *owner, T *target) {
+        if (target != nullptr) {
+            target->GCGetMaster()->writeBarrier(owner, target);
+        }
+    }
+
+    //===================================
+    // * Class GCField
+    // * Pointer field of a collectable object, assignment calls the write barrier
+    // * Initialization does not need it, a new object is traced by the running cycle
+    //===================================
+    template <typename T>
+    class GCField
+    {
+    public:
+        GCField(T *p = nullptr) noexcept : ptr(p) {}
+        GCField(const GCField<T> &field) noexcept : ptr(field.ptr) {}
+
+        GCField<T>& operator=(T *p) {
+            writeBarrier(p);
+            this->ptr = p;
+            return *this;
+        }
+
+        GCField<T>& operator=(const GCField<T> &field) {
+            return *this = field.ptr;
+        }
+
+        T* get() const noexcept { return ptr; }
+        T* operator->() const noexcept { return ptr; }
+        T& operator*() const noexcept { return *ptr; }
+        operator T*() const noexcept { return ptr; }
+
+    private:
+        friend class GCMarker;
+        T *ptr;
+    };
+
+    template<typename T>
+    inline void GCMarker::markField(const GCField<T> &field) {
+        markField(field.ptr);
+    }
+
+    template <typename T>
+    inline void GCArray<T>::set(std::size_t i, T value) {
+        data()[i] = value;
+        barrier(value, std::is_pointer<T>());
+    }
+
+    //===================================
+    // * Class GCRootPtr
+    // * Template class, object type is specified 
+    // * supposed to guarantee type safety
+    //===================================
+    template <typename Ty = GCObject>
+    class GCRootPtr: public details::GCRootPtrBase
+    {
+        CHECK_GCOBJECT_TYPE(Ty);
+    public:
+        explicit GCRootPtr(GarbageCollector *master)
+            : GCRootPtrBase(nullptr, master) {}
+        GCRootPtr(Ty *ptr)
+            : GCRootPtrBase(ptr, ptr->GCGetMaster()) {}
+
+        GCRootPtr() = delete;
+        GCRootPtr(const GCRootPtr<Ty> & gcrp)
+            : GCRootPtrBase(gcrp) {}
+
+        template <typename Object>
+        GCRootPtr(const GCRootPtr<Object> & gcrp)
+            : GCRootPtrBase(gcrp) {
+            CHECK_POINTER_CONVERTIBLE(Object, Ty);
+        }
+
+        // the moved-from root is null and no longer a root until something is assigned to it
+        GCRootPtr(GCRootPtr<Ty> && gcrp) noexcept
+            : GCRootPtrBase(std::move(gcrp)) {}
+
+        template <typename Object>
+        GCRootPtr(GCRootPtr<Object> && gcrp) noexcept
+            : GCRootPtrBase(std::move(gcrp)) {
+            CHECK_POINTER_CONVERTIBLE(Object, Ty);
+        }
+
+        GCRootPtr<Ty>& operator=(std::nullptr_t) noexcept {
+            this->ptr = nullptr;
+            return *this;
+        }
+
+        GCRootPtr<Ty>& operator=(const GCRootPtr<Ty> & gcrp) {
+            assign(gcrp.get());
+            return *this;
+        }
+
+        template <typename Object>
+        GCRootPtr<Ty>& operator=(const GCRootPtr<Object> & gcrp) {
+            CHECK_POINTER_CONVERTIBLE(Object, Ty);
+            assign(gcrp.get());
+            return *this;
+        }
+
+        GCRootPtr<Ty>& operator=(GCRootPtr<Ty> && gcrp) {
+            assign(gcrp.get());
+            gcrp.ptr = nullptr;
+            return *this;
+        }
+
+        // NOTICE: *objp MUST be allocated by the same GarbageCollector
+        template <typename Object>
+        GCRootPtr<Ty>& operator=(Object* objp) {
+            CHECK_POINTER_CONVERTIBLE(Object, Ty);
+            assign(objp);
+            return *this;
+        }
+
+        template <typename Object>
+        void reset(Object* objp) {
+            CHECK_POINTER_CONVERTIBLE(Object, Ty);
+            assign(objp);
+        }
+
+        void reset() noexcept {  this->ptr = nullptr;  }
+
+        void swap(GCRootPtr<Ty>& r) {
+            auto tmp = r.get();
+            r.assign(this->get());
+            this->assign(tmp);
         }
 
         /* Does not propagate `const` by default */
@@ -337,15 +2143,159 @@ namespace TinyGC
         Ty* operator->() const noexcept { return get(); }
         Ty& operator*() const noexcept { return *get(); }
         operator Ty*() const noexcept { return get(); }
+
+    private:
+        // a moved-from root links itself again, which may throw like constructing a root
+        void assign(Ty *objp) {
+            if (this->detached() && objp != nullptr) {
+                objp->GCGetMaster()->addRoot(this);
+            }
+            this->ptr = objp;
+        }
     };
     
-    // relies on compiler optimizations to eliminate copy
-    // recomment C++17 which guarantees no copy
+    // the result is moved if the copy is not elided
     template<typename T>
     GCRootPtr<T> make_root_ptr(T *ptr) {
         return ptr;
     }
 
+    //===================================
+    // * Class GCWeakPtr
+    // * Does not keep its object alive, reads nullptr once the object has been collected
+    // * Linked into a list of weak pointers of the collector, like GCRootPtr
+    //===================================
+    template <typename Ty = GCObject>
+    class GCWeakPtr: private details::GCRootPtrBase
+    {
+        CHECK_GCOBJECT_TYPE(Ty);
+    public:
+        explicit GCWeakPtr(GarbageCollector *master) {
+            master->addWeakRef(this);
+        }
+        GCWeakPtr(Ty *ptr) {
+            ptr->GCGetMaster()->addWeakRef(this);
+            this->ptr = ptr;
+        }
+
+        GCWeakPtr() = delete;
+        GCWeakPtr(const GCWeakPtr<Ty> &weak)
+            : GCRootPtrBase(weak) {}
+
+        GCWeakPtr(GCWeakPtr<Ty> &&weak) noexcept
+            : GCRootPtrBase(std::move(weak)) {}
+
+        GCWeakPtr<Ty>& operator=(const GCWeakPtr<Ty> &weak) {
+            assign(weak.get());
+            return *this;
+        }
+
+        GCWeakPtr<Ty>& operator=(std::nullptr_t) noexcept {
+            this->ptr = nullptr;
+            return *this;
+        }
+
+        // NOTICE: *objp MUST be allocated by the same GarbageCollector
+        template <typename Object>
+        GCWeakPtr<Ty>& operator=(Object* objp) {
+            CHECK_POINTER_CONVERTIBLE(Object, Ty);
+            assign(objp);
+            return *this;
+        }
+
+        void reset() noexcept { this->ptr = nullptr; }
+
+        // the object if it is still alive, to be rooted before the next collection
+        Ty* get() const noexcept { return reinterpret_cast<Ty*>(ptr); }
+        bool expired() const noexcept { return ptr == nullptr; }
+
+    private:
+        friend class GarbageCollector;
+
+        // a moved-from weak pointer registers itself again, which may throw like constructing one
+        void assign(Ty *objp) {
+            if (this->detached() && objp != nullptr) {
+                objp->GCGetMaster()->addWeakRef(this);
+            }
+            this->ptr = objp;
+        }
+    };
+
+    //===================================
+    // * Class GCHandle
+    // * A root in a slot of the innermost GCHandleScope, valid until that scope ends;
+    // * copies refer to the same slot
+    //===================================
+    template <typename T>
+    class GCHandle
+    {
+        CHECK_GCOBJECT_TYPE(T);
+    public:
+        template <typename Object>
+        GCHandle(const GCHandle<Object> &handle) noexcept
+            : slot(handle.slot) {
+            CHECK_POINTER_CONVERTIBLE(Object, T);
+        }
+
+        GCHandle<T>& operator=(const GCHandle<T> &handle) noexcept {
+            *slot = *(handle.slot);
+            return *this;
+        }
+
+        // NOTICE: *objp MUST be allocated by the same GarbageCollector
+        template <typename Object>
+        GCHandle<T>& operator=(Object *objp) noexcept {
+            CHECK_POINTER_CONVERTIBLE(Object, T);
+            *slot = objp;
+            return *this;
+        }
+
+        GCHandle<T>& operator=(std::nullptr_t) noexcept {
+            *slot = nullptr;
+            return *this;
+        }
+
+        T* get() const noexcept { return static_cast<T*>(*slot); }
+        T* operator->() const noexcept { return get(); }
+        T& operator*() const noexcept { return *get(); }
+        operator T*() const noexcept { return get(); }
+
+    private:
+        friend class GCHandleScope;
+        template <typename Object>
+        friend class GCHandle;
+
+        explicit GCHandle(GCObject **slot) noexcept : slot(slot) {}
+        GCObject **slot;
+    };
+
+    //===================================
+    // * Class GCHandleScope
+    // * Roots kept in a contiguous array of the collector, of the thread in a shared heap;
+    // * a handle costs a store and the scope gives all of its handles back at once
+    //===================================
+    class GCHandleScope
+    {
+    public:
+        explicit GCHandleScope(GarbageCollector &gc)
+            : area(gc.handleArea()), used(area->used), top(area->top) {}
+        ~GCHandleScope() { area->restore(used, top); }
+        GCHandleScope(const GCHandleScope&) = delete;
+        GCHandleScope& operator=(const GCHandleScope&) = delete;
+
+        // must be the innermost scope of the thread for this collector
+        template <typename T>
+        GCHandle<T> handle(T *ptr) {
+            CHECK_GCOBJECT_TYPE(T);
+            return GCHandle<T>(area->push(ptr));
+        }
+
+    private:
+        details::GCHandleArea *area;
+        std::size_t used;
+        GCObject **top;
+    };
+
 #define DEFINE_OPERATOR(type, op) \
     template<typename Left, typename Right>\
     inline type operator op(const GCRootPtr<Left>& left, const GCRootPtr<Right>& right) noexcept {\